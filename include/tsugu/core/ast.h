@@ -8,6 +8,7 @@
 #define TSUGU_CORE_AST_H
 
 #include <tsugu/core/frame.h>
+#include <tsugu/core/insttbl.h>
 #include <tsugu/core/token.h>
 #include <tsugu/core/tyenv.h>
 
@@ -28,6 +29,17 @@ typedef enum {
   TSG_STMT_EXPR,
 } tsg_stmt_kind_t;
 
+typedef enum {
+  // reads nothing from outer frames and takes no `$outer`
+  TSG_FUNC_CLOSED,
+  // reads a few outer members, which every call passes after the arguments
+  TSG_FUNC_LIFTED,
+  // reads outer members through the chain of frames from its `$outer`
+  TSG_FUNC_CLOSURE,
+} tsg_func_conv_t;
+
+#define TSG_FUNC_MAX_CAPTURES 4
+
 typedef struct tsg_ast_s tsg_ast_t;
 typedef struct tsg_block_s tsg_block_t;
 typedef struct tsg_func_s tsg_func_t;
@@ -48,6 +60,10 @@ typedef struct tsg_decl_node_s tsg_decl_node_t;
 struct tsg_ast_s {
   tsg_func_t* root;
   tsg_tyenv_t* tyenv;
+  // every type the verifier gives the AST
+  tsg_typetbl_t* types;
+  // every instance the verifier creates, the root first
+  tsg_insttbl_t* instances;
 };
 
 tsg_ast_t* tsg_ast_create(void);
@@ -68,6 +84,9 @@ struct tsg_func_s {
   tsg_tyvar_t* ftype;
   tsg_decl_list_t* params;
   tsg_block_t* body;
+  tsg_func_conv_t conv;
+  tsg_member_t* captures[TSG_FUNC_MAX_CAPTURES];
+  int32_t n_captures;
 };
 
 tsg_func_t* tsg_func_create(void);
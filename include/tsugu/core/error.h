@@ -29,6 +29,8 @@ struct tsg_errlist_s {
 
 void tsg_errlist_init(tsg_errlist_t* errlist);
 void tsg_errlist_release(tsg_errlist_t* errlist);
+// moves the errors of `from` to the end of `errlist`, leaving `from` empty
+void tsg_errlist_splice(tsg_errlist_t* errlist, tsg_errlist_t* from);
 void tsg_error(tsg_errlist_t* errlist, const tsg_source_range_t* loc,
                const char* format, ...);
 void tsg_errorv(tsg_errlist_t* errlist, const tsg_source_range_t* loc,
@@ -29,6 +29,12 @@ struct tsg_member_s {
   int32_t depth;
   int32_t index;
   tsg_tyvar_t* tyvar;
+  // referenced from a nested function, so it must live in the frame
+  bool captured;
+  // read other than as the callee of a call
+  bool escapes;
+  // the function this member names, if any
+  struct tsg_func_s* func;
 };
 
 struct tsg_member_node_s {
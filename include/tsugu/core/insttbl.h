@@ -0,0 +1,45 @@
+/*--------------------------------------- vi: set ft=c ts=2 sw=2 et: --*-c-*--*/
+/**
+ * @file insttbl.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_CORE_INSTTBL_H
+#define TSUGU_CORE_INSTTBL_H
+
+#include <tsugu/core/tyenv.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tsg_instance_s tsg_instance_t;
+typedef struct tsg_insttbl_s tsg_insttbl_t;
+
+struct tsg_instance_s {
+  tsg_func_t* func;
+  tsg_tyenv_t* env;
+};
+
+/**
+ * Every instance of one AST, in the order the verifier created them.
+ *
+ * An instance is numbered when it is added, from zero up, and the number
+ * is kept in `env->id`, so that the engines can index flat tables by it.
+ * The root is the first one. The envs stay owned by the tymaps of their
+ * polymorphic types, and the root env by the AST.
+ */
+tsg_insttbl_t* tsg_insttbl_create(void);
+void tsg_insttbl_destroy(tsg_insttbl_t* insts);
+
+int32_t tsg_insttbl_add(tsg_insttbl_t* insts, tsg_func_t* func,
+                        tsg_tyenv_t* env);
+int32_t tsg_insttbl_size(const tsg_insttbl_t* insts);
+// valid until the next add
+const tsg_instance_t* tsg_insttbl_get(const tsg_insttbl_t* insts, int32_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,6 +33,14 @@ struct tsg_tyenv_s {
   tsg_tyset_t* tyset;
   tsg_type_t** arr;
   int32_t size;
+  // this env and its outer ones, indexed by the depth of their tysets, so
+  // that a tyvar is found without walking `outer`
+  tsg_tyenv_t** display;
+  // the number of the instance in the insttbl of its AST, -1 until added
+  int32_t id;
+  // set by the verifier when the instance of this env is a function of its
+  // int and bool arguments alone, returning an int or a bool
+  bool pure;
 };
 
 tsg_tyset_t* tsg_tyset_create(tsg_tyset_t* outer);
@@ -30,10 +30,15 @@ typedef struct tsg_tymap_s tsg_tymap_t;
 
 typedef struct tsg_type_s tsg_type_t;
 typedef struct tsg_type_arr_s tsg_type_arr_t;
+typedef struct tsg_typetbl_s tsg_typetbl_t;
 
 struct tsg_type_func_s {
   tsg_type_arr_t* params;
   tsg_type_t* ret;
+  // the instance this is the type of; NULL on a signature
+  tsg_tyenv_t* env;
+  // the canonical signature of `params` and `ret`, once `ret` is set
+  tsg_type_t* sig;
 };
 
 struct tsg_type_poly_s {
@@ -49,8 +54,6 @@ struct tsg_type_s {
     struct tsg_type_func_s func;
     struct tsg_type_poly_s poly;
   };
-
-  int32_t nrefs;
 };
 
 struct tsg_type_arr_s {
@@ -58,19 +61,57 @@ struct tsg_type_arr_s {
   size_t size;
 };
 
-tsg_type_t* tsg_type_create(tsg_type_kind_t kind);
-void tsg_type_retain(tsg_type_t* type);
-void tsg_type_release(tsg_type_t* type);
+/**
+ * Owns every type of one AST, and frees them all at once with it.
+ *
+ * Bools and ints are canonical, a single type each, so they compare equal
+ * by pointer. A function type is created for each instance, which it
+ * points to, before its return type is known. Setting the return type
+ * interns the parameters and the return type as a signature, a function
+ * type without an instance that is its own `sig`, one per distinct pair.
+ * Function types then compare equal by their signature pointers, and
+ * until then only to themselves. Polymorphic types own the tymap of their
+ * instances.
+ */
+tsg_typetbl_t* tsg_typetbl_create(void);
+void tsg_typetbl_destroy(tsg_typetbl_t* types);
+
+/**
+ * A table for types made on another thread than the one using `parent`.
+ *
+ * It shares the bools and ints of `parent`, and reads nothing else of it,
+ * but interns its own signatures. Joining moves its types into `parent`,
+ * where they stay at the same addresses, and interns their signatures
+ * again there; destroying the fork instead drops them.
+ */
+tsg_typetbl_t* tsg_typetbl_fork(tsg_typetbl_t* parent);
+// frees `fork`
+void tsg_typetbl_join(tsg_typetbl_t* types, tsg_typetbl_t* fork);
+
+// the bool or int type
+tsg_type_t* tsg_typetbl_prim(tsg_typetbl_t* types, tsg_type_kind_t kind);
+tsg_type_t* tsg_typetbl_pend(tsg_typetbl_t* types);
+// of the instance `env`, `params` is taken over, the return type is pending
+tsg_type_t* tsg_typetbl_func(tsg_typetbl_t* types, tsg_type_arr_t* params,
+                             tsg_tyenv_t* env);
+// fills in the return type of `func`, NULL if it failed to verify
+void tsg_typetbl_func_ret(tsg_typetbl_t* types, tsg_type_t* func,
+                          tsg_type_t* ret);
+tsg_type_t* tsg_typetbl_poly(tsg_typetbl_t* types, tsg_func_t* func,
+                             tsg_tyenv_t* outer);
+
 bool tsg_type_equals(tsg_type_t* a, tsg_type_t* b);
+size_t tsg_type_hash(tsg_type_t* type);
 
 tsg_type_t* tsg_type_unify(tsg_type_t* a, tsg_type_t* b);
-tsg_type_t* tsg_type_binary(tsg_token_kind_t op, tsg_type_t* lhs,
-                            tsg_type_t* rhs);
+tsg_type_t* tsg_type_binary(tsg_typetbl_t* types, tsg_token_kind_t op,
+                            tsg_type_t* lhs, tsg_type_t* rhs);
 
 tsg_type_arr_t* tsg_type_arr_create(size_t size);
 tsg_type_arr_t* tsg_type_arr_dup(const tsg_type_arr_t* src);
 void tsg_type_arr_destroy(tsg_type_arr_t* arr);
 bool tsg_type_arr_equals(tsg_type_arr_t* a, tsg_type_arr_t* b);
+size_t tsg_type_arr_hash(tsg_type_arr_t* arr);
 
 #ifdef __cplusplus
 }
@@ -21,7 +21,18 @@ typedef struct tsg_verifier_s tsg_verifier_t;
 tsg_verifier_t* tsg_verifier_create(void);
 void tsg_verifier_destroy(tsg_verifier_t* verifier);
 
+/**
+ * Verifies instances ahead on `n_threads` threads besides the calling one,
+ * where the platform has threads; 0, the default, verifies on the calling
+ * thread alone. The result is the same either way: the same instances in
+ * the same order, with the same types, and the same errors in the same
+ * order.
+ */
+void tsg_verifier_set_threads(tsg_verifier_t* verifier, int32_t n_threads);
+
 bool tsg_verifier_verify(tsg_verifier_t* verifier, tsg_ast_t* ast);
+tsg_type_t* tsg_verifier_instantiate(tsg_verifier_t* verifier, tsg_ast_t* ast,
+                                     tsg_func_t* func, tsg_type_arr_t* args);
 void tsg_verifier_error(const tsg_verifier_t* verifier, tsg_errlist_t* errors);
 
 #ifdef __cplusplus
@@ -9,13 +9,135 @@
 
 #include <tsugu/core/ast.h>
 #include <tsugu/core/tyenv.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct tsg_engine_s tsg_engine_t;
+typedef struct tsg_engine_config_s tsg_engine_config_t;
+typedef struct tsg_engine_stats_s tsg_engine_stats_t;
+typedef struct tsg_program_s tsg_program_t;
+typedef struct tsg_function_s tsg_function_t;
+typedef struct tsg_value_s tsg_value_t;
+
+typedef enum {
+  TSG_VALUE_BOOL,
+  TSG_VALUE_INT,
+} tsg_value_kind_t;
+
+struct tsg_engine_config_s {
+  // compile each function instance on its first call instead of up front
+  bool lazy;
+  // programs of at most this many AST nodes start in the interpreter;
+  // 0 always compiles
+  int32_t interp_max_nodes;
+  // interpreted calls of an instance before it is compiled; 0 only compiles
+  // instances called too deep in the interpreter
+  int32_t tier_threshold;
+  // compile hot instances on a background thread
+  bool tier_background;
+  // directory of the compiled-code cache; NULL disables it
+  const char* cache_dir;
+  // codegen threads; above 1, eager programs get one module per instance
+  int32_t compile_threads;
+  // write /tmp/perf-<pid>.map and register the JIT with perf and gdb
+  bool profile;
+  // 0 to 3: the IR pass pipeline and codegen level of the JIT
+  int32_t opt_level;
+  // from -O1, calls of closed functions with constant arguments are run at
+  // compile time within this many evaluated expressions; 0 disables it
+  int32_t eval_steps;
+  // bytes of frames and memoized calls such a compile-time run may use
+  int32_t eval_memory;
+  // from -O1, pure instances that call themselves more than once keep the
+  // results of their calls in a table of this many slots; 0 disables it
+  int32_t memo_slots;
+  // count the hits and misses of those tables, for the engine stats
+  bool memo_counters;
+  // compiled code counts its calls, calls of each instance and the times
+  // each if goes either way into the engine's profile
+  bool pgo_instrument;
+  // runs of a compiled program after which it is compiled again with the
+  // counts of the profile; 0 never recompiles
+  int32_t pgo_warmup;
+  // print the LLVM IR of each module to stderr as it is built, after the
+  // calls folded at compile time
+  bool dump_ir;
+};
+
+struct tsg_engine_stats_s {
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  // time spent looking up and reading cached objects
+  double cache_load_ms;
+  // calls answered by memo tables, and calls that had to run
+  uint64_t memo_hits;
+  uint64_t memo_misses;
+};
+
+void tsg_engine_config_init(tsg_engine_config_t* config);
+
+tsg_engine_t* tsg_engine_create(const tsg_engine_config_t* config);
+void tsg_engine_destroy(tsg_engine_t* engine);
+void tsg_engine_get_stats(tsg_engine_t* engine, tsg_engine_stats_t* stats);
+
+// Each program an engine runs, loads or compiles gets JIT memory of its own
+// that is only given back when the engine is destroyed, not with the
+// program. Hosts that keep running new programs should recycle the engine
+// every so many of them, as the server does with `--max-programs`.
+// Returns -1 if the program cannot be compiled, which a program may also
+// return; tsg_engine_try_run tells the two apart.
+int32_t tsg_engine_run(tsg_engine_t* engine, tsg_ast_t* ast);
+bool tsg_engine_try_run(tsg_engine_t* engine, tsg_ast_t* ast,
+                        int32_t* result);
 int32_t tsg_engine_run_ast(tsg_ast_t* ast);
 
+struct tsg_value_s {
+  tsg_value_kind_t kind;
+
+  union {
+    bool b;
+    int32_t i;
+  };
+};
+
+// Compile once, call many times. Loading evaluates the top level once; the
+// AST must outlive the program. Function handles are owned by the program
+// and are instantiated for the given parameter kinds on first lookup. They
+// live in the frame of that one evaluation, so a loaded program is never
+// run again: tsg_program_run refuses it and returns -1.
+tsg_program_t* tsg_engine_load(tsg_engine_t* engine, tsg_ast_t* ast);
+void tsg_program_destroy(tsg_program_t* program);
+int32_t tsg_program_result(const tsg_program_t* program);
+
+tsg_function_t* tsg_program_function(tsg_program_t* program, const char* name,
+                                     const tsg_value_kind_t* params,
+                                     size_t n_params);
+tsg_value_kind_t tsg_function_result_kind(const tsg_function_t* function);
+bool tsg_function_call(const tsg_function_t* function, const tsg_value_t* args,
+                       tsg_value_t* ret);
+
+// Compile once, run many times. The whole program is compiled, never
+// interpreted, and may then be run from several threads at once. Returns
+// NULL if it does not compile. Functions cannot be looked up in it.
+tsg_program_t* tsg_engine_compile(tsg_engine_t* engine, tsg_ast_t* ast);
+int32_t tsg_program_run(tsg_program_t* program);
+
+// Profiles are keyed by instance name and source position. Loading adds
+// to the counts the engine holds; code compiled after that takes branch
+// weights from them and, from -O1, inlining decisions.
+bool tsg_engine_load_profile(tsg_engine_t* engine, const char* path);
+bool tsg_engine_save_profile(tsg_engine_t* engine, const char* path);
+
+// ahead-of-time compilation; the output prints the result of `$main`, and
+// a saved profile may be given to compile with, or NULL
+bool tsg_engine_emit_object(tsg_ast_t* ast, const char* path,
+                            const char* profile_path);
+bool tsg_engine_emit_executable(tsg_ast_t* ast, const char* path,
+                                const char* profile_path);
+
 #ifdef __cplusplus
 }
 #endif
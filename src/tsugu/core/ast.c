@@ -22,6 +22,8 @@ tsg_ast_t* tsg_ast_create(void) {
 
   ast->root = NULL;
   ast->tyenv = NULL;
+  ast->types = tsg_typetbl_create();
+  ast->instances = tsg_insttbl_create();
 
   return ast;
 }
@@ -32,7 +34,9 @@ void tsg_ast_destroy(tsg_ast_t* ast) {
   }
 
   tsg_func_destroy(ast->root);
+  tsg_insttbl_destroy(ast->instances);
   tsg_tyenv_destroy(ast->tyenv);
+  tsg_typetbl_destroy(ast->types);
   tsg_free(ast);
 }
 
@@ -64,6 +68,8 @@ tsg_func_t* tsg_func_create(void) {
   func->ftype = NULL;
   func->params = NULL;
   func->body = NULL;
+  func->conv = TSG_FUNC_CLOSURE;
+  func->n_captures = 0;
 
   return func;
 }
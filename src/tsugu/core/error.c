@@ -31,6 +31,21 @@ void tsg_errlist_release(tsg_errlist_t* errlist) {
   tsg_errlist_init(errlist);
 }
 
+void tsg_errlist_splice(tsg_errlist_t* errlist, tsg_errlist_t* from) {
+  if (from->head == NULL) {
+    return;
+  }
+
+  if (errlist->head == NULL) {
+    errlist->head = from->head;
+  } else {
+    errlist->tail->next = from->head;
+  }
+  errlist->tail = from->tail;
+
+  tsg_errlist_init(from);
+}
+
 void tsg_error(tsg_errlist_t* errlist, const tsg_source_range_t* loc,
                const char* format, ...) {
   va_list args;
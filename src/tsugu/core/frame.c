@@ -71,6 +71,9 @@ tsg_member_t* tsg_member_create(tsg_frame_t* frame) {
   member->depth = frame->depth;
   member->index = frame->size;
   member->tyvar = NULL;
+  member->captured = false;
+  member->escapes = false;
+  member->func = NULL;
 
   frame->size += 1;
 
@@ -0,0 +1,73 @@
+/*--------------------------------------- vi: set ft=c ts=2 sw=2 et: --*-c-*--*/
+/**
+ * @file insttbl.c
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include <tsugu/core/insttbl.h>
+
+#include <tsugu/core/memory.h>
+#include <tsugu/core/platform.h>
+
+struct tsg_insttbl_s {
+  tsg_instance_t* arr;
+  int32_t capacity;
+  int32_t size;
+};
+
+#define INSTTBL_MIN_CAPACITY 16
+
+tsg_insttbl_t* tsg_insttbl_create(void) {
+  tsg_insttbl_t* insts = tsg_malloc_obj(tsg_insttbl_t);
+
+  insts->arr = NULL;
+  insts->capacity = 0;
+  insts->size = 0;
+
+  return insts;
+}
+
+void tsg_insttbl_destroy(tsg_insttbl_t* insts) {
+  if (insts == NULL) {
+    return;
+  }
+
+  tsg_free(insts->arr);
+  tsg_free(insts);
+}
+
+int32_t tsg_insttbl_add(tsg_insttbl_t* insts, tsg_func_t* func,
+                        tsg_tyenv_t* env) {
+  tsg_assert(insts != NULL);
+  tsg_assert(env != NULL && env->id < 0);
+
+  if (insts->size == insts->capacity) {
+    int32_t capacity = insts->capacity > 0 ? insts->capacity * 2
+                                           : INSTTBL_MIN_CAPACITY;
+    tsg_instance_t* arr = tsg_malloc_arr(tsg_instance_t, capacity);
+    if (insts->size > 0) {
+      tsg_memcpy(arr, insts->arr, sizeof(tsg_instance_t) * insts->size);
+    }
+
+    tsg_free(insts->arr);
+    insts->arr = arr;
+    insts->capacity = capacity;
+  }
+
+  int32_t id = insts->size;
+  insts->arr[id].func = func;
+  insts->arr[id].env = env;
+  insts->size += 1;
+  env->id = id;
+
+  return id;
+}
+
+int32_t tsg_insttbl_size(const tsg_insttbl_t* insts) {
+  return insts->size;
+}
+
+const tsg_instance_t* tsg_insttbl_get(const tsg_insttbl_t* insts, int32_t id) {
+  tsg_assert(id >= 0 && id < insts->size);
+  return &(insts->arr[id]);
+}
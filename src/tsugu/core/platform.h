@@ -21,6 +21,27 @@ void* tsg_memcpy(void* dst, const void* src, size_t count);
 void* tsg_memset(void* dst, int ch, size_t count);
 size_t tsg_strlen(const char* str);
 
+typedef struct tsg_mutex_s tsg_mutex_t;
+typedef struct tsg_cond_s tsg_cond_t;
+typedef struct tsg_thread_s tsg_thread_t;
+
+// Threads for the core to spread work over. A platform without them
+// returns NULL from the create functions, and the core then does all of
+// its work on the calling thread.
+tsg_mutex_t* tsg_mutex_create(void);
+void tsg_mutex_destroy(tsg_mutex_t* mutex);
+void tsg_mutex_lock(tsg_mutex_t* mutex);
+void tsg_mutex_unlock(tsg_mutex_t* mutex);
+
+tsg_cond_t* tsg_cond_create(void);
+void tsg_cond_destroy(tsg_cond_t* cond);
+void tsg_cond_wait(tsg_cond_t* cond, tsg_mutex_t* mutex);
+void tsg_cond_broadcast(tsg_cond_t* cond);
+
+tsg_thread_t* tsg_thread_create(void (*entry)(void* arg), void* arg);
+// waits for the thread to return from `entry`, and frees it
+void tsg_thread_join(tsg_thread_t* thread);
+
 #ifdef NDEBUG
 #define tsg_assert(expr) ((void)(0))
 #else
@@ -16,6 +16,15 @@ struct tsg_resolver_s {
   tsg_scope_t* scope;
 };
 
+// what a function reads from frames outside of its own
+typedef struct {
+  int32_t depth;
+  tsg_member_t* members[TSG_FUNC_MAX_CAPTURES];
+  int32_t n_members;
+  bool linked;
+  bool nested;
+} outer_refs_t;
+
 static tsg_tyset_t* open_tyset(tsg_resolver_t* resolver);
 static void close_tyset(tsg_resolver_t* resolver, tsg_tyset_t* outer);
 static tsg_frame_t* open_frame(tsg_resolver_t* resolver);
@@ -43,9 +52,19 @@ static void resolve_expr_binary(tsg_resolver_t* resolver, tsg_expr_t* expr);
 static void resolve_expr_call(tsg_resolver_t* resolver, tsg_expr_t* expr);
 static void resolve_expr_ifelse(tsg_resolver_t* resolver, tsg_expr_t* expr);
 static void resolve_expr_ident(tsg_resolver_t* resolver, tsg_expr_t* expr);
+static void resolve_ident(tsg_resolver_t* resolver, tsg_expr_t* expr);
 
 static void resolve_expr_list(tsg_resolver_t* resolver, tsg_expr_list_t* list);
 
+static void convert_funcs(tsg_func_t* root);
+static bool convert_func(tsg_func_t* func, bool is_root);
+static bool convert_block(tsg_block_t* block);
+static bool convert_expr(tsg_expr_t* expr);
+static bool update_func_conv(tsg_func_t* func, bool is_root);
+static void add_outer_ref(outer_refs_t* refs, tsg_member_t* member);
+static void scan_block(outer_refs_t* refs, tsg_block_t* block);
+static void scan_expr(outer_refs_t* refs, tsg_expr_t* expr);
+
 tsg_resolver_t* tsg_resolver_create(void) {
   tsg_resolver_t* resolver = tsg_malloc_obj(tsg_resolver_t);
   if (resolver == NULL) {
@@ -146,7 +165,12 @@ void error(tsg_resolver_t* resolver, tsg_source_range_t* loc,
 
 bool tsg_resolver_resolve(tsg_resolver_t* resolver, tsg_ast_t* ast) {
   resolve_ast(resolver, ast);
-  return resolver->errors.head == NULL;
+  if (resolver->errors.head != NULL) {
+    return false;
+  }
+
+  convert_funcs(ast->root);
+  return true;
 }
 
 void resolve_ast(tsg_resolver_t* resolver, tsg_ast_t* ast) {
@@ -155,6 +179,7 @@ void resolve_ast(tsg_resolver_t* resolver, tsg_ast_t* ast) {
 
 void resolve_func_proto(tsg_resolver_t* resolver, tsg_func_t* func) {
   declare(resolver, func->decl);
+  func->decl->object->func = func;
 }
 
 void resolve_func_body(tsg_resolver_t* resolver, tsg_func_t* func) {
@@ -165,6 +190,8 @@ void resolve_func_body(tsg_resolver_t* resolver, tsg_func_t* func) {
   func->tyset = resolver->tyset;
   func->frame = resolver->frame;
   func->ftype = tsg_tyvar_create(resolver->tyset);
+  func->conv = TSG_FUNC_CLOSED;
+  func->n_captures = 0;
 
   tsg_decl_node_t* node = func->params->head;
   while (node) {
@@ -262,7 +289,16 @@ void resolve_expr_binary(tsg_resolver_t* resolver, tsg_expr_t* expr) {
 
 void resolve_expr_call(tsg_resolver_t* resolver, tsg_expr_t* expr) {
   tsg_assert(expr != NULL && expr->kind == TSG_EXPR_CALL);
-  resolve_expr(resolver, expr->call.callee);
+
+  tsg_expr_t* callee = expr->call.callee;
+  if (callee->kind == TSG_EXPR_IDENT) {
+    // a function that is only called by name never escapes
+    resolve_ident(resolver, callee);
+    callee->tyvar = tsg_tyvar_create(resolver->tyset);
+  } else {
+    resolve_expr(resolver, callee);
+  }
+
   resolve_expr_list(resolver, expr->call.args);
   expr->call.ftype = tsg_tyvar_create(resolver->tyset);
 }
@@ -284,8 +320,20 @@ void resolve_expr_ifelse(tsg_resolver_t* resolver, tsg_expr_t* expr) {
 
 void resolve_expr_ident(tsg_resolver_t* resolver, tsg_expr_t* expr) {
   tsg_assert(expr != NULL && expr->kind == TSG_EXPR_IDENT);
+  resolve_ident(resolver, expr);
+
+  if (expr->ident.object != NULL) {
+    expr->ident.object->escapes = true;
+  }
+}
+
+void resolve_ident(tsg_resolver_t* resolver, tsg_expr_t* expr) {
   tsg_member_t* object = lookup(resolver, expr->ident.name);
   expr->ident.object = object;
+
+  if (object != NULL && object->depth < resolver->frame->depth) {
+    object->captured = true;
+  }
 }
 
 void resolve_expr_list(tsg_resolver_t* resolver, tsg_expr_list_t* list) {
@@ -295,3 +343,211 @@ void resolve_expr_list(tsg_resolver_t* resolver, tsg_expr_list_t* list) {
     node = node->next;
   }
 }
+
+/*
+ * Closure conversion. Every function starts out closed, and is demoted to
+ * lifted or to a closure while what it reads from outer frames says so,
+ * until nothing changes. Demotions only add to what others read, so this
+ * settles.
+ *
+ * A function is lifted when it defines no functions of its own, is only
+ * ever called by name, and reads at most TSG_FUNC_MAX_CAPTURES outer
+ * members, none of them closures. Calling a lifted function reads its
+ * captures at the call site, and calling a closure needs its frame.
+ */
+
+void convert_funcs(tsg_func_t* root) {
+  while (convert_func(root, true)) {
+  }
+}
+
+bool convert_func(tsg_func_t* func, bool is_root) {
+  bool changed = update_func_conv(func, is_root);
+  changed = convert_block(func->body) || changed;
+  return changed;
+}
+
+bool convert_block(tsg_block_t* block) {
+  bool changed = false;
+
+  tsg_func_node_t* func_node = block->funcs->head;
+  while (func_node != NULL) {
+    changed = convert_func(func_node->func, false) || changed;
+    func_node = func_node->next;
+  }
+
+  tsg_stmt_node_t* stmt_node = block->stmts->head;
+  while (stmt_node != NULL) {
+    tsg_stmt_t* stmt = stmt_node->stmt;
+    switch (stmt->kind) {
+      case TSG_STMT_VAL:
+        changed = convert_expr(stmt->val.expr) || changed;
+        break;
+
+      case TSG_STMT_EXPR:
+        changed = convert_expr(stmt->expr.expr) || changed;
+        break;
+    }
+    stmt_node = stmt_node->next;
+  }
+
+  return changed;
+}
+
+bool convert_expr(tsg_expr_t* expr) {
+  bool changed = false;
+
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      changed = convert_expr(expr->binary.lhs) || changed;
+      changed = convert_expr(expr->binary.rhs) || changed;
+      break;
+
+    case TSG_EXPR_CALL:
+      changed = convert_expr(expr->call.callee) || changed;
+      for (tsg_expr_node_t* node = expr->call.args->head; node;
+           node = node->next) {
+        changed = convert_expr(node->expr) || changed;
+      }
+      break;
+
+    case TSG_EXPR_IFELSE:
+      changed = convert_expr(expr->ifelse.cond) || changed;
+      changed = convert_block(expr->ifelse.thn) || changed;
+      changed = convert_block(expr->ifelse.els) || changed;
+      break;
+
+    case TSG_EXPR_IDENT:
+    case TSG_EXPR_NUMBER:
+      break;
+  }
+
+  return changed;
+}
+
+bool update_func_conv(tsg_func_t* func, bool is_root) {
+  outer_refs_t refs;
+  refs.depth = func->frame->depth;
+  refs.n_members = 0;
+  refs.linked = false;
+  refs.nested = false;
+  scan_block(&refs, func->body);
+
+  tsg_func_conv_t conv;
+  if (refs.n_members == 0 && refs.linked == false) {
+    conv = TSG_FUNC_CLOSED;
+  } else if (!is_root && !refs.linked && !refs.nested &&
+             func->decl->object->escapes == false) {
+    conv = TSG_FUNC_LIFTED;
+  } else {
+    conv = TSG_FUNC_CLOSURE;
+  }
+
+  bool changed = false;
+  if (conv > func->conv ||
+      (conv == TSG_FUNC_LIFTED && refs.n_members > func->n_captures)) {
+    func->conv = conv;
+    func->n_captures = 0;
+    if (conv == TSG_FUNC_LIFTED) {
+      for (int32_t i = 0; i < refs.n_members; i++) {
+        func->captures[i] = refs.members[i];
+      }
+      func->n_captures = refs.n_members;
+    }
+    changed = true;
+  }
+
+  return changed;
+}
+
+void add_outer_ref(outer_refs_t* refs, tsg_member_t* member) {
+  tsg_func_t* func = member->func;
+
+  if (func != NULL && func->conv == TSG_FUNC_LIFTED) {
+    // the call passes what the callee captures from beyond us
+    for (int32_t i = 0; i < func->n_captures; i++) {
+      if (func->captures[i]->depth < refs->depth) {
+        add_outer_ref(refs, func->captures[i]);
+      }
+    }
+    return;
+  }
+
+  if (member->depth >= refs->depth) {
+    return;
+  }
+
+  if (func != NULL) {
+    if (func->conv == TSG_FUNC_CLOSURE) {
+      refs->linked = true;
+    }
+    return;
+  }
+
+  for (int32_t i = 0; i < refs->n_members; i++) {
+    if (refs->members[i] == member) {
+      return;
+    }
+  }
+
+  if (refs->n_members < TSG_FUNC_MAX_CAPTURES) {
+    refs->members[refs->n_members] = member;
+    refs->n_members += 1;
+  } else {
+    refs->linked = true;
+  }
+}
+
+void scan_block(outer_refs_t* refs, tsg_block_t* block) {
+  tsg_func_node_t* func_node = block->funcs->head;
+  while (func_node != NULL) {
+    refs->nested = true;
+    scan_block(refs, func_node->func->body);
+    func_node = func_node->next;
+  }
+
+  tsg_stmt_node_t* stmt_node = block->stmts->head;
+  while (stmt_node != NULL) {
+    tsg_stmt_t* stmt = stmt_node->stmt;
+    switch (stmt->kind) {
+      case TSG_STMT_VAL:
+        scan_expr(refs, stmt->val.expr);
+        break;
+
+      case TSG_STMT_EXPR:
+        scan_expr(refs, stmt->expr.expr);
+        break;
+    }
+    stmt_node = stmt_node->next;
+  }
+}
+
+void scan_expr(outer_refs_t* refs, tsg_expr_t* expr) {
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      scan_expr(refs, expr->binary.lhs);
+      scan_expr(refs, expr->binary.rhs);
+      break;
+
+    case TSG_EXPR_CALL:
+      scan_expr(refs, expr->call.callee);
+      for (tsg_expr_node_t* node = expr->call.args->head; node;
+           node = node->next) {
+        scan_expr(refs, node->expr);
+      }
+      break;
+
+    case TSG_EXPR_IFELSE:
+      scan_expr(refs, expr->ifelse.cond);
+      scan_block(refs, expr->ifelse.thn);
+      scan_block(refs, expr->ifelse.els);
+      break;
+
+    case TSG_EXPR_IDENT:
+      add_outer_ref(refs, expr->ident.object);
+      break;
+
+    case TSG_EXPR_NUMBER:
+      break;
+  }
+}
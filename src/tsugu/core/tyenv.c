@@ -65,6 +65,17 @@ tsg_tyenv_t* tsg_tyenv_create(tsg_tyset_t* tyset, tsg_tyenv_t* outer) {
   tyenv->outer = outer;
   tyenv->tyset = tyset;
 
+  // the outer envs are shared, only the pointers to them are copied
+  int32_t depth = tyset->depth;
+  tyenv->display = tsg_malloc_arr(tsg_tyenv_t*, depth + 1);
+  if (depth > 0) {
+    tsg_memcpy(tyenv->display, outer->display, sizeof(tsg_tyenv_t*) * depth);
+  }
+  tyenv->display[depth] = tyenv;
+
+  tyenv->id = -1;
+  tyenv->pure = false;
+
   if (tyset->n_entries > 0) {
     int32_t size = tyset->n_entries;
     tyenv->arr = tsg_malloc_arr(tsg_type_t*, size);
@@ -83,15 +94,8 @@ void tsg_tyenv_destroy(tsg_tyenv_t* tyenv) {
     return;
   }
 
-  tsg_type_t** p = tyenv->arr;
-  tsg_type_t** end = p + tyenv->size;
-  while (p < end) {
-    if (*p != NULL) {
-      tsg_type_release(*p);
-    }
-    p++;
-  }
-
+  // the types belong to the typetbl
+  tsg_free(tyenv->display);
   tsg_free(tyenv->arr);
   tsg_free(tyenv);
 }
@@ -102,7 +106,6 @@ void tsg_tyenv_set(tsg_tyenv_t* tyenv, tsg_tyvar_t* tyvar, tsg_type_t* type) {
   tsg_assert(entry != NULL);
   tsg_assert(*entry == NULL);
 
-  tsg_type_retain(type);
   *entry = type;
 }
 
@@ -116,14 +119,16 @@ tsg_type_t** find_tyenv_entry(tsg_tyenv_t* tyenv, tsg_tyvar_t* tyvar) {
   tsg_assert(tyenv != NULL);
   tsg_assert(tyvar != NULL);
 
-  while (tyenv && tyenv->tyset->depth >= tyvar->tyset->depth) {
-    if (tyenv->tyset == tyvar->tyset) {
-      tsg_assert(tyvar->index < tyenv->size);
-      return tyenv->arr + tyvar->index;
-    }
+  int32_t depth = tyvar->tyset->depth;
+  if (depth > tyenv->tyset->depth) {
+    return NULL;
+  }
 
-    tyenv = tyenv->outer;
+  tsg_tyenv_t* found = tyenv->display[depth];
+  if (found->tyset != tyvar->tyset) {
+    return NULL;
   }
 
-  return NULL;
+  tsg_assert(tyvar->index < found->size);
+  return found->arr + tyvar->index;
 }
@@ -7,23 +7,39 @@
 #include <tsugu/core/tymap.h>
 
 #include <tsugu/core/memory.h>
+#include <tsugu/core/platform.h>
 
 typedef struct tsg_tyenv_entry_s tsg_tyenv_entry_t;
 
+// An open-addressing table with linear probing. `capacity` is zero or a
+// power of two, and an entry with a NULL key is empty; entries are never
+// removed, so no tombstones are needed. Growing moves the entries, but the
+// envs are owned through pointers and stay where they are.
 struct tsg_tyenv_entry_s {
+  size_t hash;
   tsg_type_arr_t* key;
   tsg_tyenv_t* tyenv;
-  tsg_tyenv_entry_t* next;
 };
 
 struct tsg_tymap_s {
-  tsg_tyenv_entry_t* head;
+  tsg_tyenv_entry_t* entries;
+  size_t capacity;
+  size_t size;
 };
 
+#define TYMAP_MIN_CAPACITY 8
+
+static tsg_tyenv_entry_t* find_entry(tsg_tyenv_entry_t* entries,
+                                     size_t capacity, size_t hash,
+                                     tsg_type_arr_t* key);
+static void grow(tsg_tymap_t* tymap);
+
 tsg_tymap_t* tsg_tymap_create(void) {
   tsg_tymap_t* tymap = tsg_malloc_obj(tsg_tymap_t);
 
-  tymap->head = NULL;
+  tymap->entries = NULL;
+  tymap->capacity = 0;
+  tymap->size = 0;
 
   return tymap;
 }
@@ -33,15 +49,17 @@ void tsg_tymap_destroy(tsg_tymap_t* tymap) {
     return;
   }
 
-  tsg_tyenv_entry_t* entry = tymap->head;
-  while (entry != NULL) {
-    tsg_tyenv_entry_t* next = entry->next;
-    tsg_type_arr_destroy(entry->key);
-    tsg_tyenv_destroy(entry->tyenv);
-    tsg_free(entry);
-    entry = next;
+  tsg_tyenv_entry_t* entry = tymap->entries;
+  tsg_tyenv_entry_t* end = entry + tymap->capacity;
+  while (entry < end) {
+    if (entry->key != NULL) {
+      tsg_type_arr_destroy(entry->key);
+      tsg_tyenv_destroy(entry->tyenv);
+    }
+    entry++;
   }
 
+  tsg_free(tymap->entries);
   tsg_free(tymap);
 }
 
@@ -50,24 +68,67 @@ void tsg_tymap_add(tsg_tymap_t* tymap, tsg_type_arr_t* key, tsg_tyenv_t* env) {
   tsg_assert(key != NULL);
   tsg_assert(env != NULL);
 
-  tsg_tyenv_entry_t* entry = tsg_malloc_obj(tsg_tyenv_entry_t);
+  // at most three quarters full, so that probes stay short
+  if ((tymap->size + 1) * 4 > tymap->capacity * 3) {
+    grow(tymap);
+  }
+
+  size_t hash = tsg_type_arr_hash(key);
+  tsg_tyenv_entry_t* entry =
+      find_entry(tymap->entries, tymap->capacity, hash, key);
+  tsg_assert(entry->key == NULL);
 
+  entry->hash = hash;
   entry->key = tsg_type_arr_dup(key);
   entry->tyenv = env;
-  entry->next = tymap->head;
-  tymap->head = entry;
+  tymap->size += 1;
 }
 
 tsg_tyenv_t* tsg_tymap_get(tsg_tymap_t* tymap, tsg_type_arr_t* key) {
   tsg_assert(tymap != NULL);
   tsg_assert(key != NULL);
 
-  tsg_tyenv_entry_t* entry = tymap->head;
-  while (entry) {
-    if (tsg_type_arr_equals(key, entry->key)) {
-      return entry->tyenv;
+  if (tymap->size == 0) {
+    return NULL;
+  }
+
+  tsg_tyenv_entry_t* entry = find_entry(tymap->entries, tymap->capacity,
+                                        tsg_type_arr_hash(key), key);
+  return entry->key != NULL ? entry->tyenv : NULL;
+}
+
+tsg_tyenv_entry_t* find_entry(tsg_tyenv_entry_t* entries, size_t capacity,
+                              size_t hash, tsg_type_arr_t* key) {
+  size_t mask = capacity - 1;
+  size_t i = hash & mask;
+
+  // the table is never full, so this reaches an empty entry at the latest
+  while (entries[i].key != NULL) {
+    if (entries[i].hash == hash && tsg_type_arr_equals(key, entries[i].key)) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return &(entries[i]);
+}
+
+void grow(tsg_tymap_t* tymap) {
+  size_t capacity = tymap->capacity > 0 ? tymap->capacity * 2
+                                        : TYMAP_MIN_CAPACITY;
+  tsg_tyenv_entry_t* entries = tsg_malloc_arr(tsg_tyenv_entry_t, capacity);
+  tsg_memset(entries, 0, sizeof(tsg_tyenv_entry_t) * capacity);
+
+  tsg_tyenv_entry_t* entry = tymap->entries;
+  tsg_tyenv_entry_t* end = entry + tymap->capacity;
+  while (entry < end) {
+    if (entry->key != NULL) {
+      *find_entry(entries, capacity, entry->hash, entry->key) = *entry;
     }
-    entry = entry->next;
+    entry++;
   }
-  return NULL;
+
+  tsg_free(tymap->entries);
+  tymap->entries = entries;
+  tymap->capacity = capacity;
 }
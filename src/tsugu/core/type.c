@@ -10,43 +10,295 @@
 #include <tsugu/core/platform.h>
 #include <tsugu/core/tymap.h>
 
+typedef struct tsg_type_chunk_s tsg_type_chunk_t;
+
+#define TYPE_CHUNK_SIZE 256
+
+struct tsg_type_chunk_s {
+  tsg_type_chunk_t* next;
+  size_t used;
+  tsg_type_t types[TYPE_CHUNK_SIZE];
+};
+
+#define SIGTBL_MIN_CAPACITY 64
+
+struct tsg_typetbl_s {
+  tsg_type_t bool_type;
+  tsg_type_t int_type;
+  // the table the bools and ints are taken from, for a fork
+  tsg_typetbl_t* parent;
+  // the newest first, the only one with room left
+  tsg_type_chunk_t* chunks;
+  // signatures, open addressing with linear probing, at most half full
+  tsg_type_t** sigs;
+  size_t sig_capacity;
+  size_t n_sigs;
+};
+
+static tsg_type_t* alloc_type(tsg_typetbl_t* types, tsg_type_kind_t kind);
 static void destroy_type(tsg_type_t* type);
-static void destroy_type_func(tsg_type_t* type);
-static void destroy_type_poly(tsg_type_t* type);
 
-static tsg_type_t* type_op_eq(tsg_type_t* lhs, tsg_type_t* rhs);
-static tsg_type_t* type_op_cmp(tsg_type_t* lhs, tsg_type_t* rhs);
-static tsg_type_t* type_op_arith(tsg_type_t* lhs, tsg_type_t* rhs);
+static tsg_type_t* intern_sig(tsg_typetbl_t* types, tsg_type_arr_t* params,
+                              tsg_type_t* ret);
+static size_t hash_sig(tsg_type_arr_t* params, tsg_type_t* ret);
+static void grow_sigs(tsg_typetbl_t* types);
+
+static size_t hash_combine(size_t seed, size_t value);
+static size_t hash_ptr(const void* ptr);
+
+static tsg_type_t* type_op_eq(tsg_typetbl_t* types, tsg_type_t* lhs,
+                              tsg_type_t* rhs);
+static tsg_type_t* type_op_cmp(tsg_typetbl_t* types, tsg_type_t* lhs,
+                               tsg_type_t* rhs);
+static tsg_type_t* type_op_arith(tsg_typetbl_t* types, tsg_type_t* lhs,
+                                 tsg_type_t* rhs);
+
+tsg_typetbl_t* tsg_typetbl_create(void) {
+  tsg_typetbl_t* types = tsg_malloc_obj(tsg_typetbl_t);
+
+  tsg_memset(types, 0, sizeof(tsg_typetbl_t));
+  types->bool_type.kind = TSG_TYPE_BOOL;
+  types->int_type.kind = TSG_TYPE_INT;
+  types->parent = NULL;
+  types->chunks = NULL;
+  types->sigs = NULL;
+  types->sig_capacity = 0;
+  types->n_sigs = 0;
+
+  return types;
+}
+
+void tsg_typetbl_destroy(tsg_typetbl_t* types) {
+  if (types == NULL) {
+    return;
+  }
+
+  tsg_type_chunk_t* chunk = types->chunks;
+  while (chunk != NULL) {
+    tsg_type_chunk_t* next = chunk->next;
+    for (size_t i = 0; i < chunk->used; i++) {
+      destroy_type(&(chunk->types[i]));
+    }
+    tsg_free(chunk);
+    chunk = next;
+  }
+
+  tsg_free(types->sigs);
+  tsg_free(types);
+}
+
+tsg_typetbl_t* tsg_typetbl_fork(tsg_typetbl_t* parent) {
+  tsg_assert(parent != NULL && parent->parent == NULL);
+
+  tsg_typetbl_t* types = tsg_typetbl_create();
+  types->parent = parent;
+
+  return types;
+}
+
+void tsg_typetbl_join(tsg_typetbl_t* types, tsg_typetbl_t* fork) {
+  tsg_assert(fork->parent == types);
+
+  tsg_type_chunk_t* chunk = fork->chunks;
+  while (chunk != NULL) {
+    tsg_type_chunk_t* next = chunk->next;
+
+    // the signatures of the fork are left unused in its chunks
+    for (size_t i = 0; i < chunk->used; i++) {
+      tsg_type_t* type = &(chunk->types[i]);
+      if (type->kind == TSG_TYPE_FUNC && type->func.env != NULL &&
+          type->func.sig != NULL) {
+        type->func.sig = intern_sig(types, type->func.params, type->func.ret);
+      }
+    }
+
+    // behind the newest, which keeps taking the new types
+    if (types->chunks == NULL) {
+      chunk->next = NULL;
+      types->chunks = chunk;
+    } else {
+      chunk->next = types->chunks->next;
+      types->chunks->next = chunk;
+    }
+    chunk = next;
+  }
+
+  fork->chunks = NULL;
+  tsg_typetbl_destroy(fork);
+}
+
+tsg_type_t* tsg_typetbl_prim(tsg_typetbl_t* types, tsg_type_kind_t kind) {
+  tsg_assert(types != NULL);
+  tsg_assert(kind == TSG_TYPE_BOOL || kind == TSG_TYPE_INT);
+
+  if (types->parent != NULL) {
+    return tsg_typetbl_prim(types->parent, kind);
+  }
+
+  return (kind == TSG_TYPE_BOOL) ? &(types->bool_type) : &(types->int_type);
+}
+
+tsg_type_t* tsg_typetbl_pend(tsg_typetbl_t* types) {
+  return alloc_type(types, TSG_TYPE_PEND);
+}
+
+tsg_type_t* tsg_typetbl_func(tsg_typetbl_t* types, tsg_type_arr_t* params,
+                             tsg_tyenv_t* env) {
+  tsg_assert(params != NULL);
+  tsg_assert(env != NULL);
 
-tsg_type_t* tsg_type_create(tsg_type_kind_t kind) {
-  tsg_type_t* type = tsg_malloc_obj(tsg_type_t);
+  tsg_type_t* type = alloc_type(types, TSG_TYPE_FUNC);
+  type->func.params = params;
+  type->func.ret = tsg_typetbl_pend(types);
+  type->func.env = env;
+  type->func.sig = NULL;
+
+  return type;
+}
+
+void tsg_typetbl_func_ret(tsg_typetbl_t* types, tsg_type_t* func,
+                          tsg_type_t* ret) {
+  tsg_assert(func != NULL && func->kind == TSG_TYPE_FUNC);
+  tsg_assert(func->func.env != NULL);
+
+  func->func.ret = ret;
+  func->func.sig = (ret != NULL) ? intern_sig(types, func->func.params, ret)
+                                 : NULL;
+}
+
+tsg_type_t* intern_sig(tsg_typetbl_t* types, tsg_type_arr_t* params,
+                       tsg_type_t* ret) {
+  if ((types->n_sigs + 1) * 2 > types->sig_capacity) {
+    grow_sigs(types);
+  }
+
+  size_t mask = types->sig_capacity - 1;
+  size_t index = hash_sig(params, ret) & mask;
+  while (types->sigs[index] != NULL) {
+    tsg_type_t* sig = types->sigs[index];
+    if (tsg_type_equals(sig->func.ret, ret) &&
+        tsg_type_arr_equals(sig->func.params, params)) {
+      return sig;
+    }
+    index = (index + 1) & mask;
+  }
+
+  tsg_type_t* sig = alloc_type(types, TSG_TYPE_FUNC);
+  sig->func.params = tsg_type_arr_dup(params);
+  sig->func.ret = ret;
+  sig->func.env = NULL;
+  sig->func.sig = sig;
+
+  types->sigs[index] = sig;
+  types->n_sigs += 1;
+
+  return sig;
+}
+
+size_t hash_sig(tsg_type_arr_t* params, tsg_type_t* ret) {
+  return hash_combine(tsg_type_arr_hash(params), tsg_type_hash(ret));
+}
+
+void grow_sigs(tsg_typetbl_t* types) {
+  size_t capacity = (types->sig_capacity > 0) ? types->sig_capacity * 2
+                                              : SIGTBL_MIN_CAPACITY;
+  tsg_type_t** sigs = tsg_malloc_arr(tsg_type_t*, capacity);
+  tsg_memset(sigs, 0, sizeof(tsg_type_t*) * capacity);
+
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < types->sig_capacity; i++) {
+    tsg_type_t* sig = types->sigs[i];
+    if (sig == NULL) {
+      continue;
+    }
+
+    size_t index = hash_sig(sig->func.params, sig->func.ret) & mask;
+    while (sigs[index] != NULL) {
+      index = (index + 1) & mask;
+    }
+    sigs[index] = sig;
+  }
+
+  tsg_free(types->sigs);
+  types->sigs = sigs;
+  types->sig_capacity = capacity;
+}
+
+tsg_type_t* tsg_typetbl_poly(tsg_typetbl_t* types, tsg_func_t* func,
+                             tsg_tyenv_t* outer) {
+  tsg_type_t* type = alloc_type(types, TSG_TYPE_POLY);
+  type->poly.func = func;
+  // `outer` is a reference
+  type->poly.outer = outer;
+  type->poly.tymap = tsg_tymap_create();
+
+  return type;
+}
+
+tsg_type_t* alloc_type(tsg_typetbl_t* types, tsg_type_kind_t kind) {
+  tsg_assert(types != NULL);
+
+  tsg_type_chunk_t* chunk = types->chunks;
+  if (chunk == NULL || chunk->used == TYPE_CHUNK_SIZE) {
+    chunk = tsg_malloc_obj(tsg_type_chunk_t);
+    chunk->next = types->chunks;
+    chunk->used = 0;
+    types->chunks = chunk;
+  }
+
+  tsg_type_t* type = &(chunk->types[chunk->used]);
+  chunk->used += 1;
 
   tsg_memset(type, 0, sizeof(tsg_type_t));
   type->kind = kind;
-  type->nrefs = 1;
 
   return type;
 }
 
-void tsg_type_retain(tsg_type_t* type) {
-  tsg_assert(type != NULL);
-  tsg_assert(type->nrefs > 0);
+void destroy_type(tsg_type_t* type) {
+  switch (type->kind) {
+    case TSG_TYPE_FUNC:
+      tsg_type_arr_destroy(type->func.params);
+      break;
 
-  type->nrefs += 1;
+    case TSG_TYPE_POLY:
+      tsg_tymap_destroy(type->poly.tymap);
+      break;
+
+    default:
+      break;
+  }
 }
 
-void tsg_type_release(tsg_type_t* type) {
-  tsg_assert(type != NULL);
-  tsg_assert(type->nrefs > 0);
+bool tsg_type_equals(tsg_type_t* a, tsg_type_t* b) {
+  tsg_assert(a != NULL);
+  tsg_assert(b != NULL);
+
+  // bools and ints are canonical, and a pending type equals only itself
+  if (a == b) {
+    return true;
+  }
+  if (a->kind != b->kind) {
+    return false;
+  }
 
-  type->nrefs -= 1;
+  switch (a->kind) {
+    case TSG_TYPE_FUNC:
+      // signatures are canonical; one not interned yet is still pending
+      return a->func.sig != NULL && a->func.sig == b->func.sig;
 
-  if (type->nrefs <= 0) {
-    destroy_type(type);
+    case TSG_TYPE_POLY:
+      return a->poly.func == b->poly.func;
+
+    default:
+      return false;
   }
 }
 
-void destroy_type(tsg_type_t* type) {
+size_t tsg_type_hash(tsg_type_t* type) {
+  tsg_assert(type != NULL);
+
+  size_t hash = (size_t)type->kind;
   switch (type->kind) {
     case TSG_TYPE_BOOL:
       break;
@@ -55,62 +307,32 @@ void destroy_type(tsg_type_t* type) {
       break;
 
     case TSG_TYPE_FUNC:
-      destroy_type_func(type);
+      // the return type of an instance is filled in after it is verified,
+      // so only the parameters stay the same for as long as it is hashed
+      hash = hash_combine(hash, tsg_type_arr_hash(type->func.params));
       break;
 
     case TSG_TYPE_POLY:
-      destroy_type_poly(type);
+      hash = hash_combine(hash, hash_ptr(type->poly.func));
       break;
 
     case TSG_TYPE_PEND:
+      hash = hash_combine(hash, hash_ptr(type));
       break;
   }
 
-  tsg_free(type);
-}
-
-void destroy_type_func(tsg_type_t* type) {
-  tsg_assert(type->kind == TSG_TYPE_FUNC);
-  tsg_type_arr_destroy(type->func.params);
-  tsg_type_release(type->func.ret);
+  return hash;
 }
 
-void destroy_type_poly(tsg_type_t* type) {
-  tsg_assert(type->kind == TSG_TYPE_POLY);
-  // `type->poly.outer` is a reference
-  tsg_tymap_destroy(type->poly.tymap);
+size_t hash_combine(size_t seed, size_t value) {
+  return seed ^ (value + (size_t)0x9e3779b97f4a7c15ULL + (seed << 6) +
+                 (seed >> 2));
 }
 
-bool tsg_type_equals(tsg_type_t* a, tsg_type_t* b) {
-  tsg_assert(a != NULL);
-  tsg_assert(b != NULL);
-
-  if (a->kind == b->kind) {
-    switch (a->kind) {
-      case TSG_TYPE_BOOL:
-        return true;
-
-      case TSG_TYPE_INT:
-        return true;
-
-      case TSG_TYPE_FUNC:
-        if (tsg_type_equals(a->func.ret, b->func.ret) == false) {
-          return false;
-        }
-        if (tsg_type_arr_equals(a->func.params, b->func.params) == false) {
-          return false;
-        }
-        return true;
-
-      case TSG_TYPE_POLY:
-        return a->poly.func == b->poly.func;
-
-      case TSG_TYPE_PEND:
-        return a == b;
-    }
-  } else {
-    return false;
-  }
+size_t hash_ptr(const void* ptr) {
+  // allocations are aligned, which leaves the low bits all the same
+  uintptr_t bits = (uintptr_t)ptr;
+  return (size_t)(bits ^ (bits >> 4) ^ (bits >> 16));
 }
 
 tsg_type_t* tsg_type_unify(tsg_type_t* a, tsg_type_t* b) {
@@ -118,37 +340,34 @@ tsg_type_t* tsg_type_unify(tsg_type_t* a, tsg_type_t* b) {
   tsg_assert(b != NULL);
 
   if (tsg_type_equals(a, b)) {
-    tsg_type_retain(a);
     return a;
   } else if (a->kind == TSG_TYPE_PEND && b->kind != TSG_TYPE_PEND) {
-    tsg_type_retain(b);
     return b;
   } else if (a->kind != TSG_TYPE_PEND && b->kind == TSG_TYPE_PEND) {
-    tsg_type_retain(a);
     return a;
   } else {
     return NULL;
   }
 }
 
-tsg_type_t* tsg_type_binary(tsg_token_kind_t op, tsg_type_t* lhs,
-                            tsg_type_t* rhs) {
+tsg_type_t* tsg_type_binary(tsg_typetbl_t* types, tsg_token_kind_t op,
+                            tsg_type_t* lhs, tsg_type_t* rhs) {
   tsg_assert(lhs != NULL);
   tsg_assert(rhs != NULL);
 
   switch (op) {
     case TSG_TOKEN_EQ:
-      return type_op_eq(lhs, rhs);
+      return type_op_eq(types, lhs, rhs);
 
     case TSG_TOKEN_LT:
     case TSG_TOKEN_GT:
-      return type_op_cmp(lhs, rhs);
+      return type_op_cmp(types, lhs, rhs);
 
     case TSG_TOKEN_ADD:
     case TSG_TOKEN_SUB:
     case TSG_TOKEN_MUL:
     case TSG_TOKEN_DIV:
-      return type_op_arith(lhs, rhs);
+      return type_op_arith(types, lhs, rhs);
 
     default:
       tsg_assert(false);
@@ -156,28 +375,30 @@ tsg_type_t* tsg_type_binary(tsg_token_kind_t op, tsg_type_t* lhs,
   }
 }
 
-tsg_type_t* type_op_eq(tsg_type_t* lhs, tsg_type_t* rhs) {
+tsg_type_t* type_op_eq(tsg_typetbl_t* types, tsg_type_t* lhs,
+                       tsg_type_t* rhs) {
   if (tsg_type_equals(lhs, rhs)) {
-    return tsg_type_create(TSG_TYPE_BOOL);
+    return tsg_typetbl_prim(types, TSG_TYPE_BOOL);
   } else {
     return NULL;
   }
 }
 
-tsg_type_t* type_op_cmp(tsg_type_t* lhs, tsg_type_t* rhs) {
+tsg_type_t* type_op_cmp(tsg_typetbl_t* types, tsg_type_t* lhs,
+                        tsg_type_t* rhs) {
   if (lhs->kind == TSG_TYPE_INT) {
     if (rhs->kind == TSG_TYPE_INT) {
-      return tsg_type_create(TSG_TYPE_BOOL);
+      return tsg_typetbl_prim(types, TSG_TYPE_BOOL);
     } else if (rhs->kind == TSG_TYPE_PEND) {
-      return tsg_type_create(TSG_TYPE_BOOL);
+      return tsg_typetbl_prim(types, TSG_TYPE_BOOL);
     } else {
       return NULL;
     }
   } else if (lhs->kind == TSG_TYPE_PEND) {
     if (rhs->kind == TSG_TYPE_INT) {
-      return tsg_type_create(TSG_TYPE_BOOL);
+      return tsg_typetbl_prim(types, TSG_TYPE_BOOL);
     } else if (rhs->kind == TSG_TYPE_PEND) {
-      return tsg_type_create(TSG_TYPE_BOOL);
+      return tsg_typetbl_prim(types, TSG_TYPE_BOOL);
     } else {
       return NULL;
     }
@@ -186,23 +407,21 @@ tsg_type_t* type_op_cmp(tsg_type_t* lhs, tsg_type_t* rhs) {
   }
 }
 
-tsg_type_t* type_op_arith(tsg_type_t* lhs, tsg_type_t* rhs) {
+tsg_type_t* type_op_arith(tsg_typetbl_t* types, tsg_type_t* lhs,
+                          tsg_type_t* rhs) {
   if (lhs->kind == TSG_TYPE_INT) {
     if (rhs->kind == TSG_TYPE_INT) {
-      tsg_type_retain(lhs);
       return lhs;
     } else if (rhs->kind == TSG_TYPE_PEND) {
-      tsg_type_retain(lhs);
       return lhs;
     } else {
       return NULL;
     }
   } else if (lhs->kind == TSG_TYPE_PEND) {
     if (rhs->kind == TSG_TYPE_INT) {
-      tsg_type_retain(rhs);
       return rhs;
     } else if (rhs->kind == TSG_TYPE_PEND) {
-      return tsg_type_create(TSG_TYPE_INT);
+      return tsg_typetbl_prim(types, TSG_TYPE_INT);
     } else {
       return NULL;
     }
@@ -233,15 +452,7 @@ tsg_type_arr_t* tsg_type_arr_dup(const tsg_type_arr_t* src) {
   if (src->size > 0) {
     dst->elem = tsg_malloc_arr(tsg_type_t*, src->size);
     dst->size = src->size;
-
-    tsg_type_t** p = src->elem;
-    tsg_type_t** end = p + src->size;
-    tsg_type_t** q = dst->elem;
-    while (p < end) {
-      tsg_type_t* type = *(p++);
-      tsg_type_retain(type);
-      *(q++) = type;
-    }
+    tsg_memcpy(dst->elem, src->elem, sizeof(tsg_type_t*) * src->size);
   } else {
     dst->elem = NULL;
     dst->size = 0;
@@ -255,13 +466,7 @@ void tsg_type_arr_destroy(tsg_type_arr_t* arr) {
     return;
   }
 
-  tsg_type_t** p = arr->elem;
-  tsg_type_t** end = p + arr->size;
-  while (p < end) {
-    tsg_type_release(*p);
-    p++;
-  }
-
+  // the elements belong to the typetbl
   tsg_free(arr->elem);
   tsg_free(arr);
 }
@@ -288,3 +493,17 @@ bool tsg_type_arr_equals(tsg_type_arr_t* a, tsg_type_arr_t* b) {
 
   return true;
 }
+
+size_t tsg_type_arr_hash(tsg_type_arr_t* arr) {
+  tsg_assert(arr != NULL);
+
+  size_t hash = arr->size;
+  tsg_type_t** p = arr->elem;
+  tsg_type_t** end = p + arr->size;
+  while (p < end) {
+    hash = hash_combine(hash, tsg_type_hash(*p));
+    p++;
+  }
+
+  return hash;
+}
@@ -6,45 +6,249 @@
 
 #include <tsugu/core/verifier.h>
 
+#include <tsugu/core/insttbl.h>
 #include <tsugu/core/memory.h>
+#include <tsugu/core/platform.h>
 #include <tsugu/core/tyenv.h>
 #include <tsugu/core/tymap.h>
 #include <tsugu/core/type.h>
 
+typedef struct tsg_task_s tsg_task_t;
+typedef struct tsg_instmap_entry_s tsg_instmap_entry_t;
+typedef struct tsg_instmap_s tsg_instmap_t;
+typedef struct tsg_spec_inst_s tsg_spec_inst_t;
+typedef struct tsg_spec_s tsg_spec_t;
+typedef struct tsg_pool_s tsg_pool_t;
+
+// The verifier does not recurse on the native stack. Each step of the walk
+// over a function body is a task on an explicit stack, and the type of a
+// block, statement or expression is left on a stack of values for the task
+// that continues its parent. A call of a new instance pushes the tasks of
+// that instance above the continuation of the call, so deep call chains
+// and deep expressions cost heap, not native stack. Tasks are run in the
+// order the recursive walk would take, so instances get the same ids and
+// errors come out in the same order.
+typedef enum {
+  TASK_BLOCK,
+  TASK_STMT_LIST,
+  TASK_STMT,
+  TASK_STMT_VAL,
+  TASK_EXPR,
+  TASK_EXPR_LIST,
+  TASK_EXPR_BINARY,
+  TASK_EXPR_CALL,
+  TASK_EXPR_CALLED,
+  TASK_EXPR_COND,
+  TASK_EXPR_IFELSE,
+  // sets the return type of the instance being verified
+  TASK_FUNC_RET,
+  // goes back to the env of the caller, leaving the instance's type
+  TASK_FUNC_LEAVE,
+} tsg_task_kind_t;
+
+struct tsg_task_s {
+  tsg_task_kind_t kind;
+  union {
+    tsg_block_t* block;
+    tsg_stmt_node_t* stmts;
+    tsg_stmt_t* stmt;
+    tsg_expr_node_t* exprs;
+    tsg_expr_t* expr;
+    tsg_func_t* func;
+  };
+  // for TASK_FUNC_LEAVE, the env of the caller
+  tsg_tyenv_t* tyenv;
+};
+
+// Instances of any polymorphic type, keyed by the type and the argument
+// types, in an open-addressing table like the tymap. The keys are borrowed.
+struct tsg_instmap_entry_s {
+  size_t hash;
+  tsg_type_t* poly;
+  tsg_type_arr_t* args;
+  void* value;
+};
+
+struct tsg_instmap_s {
+  tsg_instmap_entry_t* entries;
+  size_t capacity;
+  size_t size;
+};
+
+// With threads, the main walker hands the calls in a block it begins to a
+// pool of workers, as specs, if their argument types are already known.
+// A worker verifies the instance of the call, and the instances that one
+// calls, ahead of the main walker and apart from it: in a fork of the type
+// table, with its own errors, and its own new instances, which it keeps in
+// `overlay` instead of the shared tymaps. It reads a shared instance only
+// once it is verified, and gives up on one still being verified. Of the
+// shared envs, it reads only what nested functions see: the functions, the
+// parameters, and the vals before the block a function is in, all of them
+// set before that block began, and so before any spec could reach them.
+//
+// When the main walker reaches the call and misses the instance in the
+// tymap, it waits for the spec, and adopts it if none of the instances
+// the spec made has been made since. The sequential walk would have made
+// the very same instances at this point, with the same types and errors,
+// since the spec read only what stays as it was; so adopting one adds its
+// instances in the order they were made, and appends its errors, just as
+// verifying the call would. Otherwise, or if the spec gave up, the main
+// walker drops it and verifies the call itself. Either way, the result is
+// that of verifying on one thread.
+typedef enum {
+  SPEC_QUEUED,
+  SPEC_RUNNING,
+  // run, to the end or until it gave up
+  SPEC_DONE,
+  // taken back by the main walker before a worker got to it
+  SPEC_CANCELLED,
+} tsg_spec_state_t;
+
+struct tsg_spec_inst_s {
+  tsg_type_t* poly;
+  // the arguments if `poly` is shared, the instance is then yet to be added
+  // to its tymap; NULL if `poly` was made by the spec
+  tsg_type_arr_t* args;
+  tsg_tyenv_t* env;
+};
+
+struct tsg_spec_s {
+  tsg_type_t* poly;
+  tsg_type_arr_t* args;
+  tsg_spec_state_t state;
+  // in the queue of the pool
+  tsg_spec_t* next;
+
+  // left by the worker once done
+  bool aborted;
+  tsg_type_t* func_type;
+  tsg_typetbl_t* types;
+  tsg_errlist_t errors;
+  // the instances made, in the order they were made, and those of shared
+  // polys by their key
+  tsg_spec_inst_t* insts;
+  size_t n_insts;
+  size_t insts_capacity;
+  tsg_instmap_t overlay;
+};
+
+struct tsg_pool_s {
+  // guards the queue and the states of the specs, and the shared tymaps
+  // and the return types of shared instances while workers read them
+  tsg_mutex_t* mutex;
+  // signaled when a spec is queued or done, and on closing
+  tsg_cond_t* cond;
+  tsg_thread_t** threads;
+  int32_t n_threads;
+  tsg_typetbl_t* types;
+
+  tsg_spec_t* head;
+  tsg_spec_t* tail;
+  bool closing;
+
+  // every spec by its instance, for the main walker alone
+  tsg_instmap_t specs;
+};
+
 struct tsg_verifier_s {
   tsg_errlist_t errors;
   tsg_tyenv_t* tyenv;
+  tsg_typetbl_t* types;
+  tsg_insttbl_t* instances;
+
+  tsg_task_t* tasks;
+  size_t n_tasks;
+  size_t tasks_capacity;
+
+  tsg_type_t** values;
+  size_t n_values;
+  size_t values_capacity;
+
+  int32_t n_threads;
+  // while verifying with threads
+  tsg_pool_t* pool;
+  // on a worker, the spec it runs
+  tsg_spec_t* spec;
+  // the spec gave up
+  bool aborted;
 };
 
+#define VERIFIER_MIN_CAPACITY 64
+#define INSTMAP_MIN_CAPACITY 16
+// the nesting of expressions searched for calls to hand to the workers,
+// and of those whose type is worked out beforehand for their arguments
+#define SPEC_MAX_EXPRS 64
+#define SPEC_MAX_DEPTH 8
+// tasks a worker runs between checks whether the pool is closing
+#define SPEC_POLL_TASKS 4096
+
 static void error(tsg_verifier_t* verifier, tsg_source_range_t* loc,
                   const char* format, ...);
 
-static tsg_type_t* verify_poly(tsg_verifier_t* verifier, tsg_type_t* poly,
-                               tsg_type_arr_t* args);
-static void verify_func(tsg_verifier_t* verifier, tsg_func_t* func,
-                        tsg_type_arr_t* arg_types);
-static tsg_type_t* verify_block(tsg_verifier_t* verifier, tsg_block_t* block);
+static void push_task(tsg_verifier_t* verifier, tsg_task_kind_t kind,
+                      void* node);
+static void push_value(tsg_verifier_t* verifier, tsg_type_t* type);
+static tsg_type_t* pop_value(tsg_verifier_t* verifier);
+static void run(tsg_verifier_t* verifier);
+static void run_task(tsg_verifier_t* verifier, tsg_task_t* task);
+
+static void begin_poly(tsg_verifier_t* verifier, tsg_type_t* poly,
+                       tsg_type_arr_t* args);
+static void begin_func(tsg_verifier_t* verifier, tsg_func_t* func,
+                       tsg_type_arr_t* arg_types);
+static void leave_func(tsg_verifier_t* verifier, tsg_func_t* func,
+                       tsg_tyenv_t* caller);
+static bool is_pure(tsg_func_t* func, tsg_tyenv_t* tyenv);
+static bool is_scalar(tsg_type_t* type);
+static void verify_block(tsg_verifier_t* verifier, tsg_block_t* block);
 static void verify_func_list(tsg_verifier_t* verifier, tsg_func_list_t* list);
-static tsg_type_t* verify_stmt_list(tsg_verifier_t* verifier,
-                                    tsg_stmt_list_t* list);
-
-static tsg_type_t* verify_stmt(tsg_verifier_t* verifier, tsg_stmt_t* stmt);
-static tsg_type_t* verify_stmt_val(tsg_verifier_t* verifier, tsg_stmt_t* stmt);
-static tsg_type_t* verify_stmt_expr(tsg_verifier_t* verifier, tsg_stmt_t* stmt);
-
-static tsg_type_t* verify_expr(tsg_verifier_t* verifier, tsg_expr_t* expr);
-static tsg_type_t* verify_expr_binary(tsg_verifier_t* verifier,
-                                      tsg_expr_t* expr);
-static tsg_type_t* verify_expr_call(tsg_verifier_t* verifier, tsg_expr_t* expr);
-static tsg_type_t* verify_expr_ifelse(tsg_verifier_t* verifier,
-                                      tsg_expr_t* expr);
-static tsg_type_t* verify_expr_ident(tsg_verifier_t* verifier,
-                                     tsg_expr_t* expr);
-static tsg_type_t* verify_expr_number(tsg_verifier_t* verifier,
-                                      tsg_expr_t* expr);
-
-static tsg_type_arr_t* verify_expr_list(tsg_verifier_t* verifier,
-                                        tsg_expr_list_t* list);
+static void verify_stmt_list(tsg_verifier_t* verifier, tsg_stmt_node_t* node);
+
+static void verify_stmt(tsg_verifier_t* verifier, tsg_stmt_t* stmt);
+static void verify_stmt_val(tsg_verifier_t* verifier, tsg_stmt_t* stmt);
+
+static void verify_expr(tsg_verifier_t* verifier, tsg_expr_t* expr);
+static void finish_expr(tsg_verifier_t* verifier, tsg_expr_t* expr,
+                        tsg_type_t* type);
+static void verify_expr_binary(tsg_verifier_t* verifier, tsg_expr_t* expr);
+static void verify_expr_call(tsg_verifier_t* verifier, tsg_expr_t* expr);
+static void verify_expr_called(tsg_verifier_t* verifier, tsg_expr_t* expr);
+static void verify_expr_cond(tsg_verifier_t* verifier, tsg_expr_t* expr);
+static void verify_expr_ifelse(tsg_verifier_t* verifier, tsg_expr_t* expr);
+
+static void verify_expr_list(tsg_verifier_t* verifier, tsg_expr_node_t* node);
+
+static bool is_main(const tsg_verifier_t* verifier);
+static void lock_shared(tsg_verifier_t* verifier);
+static void unlock_shared(tsg_verifier_t* verifier);
+static tsg_tyenv_t* find_instance(tsg_verifier_t* verifier, tsg_type_t* poly,
+                                  tsg_type_arr_t* args);
+static void add_instance(tsg_verifier_t* verifier, tsg_type_t* poly,
+                         tsg_type_arr_t* args, tsg_tyenv_t* tyenv);
+
+static tsg_pool_t* create_pool(int32_t n_threads, tsg_typetbl_t* types);
+static void destroy_pool(tsg_pool_t* pool);
+static void run_worker(void* arg);
+static void run_spec(tsg_pool_t* pool, tsg_spec_t* spec);
+static void speculate_block(tsg_verifier_t* verifier, tsg_block_t* block);
+static void speculate_call(tsg_verifier_t* verifier, tsg_expr_t* expr);
+static tsg_type_t* known_type(tsg_verifier_t* verifier, tsg_expr_t* expr,
+                              int32_t depth);
+static bool adopt_spec(tsg_verifier_t* verifier, tsg_type_t* poly,
+                       tsg_type_arr_t* args);
+static void release_spec(tsg_spec_t* spec);
+
+static void instmap_init(tsg_instmap_t* map);
+static void instmap_release(tsg_instmap_t* map);
+static void instmap_add(tsg_instmap_t* map, tsg_type_t* poly,
+                        tsg_type_arr_t* args, void* value);
+static void* instmap_get(tsg_instmap_t* map, tsg_type_t* poly,
+                         tsg_type_arr_t* args);
+static tsg_instmap_entry_t* instmap_find(tsg_instmap_entry_t* entries,
+                                         size_t capacity, size_t hash,
+                                         tsg_type_t* poly,
+                                         tsg_type_arr_t* args);
+static size_t instmap_hash(tsg_type_t* poly, tsg_type_arr_t* args);
 
 tsg_verifier_t* tsg_verifier_create(void) {
   tsg_verifier_t* verifier = tsg_malloc_obj(tsg_verifier_t);
@@ -54,6 +258,21 @@ tsg_verifier_t* tsg_verifier_create(void) {
 
   tsg_errlist_init(&(verifier->errors));
   verifier->tyenv = NULL;
+  verifier->types = NULL;
+  verifier->instances = NULL;
+
+  verifier->tasks = NULL;
+  verifier->n_tasks = 0;
+  verifier->tasks_capacity = 0;
+
+  verifier->values = NULL;
+  verifier->n_values = 0;
+  verifier->values_capacity = 0;
+
+  verifier->n_threads = 0;
+  verifier->pool = NULL;
+  verifier->spec = NULL;
+  verifier->aborted = false;
 
   return verifier;
 }
@@ -61,9 +280,15 @@ tsg_verifier_t* tsg_verifier_create(void) {
 void tsg_verifier_destroy(tsg_verifier_t* verifier) {
   tsg_errlist_release(&(verifier->errors));
   tsg_assert(verifier->tyenv == NULL);
+  tsg_free(verifier->tasks);
+  tsg_free(verifier->values);
   tsg_free(verifier);
 }
 
+void tsg_verifier_set_threads(tsg_verifier_t* verifier, int32_t n_threads) {
+  verifier->n_threads = n_threads > 0 ? n_threads : 0;
+}
+
 void tsg_verifier_error(const tsg_verifier_t* verifier, tsg_errlist_t* errors) {
   *errors = verifier->errors;
 }
@@ -83,41 +308,217 @@ bool tsg_verifier_verify(tsg_verifier_t* verifier, tsg_ast_t* ast) {
 
   tsg_assert(verifier->tyenv == NULL);
   verifier->tyenv = ast->tyenv;
-  verify_func(verifier, root_func, root_args);
+  verifier->types = ast->types;
+  verifier->instances = ast->instances;
+  tsg_insttbl_add(ast->instances, root_func, ast->tyenv);
+  if (verifier->n_threads > 0) {
+    // without threads on this platform, verified here alone
+    verifier->pool = create_pool(verifier->n_threads, ast->types);
+  }
+  begin_func(verifier, root_func, root_args);
+  run(verifier);
   verifier->tyenv = NULL;
+  destroy_pool(verifier->pool);
+  verifier->pool = NULL;
 
   return verifier->errors.head == NULL;
 }
 
-tsg_type_t* verify_poly(tsg_verifier_t* verifier, tsg_type_t* poly,
-                        tsg_type_arr_t* args) {
+tsg_type_t* tsg_verifier_instantiate(tsg_verifier_t* verifier, tsg_ast_t* ast,
+                                     tsg_func_t* func, tsg_type_arr_t* args) {
+  // `func` is defined at the top level of `ast`, `args` is taken over
+  tsg_type_t* poly = tsg_tyenv_get(ast->tyenv, func->decl->object->tyvar);
+  tsg_assert(poly != NULL && poly->kind == TSG_TYPE_POLY);
+
+  if (args->size != func->params->size) {
+    error(verifier, &(func->decl->name->loc), "wrong number of arguments");
+    tsg_type_arr_destroy(args);
+    return NULL;
+  }
+
+  tsg_assert(verifier->tyenv == NULL);
+  verifier->tyenv = ast->tyenv;
+  verifier->types = ast->types;
+  verifier->instances = ast->instances;
+  begin_poly(verifier, poly, args);
+  run(verifier);
+  tsg_type_t* func_type = pop_value(verifier);
+  verifier->tyenv = NULL;
+
+  // a failed instance stays in the tymap, so callers must not retry it
+
+  if (verifier->errors.head != NULL || func_type->func.ret == NULL) {
+    return NULL;
+  }
+
+  return func_type;
+}
+
+void push_task(tsg_verifier_t* verifier, tsg_task_kind_t kind, void* node) {
+  if (verifier->n_tasks == verifier->tasks_capacity) {
+    size_t capacity = verifier->tasks_capacity > 0
+                          ? verifier->tasks_capacity * 2
+                          : VERIFIER_MIN_CAPACITY;
+    tsg_task_t* tasks = tsg_malloc_arr(tsg_task_t, capacity);
+    if (verifier->n_tasks > 0) {
+      tsg_memcpy(tasks, verifier->tasks,
+                 sizeof(tsg_task_t) * verifier->n_tasks);
+    }
+
+    tsg_free(verifier->tasks);
+    verifier->tasks = tasks;
+    verifier->tasks_capacity = capacity;
+  }
+
+  tsg_task_t* task = &(verifier->tasks[verifier->n_tasks++]);
+  task->kind = kind;
+  task->block = (tsg_block_t*)node;
+  task->tyenv = NULL;
+}
+
+void push_value(tsg_verifier_t* verifier, tsg_type_t* type) {
+  if (verifier->n_values == verifier->values_capacity) {
+    size_t capacity = verifier->values_capacity > 0
+                          ? verifier->values_capacity * 2
+                          : VERIFIER_MIN_CAPACITY;
+    tsg_type_t** values = tsg_malloc_arr(tsg_type_t*, capacity);
+    if (verifier->n_values > 0) {
+      tsg_memcpy(values, verifier->values,
+                 sizeof(tsg_type_t*) * verifier->n_values);
+    }
+
+    tsg_free(verifier->values);
+    verifier->values = values;
+    verifier->values_capacity = capacity;
+  }
+
+  verifier->values[verifier->n_values++] = type;
+}
+
+tsg_type_t* pop_value(tsg_verifier_t* verifier) {
+  tsg_assert(verifier->n_values > 0);
+  return verifier->values[--(verifier->n_values)];
+}
+
+void run(tsg_verifier_t* verifier) {
+  size_t n_run = 0;
+  while (verifier->n_tasks > 0 && verifier->aborted == false) {
+    // copied out, running it may push tasks and move the stack
+    tsg_task_t task = verifier->tasks[--(verifier->n_tasks)];
+    run_task(verifier, &task);
+
+    // a spec nobody waits for any more is left unfinished
+    if (is_main(verifier) == false && ++n_run % SPEC_POLL_TASKS == 0) {
+      tsg_mutex_lock(verifier->pool->mutex);
+      verifier->aborted = verifier->pool->closing;
+      tsg_mutex_unlock(verifier->pool->mutex);
+    }
+  }
+}
+
+void run_task(tsg_verifier_t* verifier, tsg_task_t* task) {
+  switch (task->kind) {
+    case TASK_BLOCK:
+      verify_block(verifier, task->block);
+      break;
+
+    case TASK_STMT_LIST:
+      verify_stmt_list(verifier, task->stmts);
+      break;
+
+    case TASK_STMT:
+      verify_stmt(verifier, task->stmt);
+      break;
+
+    case TASK_STMT_VAL:
+      verify_stmt_val(verifier, task->stmt);
+      break;
+
+    case TASK_EXPR:
+      verify_expr(verifier, task->expr);
+      break;
+
+    case TASK_EXPR_LIST:
+      verify_expr_list(verifier, task->exprs);
+      break;
+
+    case TASK_EXPR_BINARY:
+      verify_expr_binary(verifier, task->expr);
+      break;
+
+    case TASK_EXPR_CALL:
+      verify_expr_call(verifier, task->expr);
+      break;
+
+    case TASK_EXPR_CALLED:
+      verify_expr_called(verifier, task->expr);
+      break;
+
+    case TASK_EXPR_COND:
+      verify_expr_cond(verifier, task->expr);
+      break;
+
+    case TASK_EXPR_IFELSE:
+      verify_expr_ifelse(verifier, task->expr);
+      break;
+
+    case TASK_FUNC_RET: {
+      tsg_type_t* ret = pop_value(verifier);
+      lock_shared(verifier);
+      tsg_typetbl_func_ret(verifier->types,
+                           tsg_tyenv_get(verifier->tyenv, task->func->ftype),
+                           ret);
+      unlock_shared(verifier);
+      break;
+    }
+
+    case TASK_FUNC_LEAVE:
+      leave_func(verifier, task->func, task->tyenv);
+      break;
+  }
+}
+
+void begin_poly(tsg_verifier_t* verifier, tsg_type_t* poly,
+                tsg_type_arr_t* args) {
+  // leaves the FUNC type of the instance, once it has been verified
   tsg_assert(poly->kind == TSG_TYPE_POLY);
   tsg_assert(args->size == poly->poly.func->params->size);
 
-  tsg_tyenv_t* tyenv = tsg_tymap_get(poly->poly.tymap, args);
+  tsg_tyenv_t* tyenv = find_instance(verifier, poly, args);
+
+  if (verifier->aborted) {
+    tsg_type_arr_destroy(args);
+    return;
+  }
+  if (tyenv == NULL && verifier->pool != NULL && is_main(verifier) &&
+      adopt_spec(verifier, poly, args)) {
+    tsg_type_arr_destroy(args);
+    return;
+  }
 
   if (tyenv == NULL) {
     tyenv = tsg_tyenv_create(poly->poly.func->tyset, poly->poly.outer);
-    tsg_tymap_add(poly->poly.tymap, args, tyenv);
 
-    tsg_tyenv_t* stashed = verifier->tyenv;
+    push_task(verifier, TASK_FUNC_LEAVE, poly->poly.func);
+    verifier->tasks[verifier->n_tasks - 1].tyenv = verifier->tyenv;
+
     verifier->tyenv = tyenv;
-    verify_func(verifier, poly->poly.func, args);
-    verifier->tyenv = stashed;
+    // the env is complete before workers can find it; `args` is now the
+    // parameters of the FUNC type, and stays
+    begin_func(verifier, poly->poly.func, args);
+    add_instance(verifier, poly, args, tyenv);
   } else {
     tsg_type_arr_destroy(args);
+    push_value(verifier, tsg_tyenv_get(tyenv, poly->poly.func->ftype));
   }
-
-  return tsg_tyenv_get(tyenv, poly->poly.func->ftype);
 }
 
-void verify_func(tsg_verifier_t* verifier, tsg_func_t* func,
-                 tsg_type_arr_t* arg_types) {
+void begin_func(tsg_verifier_t* verifier, tsg_func_t* func,
+                tsg_type_arr_t* arg_types) {
   tsg_assert(func->params->size == arg_types->size);
 
-  tsg_type_t* func_type = tsg_type_create(TSG_TYPE_FUNC);
-  func_type->func.params = arg_types;
-  func_type->func.ret = tsg_type_create(TSG_TYPE_PEND);
+  tsg_type_t* func_type =
+      tsg_typetbl_func(verifier->types, arg_types, verifier->tyenv);
   tsg_tyenv_set(verifier->tyenv, func->ftype, func_type);
 
   tsg_decl_node_t* decl = func->params->head;
@@ -130,178 +531,240 @@ void verify_func(tsg_verifier_t* verifier, tsg_func_t* func,
     ptype++;
   }
 
-  tsg_type_t* ret_type = verify_block(verifier, func->body);
-  tsg_type_release(func_type->func.ret);
-  func_type->func.ret = ret_type;
-  tsg_type_release(func_type);
+  push_task(verifier, TASK_FUNC_RET, func);
+  push_task(verifier, TASK_BLOCK, func->body);
+}
+
+void leave_func(tsg_verifier_t* verifier, tsg_func_t* func,
+                tsg_tyenv_t* caller) {
+  tsg_tyenv_t* tyenv = verifier->tyenv;
+  verifier->tyenv = caller;
+
+  tyenv->pure = is_pure(func, tyenv);
+  push_value(verifier, tsg_tyenv_get(tyenv, func->ftype));
+}
+
+bool is_pure(tsg_func_t* func, tsg_tyenv_t* tyenv) {
+  // The language has no effects, so a function is pure unless it reads
+  // outer members, or takes a function whose frame it could read.
+  if (func->conv != TSG_FUNC_CLOSED) {
+    return false;
+  }
+
+  tsg_type_t* func_type = tsg_tyenv_get(tyenv, func->ftype);
+  if (!is_scalar(func_type->func.ret)) {
+    return false;
+  }
+
+  tsg_type_arr_t* params = func_type->func.params;
+  for (size_t i = 0; i < params->size; i++) {
+    if (!is_scalar(params->elem[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool is_scalar(tsg_type_t* type) {
+  return type != NULL &&
+         (type->kind == TSG_TYPE_INT || type->kind == TSG_TYPE_BOOL);
 }
 
-tsg_type_t* verify_block(tsg_verifier_t* verifier, tsg_block_t* block) {
+void verify_block(tsg_verifier_t* verifier, tsg_block_t* block) {
   verify_func_list(verifier, block->funcs);
-  return verify_stmt_list(verifier, block->stmts);
+  if (verifier->pool != NULL && is_main(verifier)) {
+    speculate_block(verifier, block);
+  }
+  // the type of the last statement, null while there is none
+  push_value(verifier, NULL);
+  push_task(verifier, TASK_STMT_LIST, block->stmts->head);
 }
 
 void verify_func_list(tsg_verifier_t* verifier, tsg_func_list_t* list) {
   tsg_func_node_t* node = list->head;
   while (node != NULL) {
-    tsg_type_t* type = tsg_type_create(TSG_TYPE_POLY);
-    type->poly.func = node->func;
-    type->poly.outer = verifier->tyenv;
-    type->poly.tymap = tsg_tymap_create();
+    tsg_type_t* type =
+        tsg_typetbl_poly(verifier->types, node->func, verifier->tyenv);
     tsg_tyenv_set(verifier->tyenv, node->func->decl->object->tyvar, type);
-    tsg_type_release(type);
 
     node = node->next;
   }
 }
 
-tsg_type_t* verify_stmt_list(tsg_verifier_t* verifier, tsg_stmt_list_t* list) {
-  tsg_type_t* last_stmt_type = NULL;
-
-  tsg_stmt_node_t* node = list->head;
-  while (node) {
-    if (last_stmt_type != NULL) {
-      tsg_type_release(last_stmt_type);
-    }
-
-    last_stmt_type = verify_stmt(verifier, node->stmt);
-    node = node->next;
+void verify_stmt_list(tsg_verifier_t* verifier, tsg_stmt_node_t* node) {
+  if (node == NULL) {
+    return;
   }
 
-  return last_stmt_type;
+  // the statement replaces the type of the one before it
+  pop_value(verifier);
+  push_task(verifier, TASK_STMT_LIST, node->next);
+  push_task(verifier, TASK_STMT, node->stmt);
 }
 
-tsg_type_t* verify_stmt(tsg_verifier_t* verifier, tsg_stmt_t* stmt) {
+void verify_stmt(tsg_verifier_t* verifier, tsg_stmt_t* stmt) {
   switch (stmt->kind) {
     case TSG_STMT_VAL:
-      return verify_stmt_val(verifier, stmt);
+      push_task(verifier, TASK_STMT_VAL, stmt);
+      push_task(verifier, TASK_EXPR, stmt->val.expr);
+      return;
 
     case TSG_STMT_EXPR:
-      return verify_stmt_expr(verifier, stmt);
+      push_task(verifier, TASK_EXPR, stmt->expr.expr);
+      return;
   }
 
-  return NULL;
+  push_value(verifier, NULL);
 }
 
-tsg_type_t* verify_stmt_val(tsg_verifier_t* verifier, tsg_stmt_t* stmt) {
+void verify_stmt_val(tsg_verifier_t* verifier, tsg_stmt_t* stmt) {
   tsg_assert(stmt != NULL && stmt->kind == TSG_STMT_VAL);
 
-  tsg_type_t* type = verify_expr(verifier, stmt->val.expr);
+  // the type of the expression stays as that of the statement
+  tsg_type_t* type = verifier->values[verifier->n_values - 1];
   tsg_tyenv_set(verifier->tyenv, stmt->val.decl->object->tyvar, type);
-
-  return type;
-}
-
-tsg_type_t* verify_stmt_expr(tsg_verifier_t* verifier, tsg_stmt_t* stmt) {
-  tsg_assert(stmt != NULL && stmt->kind == TSG_STMT_EXPR);
-  return verify_expr(verifier, stmt->expr.expr);
 }
 
-tsg_type_t* verify_expr(tsg_verifier_t* verifier, tsg_expr_t* expr) {
-  tsg_type_t* type = NULL;
-
+void verify_expr(tsg_verifier_t* verifier, tsg_expr_t* expr) {
   switch (expr->kind) {
     case TSG_EXPR_BINARY:
-      type = verify_expr_binary(verifier, expr);
-      break;
+      push_task(verifier, TASK_EXPR_BINARY, expr);
+      push_task(verifier, TASK_EXPR, expr->binary.rhs);
+      push_task(verifier, TASK_EXPR, expr->binary.lhs);
+      return;
 
     case TSG_EXPR_CALL:
-      type = verify_expr_call(verifier, expr);
-      break;
+      push_task(verifier, TASK_EXPR_CALL, expr);
+      push_task(verifier, TASK_EXPR_LIST, expr->call.args->head);
+      push_task(verifier, TASK_EXPR, expr->call.callee);
+      return;
 
     case TSG_EXPR_IFELSE:
-      type = verify_expr_ifelse(verifier, expr);
-      break;
+      push_task(verifier, TASK_EXPR_IFELSE, expr);
+      push_task(verifier, TASK_BLOCK, expr->ifelse.els);
+      push_task(verifier, TASK_BLOCK, expr->ifelse.thn);
+      push_task(verifier, TASK_EXPR_COND, expr);
+      push_task(verifier, TASK_EXPR, expr->ifelse.cond);
+      return;
 
     case TSG_EXPR_IDENT:
-      type = verify_expr_ident(verifier, expr);
-      break;
+      tsg_assert(expr->ident.object != NULL);
+      finish_expr(verifier, expr,
+                  tsg_tyenv_get(verifier->tyenv, expr->ident.object->tyvar));
+      return;
 
     case TSG_EXPR_NUMBER:
-      type = verify_expr_number(verifier, expr);
-      break;
+      finish_expr(verifier, expr,
+                  tsg_typetbl_prim(verifier->types, TSG_TYPE_INT));
+      return;
   }
 
+  push_value(verifier, NULL);
+}
+
+void finish_expr(tsg_verifier_t* verifier, tsg_expr_t* expr,
+                 tsg_type_t* type) {
   if (type != NULL) {
     tsg_tyenv_set(verifier->tyenv, expr->tyvar, type);
   }
 
-  return type;
+  push_value(verifier, type);
 }
 
-tsg_type_t* verify_expr_binary(tsg_verifier_t* verifier, tsg_expr_t* expr) {
+void verify_expr_binary(tsg_verifier_t* verifier, tsg_expr_t* expr) {
   tsg_assert(expr != NULL && expr->kind == TSG_EXPR_BINARY);
 
-  tsg_type_t* lhs_type = verify_expr(verifier, expr->binary.lhs);
-  tsg_type_t* rhs_type = verify_expr(verifier, expr->binary.rhs);
+  tsg_type_t* rhs_type = pop_value(verifier);
+  tsg_type_t* lhs_type = pop_value(verifier);
 
   if (lhs_type == NULL || rhs_type == NULL) {
-    return NULL;
+    finish_expr(verifier, expr, NULL);
+    return;
   }
 
-  tsg_type_t* ret_type = tsg_type_binary(expr->binary.op, lhs_type, rhs_type);
+  tsg_type_t* ret_type =
+      tsg_type_binary(verifier->types, expr->binary.op, lhs_type, rhs_type);
   if (ret_type == NULL) {
     error(verifier, &(expr->loc), "incompatible type");
   }
 
-  tsg_type_release(lhs_type);
-  tsg_type_release(rhs_type);
-
-  return ret_type;
+  finish_expr(verifier, expr, ret_type);
 }
 
-tsg_type_t* verify_expr_call(tsg_verifier_t* verifier, tsg_expr_t* expr) {
+void verify_expr_call(tsg_verifier_t* verifier, tsg_expr_t* expr) {
   tsg_assert(expr != NULL && expr->kind == TSG_EXPR_CALL);
 
-  tsg_type_t* callee_type = verify_expr(verifier, expr->call.callee);
-  tsg_type_arr_t* arg_types = verify_expr_list(verifier, expr->call.args);
+  size_t n_args = expr->call.args->size;
+  tsg_type_arr_t* arg_types = tsg_type_arr_create(n_args);
+  verifier->n_values -= n_args;
+  for (size_t i = 0; i < n_args; i++) {
+    arg_types->elem[i] = verifier->values[verifier->n_values + i];
+  }
+  tsg_type_t* callee_type = pop_value(verifier);
 
   if (callee_type == NULL) {
-    return NULL;
+    tsg_type_arr_destroy(arg_types);
+    finish_expr(verifier, expr, NULL);
+    return;
   }
 
-  if (callee_type->kind != TSG_TYPE_POLY) {
-    error(verifier, &(expr->call.callee->loc), "callee is not a function");
-    return NULL;
+  for (size_t i = 0; i < arg_types->size; i++) {
+    if (arg_types->elem[i] == NULL) {
+      // the argument has already been reported
+      tsg_type_arr_destroy(arg_types);
+      finish_expr(verifier, expr, NULL);
+      return;
+    }
   }
 
-  if (expr->call.args->size < callee_type->poly.func->params->size) {
+  bool failed = true;
+  if (callee_type->kind != TSG_TYPE_POLY) {
+    error(verifier, &(expr->call.callee->loc), "callee is not a function");
+  } else if (n_args < callee_type->poly.func->params->size) {
     error(verifier, &(expr->loc), "too few arguments");
-    return NULL;
-  }
-  if (expr->call.args->size > callee_type->poly.func->params->size) {
+  } else if (n_args > callee_type->poly.func->params->size) {
     error(verifier, &(expr->loc), "too many arguments");
-    return NULL;
+  } else {
+    failed = false;
+  }
+  if (failed) {
+    tsg_type_arr_destroy(arg_types);
+    finish_expr(verifier, expr, NULL);
+    return;
   }
 
-  tsg_type_t* func_type = verify_poly(verifier, callee_type, arg_types);
+  push_task(verifier, TASK_EXPR_CALLED, expr);
+  begin_poly(verifier, callee_type, arg_types);
+}
+
+void verify_expr_called(tsg_verifier_t* verifier, tsg_expr_t* expr) {
+  tsg_type_t* func_type = pop_value(verifier);
   tsg_assert(func_type->kind == TSG_TYPE_FUNC);
   tsg_tyenv_set(verifier->tyenv, expr->call.ftype, func_type);
-  tsg_type_release(callee_type);
 
-  tsg_type_t* type = func_type->func.ret;
-  if (type != NULL) {
-    tsg_type_retain(type);
-  }
-
-  return type;
+  finish_expr(verifier, expr, func_type->func.ret);
 }
 
-tsg_type_t* verify_expr_ifelse(tsg_verifier_t* verifier, tsg_expr_t* expr) {
+void verify_expr_cond(tsg_verifier_t* verifier, tsg_expr_t* expr) {
   tsg_assert(expr != NULL && expr->kind == TSG_EXPR_IFELSE);
 
-  tsg_type_t* cond_type = verify_expr(verifier, expr->ifelse.cond);
+  tsg_type_t* cond_type = pop_value(verifier);
   if (cond_type && cond_type->kind != TSG_TYPE_BOOL) {
     error(verifier, &(expr->ifelse.cond->loc),
           "cond expr must have boolean type");
   }
-  tsg_type_release(cond_type);
+}
 
-  tsg_type_t* thn_type = verify_block(verifier, expr->ifelse.thn);
-  tsg_type_t* els_type = verify_block(verifier, expr->ifelse.els);
+void verify_expr_ifelse(tsg_verifier_t* verifier, tsg_expr_t* expr) {
+  tsg_assert(expr != NULL && expr->kind == TSG_EXPR_IFELSE);
+
+  tsg_type_t* els_type = pop_value(verifier);
+  tsg_type_t* thn_type = pop_value(verifier);
 
   if (thn_type == NULL || els_type == NULL) {
-    return NULL;
+    finish_expr(verifier, expr, NULL);
+    return;
   }
 
   tsg_type_t* ret_type = tsg_type_unify(thn_type, els_type);
@@ -310,38 +773,512 @@ tsg_type_t* verify_expr_ifelse(tsg_verifier_t* verifier, tsg_expr_t* expr) {
           "type miss match with thn_block and els_block");
   }
 
-  tsg_type_release(thn_type);
-  tsg_type_release(els_type);
+  finish_expr(verifier, expr, ret_type);
+}
+
+void verify_expr_list(tsg_verifier_t* verifier, tsg_expr_node_t* node) {
+  // leaves the type of each expression, in order
+  if (node == NULL) {
+    return;
+  }
+
+  push_task(verifier, TASK_EXPR_LIST, node->next);
+  push_task(verifier, TASK_EXPR, node->expr);
+}
+
+bool is_main(const tsg_verifier_t* verifier) {
+  return verifier->spec == NULL;
+}
+
+void lock_shared(tsg_verifier_t* verifier) {
+  // a worker writes only what is its own
+  if (verifier->pool != NULL && is_main(verifier)) {
+    tsg_mutex_lock(verifier->pool->mutex);
+  }
+}
+
+void unlock_shared(tsg_verifier_t* verifier) {
+  if (verifier->pool != NULL && is_main(verifier)) {
+    tsg_mutex_unlock(verifier->pool->mutex);
+  }
+}
+
+tsg_tyenv_t* find_instance(tsg_verifier_t* verifier, tsg_type_t* poly,
+                           tsg_type_arr_t* args) {
+  // the main walker is the only one to add to the shared tymaps, and so
+  // reads them unlocked; a worker also has polys of its own, whose outer
+  // env is not in the insttbl yet
+  if (is_main(verifier) || poly->poly.outer->id < 0) {
+    return tsg_tymap_get(poly->poly.tymap, args);
+  }
+
+  tsg_spec_t* spec = verifier->spec;
+  tsg_tyenv_t* tyenv = instmap_get(&(spec->overlay), poly, args);
+  if (tyenv != NULL) {
+    return tyenv;
+  }
+
+  tsg_mutex_lock(verifier->pool->mutex);
+  tyenv = tsg_tymap_get(poly->poly.tymap, args);
+  if (tyenv != NULL) {
+    // the return type of one being verified is still pending, while what
+    // a call of it sees depends on when the main walker gets to the call
+    tsg_type_t* func_type = tsg_tyenv_get(tyenv, poly->poly.func->ftype);
+    if (func_type->func.ret != NULL && func_type->func.sig == NULL) {
+      verifier->aborted = true;
+    }
+  }
+  tsg_mutex_unlock(verifier->pool->mutex);
+
+  return tyenv;
+}
+
+void add_instance(tsg_verifier_t* verifier, tsg_type_t* poly,
+                  tsg_type_arr_t* args, tsg_tyenv_t* tyenv) {
+  if (is_main(verifier)) {
+    lock_shared(verifier);
+    tsg_tymap_add(poly->poly.tymap, args, tyenv);
+    tsg_insttbl_add(verifier->instances, poly->poly.func, tyenv);
+    unlock_shared(verifier);
+    return;
+  }
+
+  tsg_spec_t* spec = verifier->spec;
+  if (spec->n_insts == spec->insts_capacity) {
+    size_t capacity = spec->insts_capacity > 0 ? spec->insts_capacity * 2
+                                               : VERIFIER_MIN_CAPACITY;
+    tsg_spec_inst_t* insts = tsg_malloc_arr(tsg_spec_inst_t, capacity);
+    if (spec->n_insts > 0) {
+      tsg_memcpy(insts, spec->insts, sizeof(tsg_spec_inst_t) * spec->n_insts);
+    }
+
+    tsg_free(spec->insts);
+    spec->insts = insts;
+    spec->insts_capacity = capacity;
+  }
+
+  tsg_spec_inst_t* inst = &(spec->insts[spec->n_insts++]);
+  inst->poly = poly;
+  inst->env = tyenv;
+  if (poly->poly.outer->id < 0) {
+    inst->args = NULL;
+    tsg_tymap_add(poly->poly.tymap, args, tyenv);
+  } else {
+    inst->args = tsg_type_arr_dup(args);
+    instmap_add(&(spec->overlay), poly, inst->args, tyenv);
+  }
+}
+
+tsg_pool_t* create_pool(int32_t n_threads, tsg_typetbl_t* types) {
+  tsg_pool_t* pool = tsg_malloc_obj(tsg_pool_t);
+  pool->mutex = tsg_mutex_create();
+  pool->cond = tsg_cond_create();
+  pool->threads = tsg_malloc_arr(tsg_thread_t*, n_threads);
+  pool->n_threads = 0;
+  pool->types = types;
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->closing = false;
+  instmap_init(&(pool->specs));
+
+  if (pool->mutex != NULL && pool->cond != NULL) {
+    for (int32_t i = 0; i < n_threads; i++) {
+      tsg_thread_t* thread = tsg_thread_create(run_worker, pool);
+      if (thread == NULL) {
+        break;
+      }
+      pool->threads[pool->n_threads++] = thread;
+    }
+  }
+
+  if (pool->n_threads == 0) {
+    destroy_pool(pool);
+    return NULL;
+  }
 
-  return ret_type;
+  return pool;
 }
 
-tsg_type_t* verify_expr_ident(tsg_verifier_t* verifier, tsg_expr_t* expr) {
-  tsg_assert(expr != NULL && expr->kind == TSG_EXPR_IDENT);
-  tsg_assert(expr->ident.object != NULL);
+void destroy_pool(tsg_pool_t* pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  if (pool->n_threads > 0) {
+    tsg_mutex_lock(pool->mutex);
+    pool->closing = true;
+    tsg_cond_broadcast(pool->cond);
+    tsg_mutex_unlock(pool->mutex);
+
+    for (int32_t i = 0; i < pool->n_threads; i++) {
+      tsg_thread_join(pool->threads[i]);
+    }
+  }
+
+  tsg_instmap_entry_t* entry = pool->specs.entries;
+  tsg_instmap_entry_t* end = entry + pool->specs.capacity;
+  while (entry < end) {
+    if (entry->poly != NULL) {
+      tsg_spec_t* spec = (tsg_spec_t*)entry->value;
+      release_spec(spec);
+      tsg_type_arr_destroy(spec->args);
+      tsg_free(spec);
+    }
+    entry++;
+  }
+  instmap_release(&(pool->specs));
 
-  tsg_type_t* type = tsg_tyenv_get(verifier->tyenv, expr->ident.object->tyvar);
-  tsg_type_retain(type);
-  return type;
+  tsg_free(pool->threads);
+  tsg_cond_destroy(pool->cond);
+  tsg_mutex_destroy(pool->mutex);
+  tsg_free(pool);
 }
 
-tsg_type_t* verify_expr_number(tsg_verifier_t* verifier, tsg_expr_t* expr) {
-  (void)verifier;
-  tsg_assert(expr != NULL && expr->kind == TSG_EXPR_NUMBER);
+void run_worker(void* arg) {
+  tsg_pool_t* pool = (tsg_pool_t*)arg;
 
-  return tsg_type_create(TSG_TYPE_INT);
+  tsg_mutex_lock(pool->mutex);
+  while (true) {
+    while (pool->closing == false && pool->head == NULL) {
+      tsg_cond_wait(pool->cond, pool->mutex);
+    }
+    if (pool->closing) {
+      break;
+    }
+
+    tsg_spec_t* spec = pool->head;
+    pool->head = spec->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    if (spec->state == SPEC_CANCELLED) {
+      continue;
+    }
+
+    spec->state = SPEC_RUNNING;
+    tsg_mutex_unlock(pool->mutex);
+    run_spec(pool, spec);
+    tsg_mutex_lock(pool->mutex);
+    spec->state = SPEC_DONE;
+    tsg_cond_broadcast(pool->cond);
+  }
+  tsg_mutex_unlock(pool->mutex);
 }
 
-tsg_type_arr_t* verify_expr_list(tsg_verifier_t* verifier,
-                                 tsg_expr_list_t* list) {
-  tsg_type_arr_t* arr = tsg_type_arr_create(list->size);
-  tsg_type_t** p = arr->elem;
+void run_spec(tsg_pool_t* pool, tsg_spec_t* spec) {
+  tsg_verifier_t* verifier = tsg_verifier_create();
+  spec->types = tsg_typetbl_fork(pool->types);
+  verifier->types = spec->types;
+  verifier->pool = pool;
+  verifier->spec = spec;
+
+  // the caller's env is given back once the instance is done, and any one
+  // will do, as the worker verifies nothing else
+  verifier->tyenv = spec->poly->poly.outer;
+  begin_poly(verifier, spec->poly, tsg_type_arr_dup(spec->args));
+  run(verifier);
+
+  spec->aborted = verifier->aborted;
+  if (spec->aborted == false) {
+    spec->func_type = pop_value(verifier);
+  }
+  tsg_errlist_splice(&(spec->errors), &(verifier->errors));
 
-  tsg_expr_node_t* node = list->head;
-  while (node) {
-    *(p++) = verify_expr(verifier, node->expr);
+  verifier->tyenv = NULL;
+  tsg_verifier_destroy(verifier);
+}
+
+void speculate_block(tsg_verifier_t* verifier, tsg_block_t* block) {
+  // the calls in the statements of the block, in the order they appear,
+  // but not those in nested blocks, which are handed over as they begin
+  tsg_expr_t* exprs[SPEC_MAX_EXPRS];
+  size_t n_exprs = 0;
+
+  tsg_stmt_node_t* node = block->stmts->head;
+  while (node != NULL) {
+    tsg_stmt_t* stmt = node->stmt;
     node = node->next;
+
+    switch (stmt->kind) {
+      case TSG_STMT_VAL:
+        exprs[n_exprs++] = stmt->val.expr;
+        break;
+
+      case TSG_STMT_EXPR:
+        exprs[n_exprs++] = stmt->expr.expr;
+        break;
+
+      default:
+        continue;
+    }
+
+    while (n_exprs > 0) {
+      tsg_expr_t* expr = exprs[--n_exprs];
+
+      switch (expr->kind) {
+        case TSG_EXPR_BINARY:
+          if (n_exprs + 2 <= SPEC_MAX_EXPRS) {
+            exprs[n_exprs++] = expr->binary.rhs;
+            exprs[n_exprs++] = expr->binary.lhs;
+          }
+          break;
+
+        case TSG_EXPR_CALL: {
+          speculate_call(verifier, expr);
+
+          size_t n_args = expr->call.args->size;
+          if (n_exprs + n_args <= SPEC_MAX_EXPRS) {
+            n_exprs += n_args;
+            tsg_expr_node_t* arg = expr->call.args->head;
+            for (size_t i = 1; i <= n_args; i++) {
+              exprs[n_exprs - i] = arg->expr;
+              arg = arg->next;
+            }
+          }
+          break;
+        }
+
+        case TSG_EXPR_IFELSE:
+          exprs[n_exprs++] = expr->ifelse.cond;
+          break;
+
+        default:
+          break;
+      }
+    }
+  }
+}
+
+void speculate_call(tsg_verifier_t* verifier, tsg_expr_t* expr) {
+  tsg_expr_t* callee = expr->call.callee;
+  if (callee->kind != TSG_EXPR_IDENT || callee->ident.object->func == NULL) {
+    return;
+  }
+
+  tsg_type_t* poly =
+      tsg_tyenv_get(verifier->tyenv, callee->ident.object->tyvar);
+  if (poly == NULL || poly->kind != TSG_TYPE_POLY ||
+      poly->poly.func->params->size != expr->call.args->size) {
+    return;
+  }
+
+  tsg_type_arr_t* args = tsg_type_arr_create(expr->call.args->size);
+  tsg_expr_node_t* arg = expr->call.args->head;
+  for (size_t i = 0; i < args->size; i++) {
+    args->elem[i] = known_type(verifier, arg->expr, SPEC_MAX_DEPTH);
+    if (args->elem[i] == NULL) {
+      tsg_type_arr_destroy(args);
+      return;
+    }
+    arg = arg->next;
+  }
+
+  tsg_pool_t* pool = verifier->pool;
+  if (tsg_tymap_get(poly->poly.tymap, args) != NULL ||
+      instmap_get(&(pool->specs), poly, args) != NULL) {
+    tsg_type_arr_destroy(args);
+    return;
+  }
+
+  tsg_spec_t* spec = tsg_malloc_obj(tsg_spec_t);
+  tsg_memset(spec, 0, sizeof(tsg_spec_t));
+  spec->poly = poly;
+  spec->args = args;
+  spec->state = SPEC_QUEUED;
+  tsg_errlist_init(&(spec->errors));
+  instmap_init(&(spec->overlay));
+  instmap_add(&(pool->specs), poly, args, spec);
+
+  tsg_mutex_lock(pool->mutex);
+  if (pool->tail == NULL) {
+    pool->head = spec;
+  } else {
+    pool->tail->next = spec;
+  }
+  pool->tail = spec;
+  tsg_cond_broadcast(pool->cond);
+  tsg_mutex_unlock(pool->mutex);
+}
+
+tsg_type_t* known_type(tsg_verifier_t* verifier, tsg_expr_t* expr,
+                       int32_t depth) {
+  // the type `expr` will be verified to have, if it is clear beforehand,
+  // or NULL; a member keeps the one type it has once it is set
+  switch (expr->kind) {
+    case TSG_EXPR_NUMBER:
+      return tsg_typetbl_prim(verifier->types, TSG_TYPE_INT);
+
+    case TSG_EXPR_IDENT:
+      return tsg_tyenv_get(verifier->tyenv, expr->ident.object->tyvar);
+
+    case TSG_EXPR_BINARY: {
+      if (depth == 0) {
+        return NULL;
+      }
+      tsg_type_t* lhs_type = known_type(verifier, expr->binary.lhs, depth - 1);
+      tsg_type_t* rhs_type = known_type(verifier, expr->binary.rhs, depth - 1);
+      if (lhs_type == NULL || rhs_type == NULL) {
+        return NULL;
+      }
+      return tsg_type_binary(verifier->types, expr->binary.op, lhs_type,
+                             rhs_type);
+    }
+
+    default:
+      return NULL;
+  }
+}
+
+bool adopt_spec(tsg_verifier_t* verifier, tsg_type_t* poly,
+                tsg_type_arr_t* args) {
+  tsg_pool_t* pool = verifier->pool;
+  tsg_spec_t* spec = instmap_get(&(pool->specs), poly, args);
+  if (spec == NULL) {
+    return false;
+  }
+
+  tsg_mutex_lock(pool->mutex);
+  if (spec->state == SPEC_QUEUED) {
+    spec->state = SPEC_CANCELLED;
+  }
+  while (spec->state == SPEC_RUNNING) {
+    tsg_cond_wait(pool->cond, pool->mutex);
+  }
+
+  bool adopted = (spec->state == SPEC_DONE && spec->aborted == false);
+  for (size_t i = 0; adopted && i < spec->n_insts; i++) {
+    tsg_spec_inst_t* inst = &(spec->insts[i]);
+    if (inst->args != NULL &&
+        tsg_tymap_get(inst->poly->poly.tymap, inst->args) != NULL) {
+      adopted = false;
+    }
   }
 
-  return arr;
+  if (adopted) {
+    tsg_typetbl_join(verifier->types, spec->types);
+    spec->types = NULL;
+
+    for (size_t i = 0; i < spec->n_insts; i++) {
+      tsg_spec_inst_t* inst = &(spec->insts[i]);
+      if (inst->args != NULL) {
+        tsg_tymap_add(inst->poly->poly.tymap, inst->args, inst->env);
+      }
+      tsg_insttbl_add(verifier->instances, inst->poly->poly.func, inst->env);
+      // owned by the tymap from now on
+      inst->env = NULL;
+    }
+  }
+  tsg_mutex_unlock(pool->mutex);
+
+  if (adopted) {
+    tsg_errlist_splice(&(verifier->errors), &(spec->errors));
+    push_value(verifier, spec->func_type);
+  }
+  release_spec(spec);
+
+  return adopted;
+}
+
+void release_spec(tsg_spec_t* spec) {
+  // what the worker left, once adopted or dropped
+  for (size_t i = 0; i < spec->n_insts; i++) {
+    tsg_spec_inst_t* inst = &(spec->insts[i]);
+    if (inst->args != NULL) {
+      tsg_type_arr_destroy(inst->args);
+      tsg_tyenv_destroy(inst->env);
+    }
+  }
+  tsg_free(spec->insts);
+  spec->insts = NULL;
+  spec->n_insts = 0;
+  spec->insts_capacity = 0;
+
+  instmap_release(&(spec->overlay));
+  // the envs of its own polys go with their tymaps
+  tsg_typetbl_destroy(spec->types);
+  spec->types = NULL;
+  tsg_errlist_release(&(spec->errors));
+}
+
+void instmap_init(tsg_instmap_t* map) {
+  map->entries = NULL;
+  map->capacity = 0;
+  map->size = 0;
+}
+
+void instmap_release(tsg_instmap_t* map) {
+  tsg_free(map->entries);
+  instmap_init(map);
+}
+
+void instmap_add(tsg_instmap_t* map, tsg_type_t* poly, tsg_type_arr_t* args,
+                 void* value) {
+  // at most three quarters full, so that probes stay short
+  if ((map->size + 1) * 4 > map->capacity * 3) {
+    size_t capacity = map->capacity > 0 ? map->capacity * 2
+                                        : INSTMAP_MIN_CAPACITY;
+    tsg_instmap_entry_t* entries =
+        tsg_malloc_arr(tsg_instmap_entry_t, capacity);
+    tsg_memset(entries, 0, sizeof(tsg_instmap_entry_t) * capacity);
+
+    for (size_t i = 0; i < map->capacity; i++) {
+      tsg_instmap_entry_t* entry = &(map->entries[i]);
+      if (entry->poly != NULL) {
+        *instmap_find(entries, capacity, entry->hash, entry->poly,
+                      entry->args) = *entry;
+      }
+    }
+
+    tsg_free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+  }
+
+  size_t hash = instmap_hash(poly, args);
+  tsg_instmap_entry_t* entry =
+      instmap_find(map->entries, map->capacity, hash, poly, args);
+  tsg_assert(entry->poly == NULL);
+
+  entry->hash = hash;
+  entry->poly = poly;
+  entry->args = args;
+  entry->value = value;
+  map->size += 1;
+}
+
+void* instmap_get(tsg_instmap_t* map, tsg_type_t* poly, tsg_type_arr_t* args) {
+  if (map->size == 0) {
+    return NULL;
+  }
+
+  tsg_instmap_entry_t* entry = instmap_find(
+      map->entries, map->capacity, instmap_hash(poly, args), poly, args);
+  return entry->poly != NULL ? entry->value : NULL;
+}
+
+tsg_instmap_entry_t* instmap_find(tsg_instmap_entry_t* entries,
+                                  size_t capacity, size_t hash,
+                                  tsg_type_t* poly, tsg_type_arr_t* args) {
+  size_t mask = capacity - 1;
+  size_t i = hash & mask;
+
+  // the table is never full, so this reaches an empty entry at the latest
+  while (entries[i].poly != NULL) {
+    if (entries[i].hash == hash && entries[i].poly == poly &&
+        tsg_type_arr_equals(args, entries[i].args)) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return &(entries[i]);
+}
+
+size_t instmap_hash(tsg_type_t* poly, tsg_type_arr_t* args) {
+  // allocations are aligned, which leaves the low bits all the same
+  uintptr_t bits = (uintptr_t)poly;
+  size_t seed = tsg_type_arr_hash(args);
+  size_t value = (size_t)(bits ^ (bits >> 4) ^ (bits >> 16));
+  return seed ^ (value + (size_t)0x9e3779b97f4a7c15ULL + (seed << 6) +
+                 (seed >> 2));
 }
@@ -6,95 +6,203 @@
 
 #include "compiler.h"
 
+#include "disk_cache.h"
+#include "evaluator.h"
+#include "lowering.h"
+#include "mir_passes.h"
+#include "program.h"
 #include <tsugu/core/platform.h>
-#include <tsugu/core/tymap.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Verifier.h>
-#include <llvm/Support/TargetSelect.h>
+#include <algorithm>
 
 using namespace tsugu;
 
-typedef int32_t (*main_func_t)(void);
+static void describe_type(std::string* out, tsg_type_t* type) {
+  switch (type->kind) {
+    case TSG_TYPE_BOOL:
+      *out += "bool";
+      break;
+
+    case TSG_TYPE_INT:
+      *out += "int";
+      break;
 
-Compiler::Compiler()
-    : context(),
-      builder(context),
+    case TSG_TYPE_FUNC:
+      *out += "(";
+      for (size_t i = 0; i < type->func.params->size; i++) {
+        if (i > 0) {
+          *out += ", ";
+        }
+        describe_type(out, type->func.params->elem[i]);
+      }
+      *out += ") -> ";
+      describe_type(out, type->func.ret);
+      break;
+
+    case TSG_TYPE_POLY:
+      // a function value is known by the function it refers to
+      *out += tsg_ident_cstr(type->poly.func->decl->name);
+      break;
+
+    case TSG_TYPE_PEND:
+      *out += "?";
+      break;
+  }
+}
+
+Compiler::Compiler(llvm::LLVMContext& llvm_context, Program* owner)
+    : context(llvm_context),
+      builder(llvm_context),
       module(nullptr),
+      program(owner),
+      profile(owner != nullptr ? owner->getPgoProfile() : nullptr),
+      instrumenting(owner != nullptr && owner->isInstrumenting()),
       tyenv(nullptr),
-      frametype(nullptr),
-      frameptr(nullptr),
-      function_table(nullptr) {}
+      values(),
+      blocks(),
+      function_table(nullptr),
+      memo_table(nullptr) {}
 
 Compiler::~Compiler() {}
 
-int32_t Compiler::run(tsg_ast_t* ast) {
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
+std::unique_ptr<llvm::Module> Compiler::compile(tsg_ast_t* ast) {
+  auto module_owner = createModule("main_module");
+  // Lazy and partitioned programs compile each instance on its own.
+  bool whole_program = program == nullptr ||
+                       (!program->isLazy() && !program->isPartitioned());
+  auto root = buildInstance(ast->root, ast->tyenv, whole_program);
 
-  auto moduleOwner = llvm::make_unique<llvm::Module>("main_module", context);
-  module = moduleOwner.get();
+  // The program looks up nothing but `$main`, so whatever the inliner
+  // folds into it can be dropped.
+  internalizeExcept(root);
 
-  function_table = new FunctionTable();
+  return finishModule(std::move(module_owner));
+}
 
-  buildAst(ast, ast->tyenv);
-  module->print(llvm::errs(), nullptr);
+std::unique_ptr<llvm::Module> Compiler::compileStandalone(tsg_ast_t* ast) {
+  auto module_owner = createModule("main_module");
 
-  if (llvm::verifyModule(*module, &(llvm::errs()))) {
-    llvm::errs() << "verifyModule Failed\n";
-    return -1;
-  }
+  // Claim the C symbols before any tsugu function can take their names.
+  auto startup_type = llvm::FunctionType::get(builder.getInt32Ty(), false);
+  auto startup = llvm::Function::Create(
+      startup_type, llvm::Function::ExternalLinkage, "main", module);
+  std::vector<llvm::Type*> printf_params;
+  printf_params.push_back(builder.getInt8PtrTy());
+  auto printf_type =
+      llvm::FunctionType::get(builder.getInt32Ty(), printf_params, true);
+  auto printf_func = llvm::Function::Create(
+      printf_type, llvm::Function::ExternalLinkage, "printf", module);
 
-  std::string err;
-  auto engine =
-      llvm::EngineBuilder(std::move(moduleOwner)).setErrorStr(&err).create();
+  auto root = buildInstance(ast->root, ast->tyenv, true);
+  buildStartup(startup, root, printf_func);
 
-  if (!engine) {
-    llvm::errs() << err << "\n";
-    return -1;
-  }
+  // Only `main` is exported, so tsugu functions never clash with libc.
+  internalizeExcept(startup);
 
-  auto f = (main_func_t)engine->getFunctionAddress(
-      tsg_ident_cstr(ast->root->decl->name));
-  if (!f) {
-    llvm::errs() << "function not found\n";
-    return -1;
-  }
-  int32_t result = f();
+  return finishModule(std::move(module_owner));
+}
 
-  engine->finalizeObject();
-  delete engine;
-  delete function_table;
+std::unique_ptr<llvm::Module> Compiler::compileInstance(
+    tsg_func_t* func, tsg_tyenv_t* env, const std::string& name) {
+  auto module_owner = createModule(name);
+  auto llvm_func = buildInstance(func, env, false);
+  llvm_func->setName(name);
+  return finishModule(std::move(module_owner));
+}
 
-  return result;
+std::unique_ptr<llvm::Module> Compiler::compileEntry(
+    tsg_func_t* func, tsg_tyenv_t* env, const std::string& callee_name,
+    const std::string& name) {
+  auto module_owner = createModule(name);
+  auto callee = llvm::Function::Create(convInstanceTy(func, env),
+                                       llvm::Function::ExternalLinkage,
+                                       callee_name, module);
+  callee->setCallingConv(llvm::CallingConv::Fast);
+  buildEntry(func, env, callee, name);
+  return finishModule(std::move(module_owner));
 }
 
-void Compiler::store(tsg_member_t* member, llvm::Value* value) {
-  builder.CreateStore(value, createObjPtr(member));
+void Compiler::layoutFrame(tsg_frame_t* frame, tsg_tyenv_t* env,
+                           const llvm::DataLayout& data_layout,
+                           FrameLayout* layout) {
+  auto stashed_env = this->tyenv;
+  this->tyenv = env;
+  auto frame_type = convFrameTy(frame);
+  this->tyenv = stashed_env;
+
+  auto struct_layout = data_layout.getStructLayout(frame_type);
+  layout->size = struct_layout->getSizeInBytes();
+  layout->align = data_layout.getABITypeAlignment(frame_type);
+  layout->offsets.clear();
+  layout->sizes.clear();
+  for (unsigned i = 0; i < frame_type->getNumElements(); i++) {
+    layout->offsets.push_back(struct_layout->getElementOffset(i));
+    layout->sizes.push_back(
+        data_layout.getTypeStoreSize(frame_type->getElementType(i)));
+  }
 }
 
-llvm::Value* Compiler::load(tsg_member_t* member) {
-  return builder.CreateLoad(createObjPtr(member));
+std::string Compiler::describeInstance(tsg_func_t* func, tsg_tyenv_t* env) {
+  std::string name = tsg_ident_cstr(func->decl->name);
+
+  auto params = tsg_tyenv_get(env, func->ftype)->func.params;
+  name += "(";
+  for (size_t i = 0; i < params->size; i++) {
+    if (i > 0) {
+      name += ", ";
+    }
+    describe_type(&name, params->elem[i]);
+  }
+  name += ")";
+
+  return name;
 }
 
-llvm::Value* Compiler::createObjPtr(tsg_member_t* member) {
-  return createObjPtrRaw(member->depth, member->index + 1);
+std::unique_ptr<llvm::Module> Compiler::createModule(const std::string& name) {
+  auto module_owner = llvm::make_unique<llvm::Module>(name, context);
+  module = module_owner.get();
+  function_table = new FunctionTable();
+  return module_owner;
 }
 
-llvm::Value* Compiler::createObjPtrRaw(int32_t depth, int32_t index) {
-  llvm::Value* fp = this->frameptr;
-  tsg_frame_t* ft = this->frametype;
-  assert(0 <= depth && depth <= ft->depth);
+std::unique_ptr<llvm::Module> Compiler::finishModule(
+    std::unique_ptr<llvm::Module> module_owner) {
+  if (program != nullptr && program->isDumpingIr()) {
+    module->print(llvm::errs(), nullptr);
+  }
+
+  delete function_table;
+  function_table = nullptr;
+  module = nullptr;
+
+  if (llvm::verifyModule(*module_owner, &(llvm::errs()))) {
+    llvm::errs() << "verifyModule Failed\n";
+    return nullptr;
+  }
+
+  return module_owner;
+}
 
-  while (depth < ft->depth) {
+llvm::Value* Compiler::createSlotPtr(llvm::Value* base, tsg_frame_t* frame,
+                                     tsg_tyenv_t* env, int32_t hops,
+                                     int32_t index) {
+  auto stashed_env = this->tyenv;
+  this->tyenv = env;
+  llvm::Value* fp =
+      builder.CreateBitCast(base, convFrameTy(frame)->getPointerTo());
+  this->tyenv = stashed_env;
+
+  // each frame's slot 0 points to the one it is nested in
+  for (int32_t i = 0; i < hops; i++) {
     std::vector<llvm::Value*> elem_idx;
     elem_idx.push_back(builder.getInt32(0));
     elem_idx.push_back(builder.getInt32(0));
     fp = builder.CreateLoad(builder.CreateGEP(fp, elem_idx));
-    ft = ft->outer;
+    frame = frame->outer;
   }
 
-  // `fp` has a pointer to outer frame as a member, but `ft` does not.
-  assert(0 <= index && index < ft->size + 1);
+  assert(0 <= index && index < frame->size + 1);
 
   std::vector<llvm::Value*> elem_idx;
   elem_idx.push_back(builder.getInt32(0));
@@ -102,6 +210,17 @@ llvm::Value* Compiler::createObjPtrRaw(int32_t depth, int32_t index) {
   return builder.CreateGEP(fp, elem_idx);
 }
 
+llvm::Value* Compiler::createHostPtr(uintptr_t address, llvm::Type* type) {
+  // such code is only valid in this process; keep it out of the disk cache
+  module->getOrInsertNamedMetadata(DiskCache::HOST_ADDRESSES);
+  return builder.CreateIntToPtr(builder.getInt64(address), type);
+}
+
+llvm::Value* Compiler::createCounterPtr(std::atomic<uint64_t>* counter) {
+  return createHostPtr(reinterpret_cast<uintptr_t>(counter),
+                       builder.getInt64Ty()->getPointerTo());
+}
+
 llvm::Type* Compiler::convTy(tsg_type_t* type) {
   switch (type->kind) {
     case TSG_TYPE_BOOL:
@@ -125,6 +244,25 @@ llvm::Type* Compiler::convTy(tsg_type_t* type) {
   return nullptr;
 }
 
+llvm::Type* Compiler::convMirTy(MirType type) {
+  switch (type) {
+    case MIR_VOID:
+      return builder.getVoidTy();
+
+    case MIR_BOOL:
+      return builder.getInt1Ty();
+
+    case MIR_INT:
+      return builder.getInt32Ty();
+
+    case MIR_PTR:
+      return builder.getInt8PtrTy();
+  }
+
+  assert(false);
+  return nullptr;
+}
+
 llvm::FunctionType* Compiler::convFuncTy(tsg_type_t* type) {
   assert(type != nullptr && type->kind == TSG_TYPE_FUNC);
 
@@ -137,6 +275,25 @@ llvm::FunctionType* Compiler::convFuncTy(tsg_type_t* type) {
   return func_type;
 }
 
+llvm::FunctionType* Compiler::convInstanceTy(tsg_func_t* func,
+                                             tsg_tyenv_t* env) {
+  auto type = tsg_tyenv_get(env, func->ftype);
+  assert(type != nullptr && type->kind == TSG_TYPE_FUNC);
+
+  auto ret_type = convTy(type->func.ret);
+  auto param_types = std::vector<llvm::Type*>();
+  if (func->conv == TSG_FUNC_CLOSURE) {
+    param_types.push_back(builder.getInt8PtrTy());
+  }
+  convTyArr(param_types, type->func.params);
+  for (int32_t i = 0; i < func->n_captures; i++) {
+    auto capture = func->captures[i];
+    param_types.push_back(convTy(tsg_tyenv_get(env, capture->tyvar)));
+  }
+
+  return llvm::FunctionType::get(ret_type, param_types, false);
+}
+
 llvm::StructType* Compiler::convFrameTy(tsg_frame_t* frame) {
   std::vector<llvm::Type*> member_types;
   if (frame->outer != nullptr) {
@@ -164,163 +321,401 @@ void Compiler::convTyArr(std::vector<llvm::Type*>& types, tsg_type_arr_t* arr) {
   }
 }
 
-void Compiler::buildAst(tsg_ast_t* ast, tsg_tyenv_t* env) {
-  buildFunc(ast->root, env);
+void Compiler::internalizeExcept(llvm::Function* entry) {
+  for (auto& func : *module) {
+    if (&func != entry && !func.isDeclaration()) {
+      func.setLinkage(llvm::Function::InternalLinkage);
+    }
+  }
+}
+
+llvm::Function* Compiler::buildInstance(tsg_func_t* func, tsg_tyenv_t* env,
+                                        bool whole_program) {
+  int32_t opt_level = program != nullptr ? program->getOptLevel() : 0;
+
+  // Calls with constant arguments are worth running up front only when
+  // the code is optimized anyway.
+  std::unique_ptr<Evaluator> evaluator;
+  if (opt_level > 0 && program->getEvalSteps() > 0) {
+    evaluator.reset(
+        new Evaluator(program->getEvalSteps(), program->getEvalMemory()));
+  }
+
+  // nothing has been counted on an engine with an empty profile
+  PgoProfile* sites = profile;
+  if (sites != nullptr && !instrumenting && sites->isEmpty()) {
+    sites = nullptr;
+  }
+
+  MirModule mir_module;
+  Lowering lowering(mir_module, whole_program, evaluator.get(), sites,
+                    instrumenting);
+  lowering.lowerFunc(func, env);
+  if (evaluator != nullptr && program->isDumpingIr()) {
+    evaluator->printFolds(llvm::errs());
+  }
+
+  bool memoize = opt_level > 0 && program->getMemoSlots() > 0;
+  MirPassManager passes(opt_level, memoize,
+                        sites != nullptr && !instrumenting);
+  passes.run(mir_module, whole_program);
+
+  // every instance first, so that calls can refer to any of them
+  auto mir_funcs = mir_module.getFuncs();
+  for (auto mir_func : mir_funcs) {
+    declareFunc(mir_func);
+  }
+  for (auto mir_func : mir_funcs) {
+    buildFunc(mir_func);
+  }
+
+  return function_table->get(env);
+}
+
+llvm::Value* Compiler::fetchLazyFunc(tsg_tyenv_t* env,
+                                     llvm::FunctionType* func_type) {
+  llvm::Function* llvm_func = function_table->get(env);
+  if (llvm_func) {
+    return llvm_func;
+  }
+
+  int32_t id = program->getInstanceId(env);
+  auto func_ptr_type = func_type->getPointerTo();
+
+  // The slot holds the instance's address once it has been compiled, and
+  // is read with acquire, as the program stores into it with release.
+  auto slot_addr = reinterpret_cast<uintptr_t>(program->getInstanceSlot(id));
+  auto cached = builder.CreateAlignedLoad(
+      createHostPtr(slot_addr, func_ptr_type->getPointerTo()),
+      sizeof(void*));
+  cached->setAtomic(llvm::AtomicOrdering::Acquire);
+
+  llvm::Function* parent = builder.GetInsertBlock()->getParent();
+  auto check_block = builder.GetInsertBlock();
+  auto resolve_block = llvm::BasicBlock::Create(context, "resolve", parent);
+  auto call_block = llvm::BasicBlock::Create(context, "call", parent);
+  builder.CreateCondBr(builder.CreateIsNull(cached), resolve_block, call_block);
+
+  builder.SetInsertPoint(resolve_block);
+  std::vector<llvm::Type*> resolver_params;
+  resolver_params.push_back(builder.getInt8PtrTy());
+  resolver_params.push_back(builder.getInt32Ty());
+  auto resolver_type = llvm::FunctionType::get(builder.getInt8PtrTy(),
+                                               resolver_params, false);
+  auto resolver_addr = reinterpret_cast<uintptr_t>(&Program::resolveInstance);
+  auto resolver = createHostPtr(resolver_addr, resolver_type->getPointerTo());
+
+  std::vector<llvm::Value*> resolver_args;
+  resolver_args.push_back(createHostPtr(reinterpret_cast<uintptr_t>(program),
+                                        builder.getInt8PtrTy()));
+  resolver_args.push_back(builder.getInt32(id));
+  auto resolved = builder.CreateBitCast(
+      builder.CreateCall(resolver, resolver_args), func_ptr_type);
+  builder.CreateBr(call_block);
+
+  builder.SetInsertPoint(call_block);
+  auto callee = builder.CreatePHI(func_ptr_type, 2);
+  callee->addIncoming(cached, check_block);
+  callee->addIncoming(resolved, resolve_block);
+
+  return callee;
 }
 
-llvm::Function* Compiler::fetchFunc(tsg_func_t* func, tsg_tyenv_t* env) {
-  llvm::Function* llvm_func = function_table->get(func, env);
+llvm::Function* Compiler::fetchExternFunc(tsg_tyenv_t* env,
+                                          llvm::FunctionType* func_type) {
+  llvm::Function* llvm_func = function_table->get(env);
   if (llvm_func) {
     return llvm_func;
   }
 
-  llvm_func = buildFunc(func, env);
+  // defined by the module of that instance
+  int32_t id = program->getInstanceId(env);
+  llvm_func =
+      llvm::Function::Create(func_type, llvm::Function::ExternalLinkage,
+                             program->getInstanceName(id), module);
+  llvm_func->setCallingConv(llvm::CallingConv::Fast);
+  function_table->set(env, llvm_func);
+
   return llvm_func;
 }
 
-llvm::Function* Compiler::buildFunc(tsg_func_t* func, tsg_tyenv_t* env) {
-  assert(func->tyset == env->tyset);
+llvm::Function* Compiler::declareFunc(MirFunc* mir_func) {
+  auto func = mir_func->getFunc();
+  auto env = mir_func->getEnv();
+
+  // `$main` keeps its name, the program looks it up
+  std::string name = tsg_ident_cstr(func->decl->name);
+  if (func->frame->outer != nullptr) {
+    name = describeInstance(func, env);
+  }
 
-  auto func_type = tsg_tyenv_get(env, func->ftype);
   auto llvm_func = llvm::Function::Create(
-      convFuncTy(func_type), llvm::Function::ExternalLinkage,
-      tsg_ident_cstr(func->decl->name), module);
+      convInstanceTy(func, env), llvm::Function::ExternalLinkage, name, module);
+  // Only tsugu code calls an instance, so it can use the convention that
+  // guarantees tail calls. The host calls `$main` with the C one.
+  if (func->frame->outer != nullptr) {
+    llvm_func->setCallingConv(llvm::CallingConv::Fast);
+  }
 
-  function_table->set(func, env, llvm_func);
-  auto body = llvm::BasicBlock::Create(context, "entry", llvm_func);
-  builder.SetInsertPoint(body);
+  auto arg = llvm_func->arg_begin();
+  for (auto param : mir_func->getParams()) {
+    arg->setName(param->name);
+    arg++;
+  }
+
+  function_table->set(env, llvm_func);
+  return llvm_func;
+}
+
+void Compiler::buildFunc(MirFunc* mir_func) {
+  auto llvm_func = function_table->get(mir_func->getEnv());
 
   auto stashed_env = this->tyenv;
-  auto stashed_frametype = this->frametype;
-  auto stashed_frameptr = this->frameptr;
-  this->tyenv = env;
-  this->frametype = func->frame;
-  this->frameptr = builder.CreateAlloca(convFrameTy(func->frame));
-  this->frameptr->setName("$sf");
-
-  auto node = func->params->head;
-  int32_t param_index = 0;
-  for (auto& arg : llvm_func->args()) {
-    if (param_index == 0) {
-      arg.setName("$outer");
-
-      if (func->frame->outer != nullptr) {
-        auto outer = builder.CreateBitCast(
-            &arg, convFrameTy(func->frame->outer)->getPointerTo());
-        builder.CreateStore(outer, createObjPtrRaw(frametype->depth, 0));
-      } else {
-        builder.CreateStore(&arg, createObjPtrRaw(frametype->depth, 0));
-      }
-    } else {
-      arg.setName(tsg_ident_cstr(node->decl->name));
-      store(node->decl->object, &arg);
-      node = node->next;
-    }
-    param_index += 1;
+  this->tyenv = mir_func->getEnv();
+  this->values.clear();
+  this->blocks.clear();
+
+  auto arg = llvm_func->arg_begin();
+  for (auto param : mir_func->getParams()) {
+    this->values[param] = &*arg;
+    arg++;
   }
 
-  llvm::Value* last_value = buildBlock(func->body);
+  // a memoized instance looks its arguments up before the body runs
+  std::unique_ptr<MemoTable> memo;
+  llvm::BasicBlock* memo_block = nullptr;
+  if (mir_func->isMemoized()) {
+    memo.reset(new MemoTable(builder, llvm_func, program->getMemoSlots(),
+                             program->getMemoCounters()));
+    memo_block = llvm::BasicBlock::Create(context, "memo", llvm_func);
+  }
 
-  if (last_value) {
-    builder.CreateRet(last_value);
-  } else {
-    builder.CreateRetVoid();
+  // Dominators come first, so every operand but a PHI's is built before
+  // it is used.
+  auto order = mir_func->getBlocksInOrder();
+  for (auto block : order) {
+    this->blocks[block] =
+        llvm::BasicBlock::Create(context, block->name, llvm_func);
   }
 
-  this->frameptr = stashed_frameptr;
-  this->frametype = stashed_frametype;
+  // calls are counted before a memo table can answer them
+  auto entry_site = mir_func->getEntrySite();
+  if (entry_site != nullptr && instrumenting) {
+    builder.SetInsertPoint(memo_block != nullptr ? memo_block
+                                                 : this->blocks[order[0]]);
+    buildCount(createCounterPtr(&(entry_site->counts[0])));
+  } else if (entry_site != nullptr) {
+    llvm_func->setEntryCount(entry_site->counts[0].load());
+  }
+
+  if (memo != nullptr) {
+    builder.SetInsertPoint(memo_block);
+    memo->buildLookup(this->blocks[order[0]]);
+  }
+  this->memo_table = memo.get();
+
+  // a block may end up split, by a lazy call; PHIs want the last part
+  std::unordered_map<MirBlock*, llvm::BasicBlock*> exits;
+  for (auto block : order) {
+    builder.SetInsertPoint(this->blocks[block]);
+    for (auto inst : block->insts) {
+      this->values[inst] = buildInst(inst, mir_func);
+    }
+    exits[block] = builder.GetInsertBlock();
+  }
+
+  for (auto block : order) {
+    for (auto inst : block->insts) {
+      if (inst->opcode != MIR_PHI) {
+        break;
+      }
+      auto phi = llvm::cast<llvm::PHINode>(this->values[inst]);
+      for (size_t i = 0; i < inst->operands.size(); i++) {
+        phi->addIncoming(this->values[inst->operands[i]],
+                         exits[inst->targets[i]]);
+      }
+    }
+  }
+
+  this->memo_table = nullptr;
+  this->blocks.clear();
+  this->values.clear();
   this->tyenv = stashed_env;
 
   if (llvm::verifyFunction(*llvm_func, &(llvm::errs()))) {
     llvm::errs() << "verifyFunction Failed\n";
   }
-
-  return llvm_func;
 }
 
-llvm::Value* Compiler::buildBlock(tsg_block_t* block) {
-  buildFuncList(block->funcs);
-  return buildStmtList(block->stmts);
-}
+llvm::Function* Compiler::buildEntry(tsg_func_t* func, tsg_tyenv_t* env,
+                                     llvm::Function* callee,
+                                     const std::string& name) {
+  // void entry(i8* outer, i64* args, i64* ret): every argument and the
+  // result travel in a 64-bit cell, ints and bools zero-extended.
+  auto cell_ptr_type = builder.getInt64Ty()->getPointerTo();
+  std::vector<llvm::Type*> param_types;
+  param_types.push_back(builder.getInt8PtrTy());
+  param_types.push_back(cell_ptr_type);
+  param_types.push_back(cell_ptr_type);
+  auto entry_type =
+      llvm::FunctionType::get(builder.getVoidTy(), param_types, false);
+  auto entry = llvm::Function::Create(
+      entry_type, llvm::Function::ExternalLinkage, name, module);
+
+  auto body = llvm::BasicBlock::Create(context, "entry", entry);
+  builder.SetInsertPoint(body);
 
-void Compiler::buildFuncList(tsg_func_list_t* funcs) {
-  auto node = funcs->head;
-  while (node != nullptr) {
-    auto poly_obj =
-        builder.CreateBitCast(this->frameptr, builder.getInt8PtrTy());
-    store(node->func->decl->object, poly_obj);
-    node = node->next;
+  auto arg = entry->arg_begin();
+  llvm::Value* outer = &*(arg++);
+  llvm::Value* cells = &*(arg++);
+  llvm::Value* ret = &*arg;
+
+  std::vector<llvm::Value*> args;
+  if (func->conv == TSG_FUNC_CLOSURE) {
+    args.push_back(outer);
   }
-}
 
-llvm::Value* Compiler::buildStmtList(tsg_stmt_list_t* stmts) {
-  llvm::Value* last_value = nullptr;
+  auto callee_type = callee->getFunctionType();
+  size_t n_params = tsg_tyenv_get(env, func->ftype)->func.params->size;
+  for (size_t i = 0; i < n_params; i++) {
+    auto param_type = callee_type->getParamType(args.size());
+    auto cell_ptr = builder.CreateConstGEP1_32(cells, i);
+    llvm::Value* cell = builder.CreateLoad(cell_ptr);
+    if (param_type->isPointerTy()) {
+      args.push_back(builder.CreateIntToPtr(cell, param_type));
+    } else {
+      args.push_back(builder.CreateTrunc(cell, param_type));
+    }
+  }
 
-  auto node = stmts->head;
-  while (node != nullptr) {
-    last_value = buildStmt(node->stmt);
-    node = node->next;
+  // The caller's frames hold every member, captures included.
+  auto outer_frame = func->frame->outer;
+  for (int32_t i = 0; i < func->n_captures; i++) {
+    auto capture = func->captures[i];
+    auto hops = outer_frame->depth - capture->depth;
+    args.push_back(builder.CreateLoad(createSlotPtr(
+        outer, outer_frame, env, hops, capture->index + 1)));
   }
 
-  return last_value;
+  auto value = builder.CreateCall(callee, args);
+  value->setCallingConv(callee->getCallingConv());
+  if (value->getType()->isPointerTy()) {
+    builder.CreateStore(builder.CreatePtrToInt(value, builder.getInt64Ty()),
+                        ret);
+  } else if (!value->getType()->isVoidTy()) {
+    builder.CreateStore(builder.CreateZExt(value, builder.getInt64Ty()), ret);
+  }
+  builder.CreateRetVoid();
+
+  return entry;
 }
 
-llvm::Value* Compiler::buildStmt(tsg_stmt_t* stmt) {
-  switch (stmt->kind) {
-    case TSG_STMT_VAL:
-      return buildStmtVal(stmt);
+void Compiler::buildStartup(llvm::Function* startup, llvm::Function* root,
+                            llvm::Function* printf_func) {
+  // int main(void) { printf("result = %d\n", $main()); return 0; }
+  auto body = llvm::BasicBlock::Create(context, "entry", startup);
+  builder.SetInsertPoint(body);
 
-    case TSG_STMT_EXPR:
-      return buildStmtExpr(stmt);
+  // the root reads no outer frame, so it takes no `$outer`
+  llvm::Value* value = builder.CreateCall(root);
+  if (value->getType()->isPointerTy()) {
+    value = builder.CreatePtrToInt(value, builder.getInt32Ty());
+  } else {
+    value = builder.CreateZExtOrTrunc(value, builder.getInt32Ty());
   }
 
-  assert(false);
-  return nullptr;
+  std::vector<llvm::Value*> printf_args;
+  printf_args.push_back(builder.CreateGlobalStringPtr("result = %d\n"));
+  printf_args.push_back(value);
+  builder.CreateCall(printf_func, printf_args);
+  builder.CreateRet(builder.getInt32(0));
 }
 
-llvm::Value* Compiler::buildStmtVal(tsg_stmt_t* stmt) {
-  assert(stmt != nullptr && stmt->kind == TSG_STMT_VAL);
+llvm::Value* Compiler::buildInst(MirInst* inst, MirFunc* mir_func) {
+  switch (inst->opcode) {
+    case MIR_PARAM:
+      // arguments are bound by buildFunc
+      assert(false);
+      return nullptr;
 
-  llvm::Value* value = buildExpr(stmt->val.expr);
-  store(stmt->val.decl->object, value);
+    case MIR_CONST:
+      if (inst->type == MIR_BOOL) {
+        return builder.getInt1(inst->imm != 0);
+      }
+      return builder.getInt32(inst->imm);
 
-  return value;
-}
+    case MIR_NULL:
+      return llvm::ConstantPointerNull::get(builder.getInt8PtrTy());
 
-llvm::Value* Compiler::buildStmtExpr(tsg_stmt_t* stmt) {
-  assert(stmt != nullptr && stmt->kind == TSG_STMT_EXPR);
-  return buildExpr(stmt->expr.expr);
-}
+    case MIR_BINARY:
+      return buildInstBinary(inst);
 
-llvm::Value* Compiler::buildExpr(tsg_expr_t* expr) {
-  switch (expr->kind) {
-    case TSG_EXPR_BINARY:
-      return buildExprBinary(expr);
+    case MIR_FRAME: {
+      auto stashed_env = this->tyenv;
+      this->tyenv = inst->env;
+      auto frame = builder.CreateAlloca(convFrameTy(inst->frame));
+      this->tyenv = stashed_env;
+      frame->setName(inst->name);
+      return frame;
+    }
 
-    case TSG_EXPR_CALL:
-      return buildExprCall(expr);
+    case MIR_CLOSURE:
+      return builder.CreateBitCast(values[inst->operands[0]],
+                                   builder.getInt8PtrTy());
+
+    case MIR_STORE: {
+      auto ptr = createSlotPtr(values[inst->operands[0]], inst->frame,
+                               inst->env, 0, inst->index);
+      auto slot_type = ptr->getType()->getPointerElementType();
+      // function values are stored into frame pointer slots as they are
+      auto value = builder.CreateBitCast(values[inst->operands[1]], slot_type);
+      return builder.CreateStore(value, ptr);
+    }
 
-    case TSG_EXPR_IFELSE:
-      return buildExprIfelse(expr);
+    case MIR_LOAD:
+      return builder.CreateLoad(createSlotPtr(values[inst->operands[0]],
+                                              inst->frame, inst->env,
+                                              inst->hops, inst->index));
 
-    case TSG_EXPR_IDENT:
-      return buildExprIdent(expr);
+    case MIR_CALL:
+      return buildInstCall(inst, mir_func);
 
-    case TSG_EXPR_NUMBER:
-      return buildExprNumber(expr);
+    case MIR_PHI: {
+      // incoming values are added once every block is built
+      auto phi = builder.CreatePHI(convMirTy(inst->type),
+                                   inst->operands.size());
+      phi->setName(inst->name);
+      return phi;
+    }
+
+    case MIR_BR:
+      return buildInstBr(inst);
+
+    case MIR_JUMP:
+      return builder.CreateBr(blocks[inst->targets[0]]);
+
+    case MIR_RET:
+      if (inst->operands.empty()) {
+        return builder.CreateRetVoid();
+      }
+      if (memo_table != nullptr) {
+        memo_table->buildReturn(values[inst->operands[0]]);
+        return nullptr;
+      }
+      return builder.CreateRet(values[inst->operands[0]]);
   }
 
   assert(false);
   return nullptr;
 }
 
-llvm::Value* Compiler::buildExprBinary(tsg_expr_t* expr) {
-  assert(expr != nullptr && expr->kind == TSG_EXPR_BINARY);
+llvm::Value* Compiler::buildInstBinary(MirInst* inst) {
+  assert(inst != nullptr && inst->opcode == MIR_BINARY);
 
-  llvm::Value* lhs = buildExpr(expr->binary.lhs);
-  llvm::Value* rhs = buildExpr(expr->binary.rhs);
+  llvm::Value* lhs = values[inst->operands[0]];
+  llvm::Value* rhs = values[inst->operands[1]];
 
-  switch (expr->binary.op) {
+  switch (inst->op) {
     case TSG_TOKEN_EQ:
       return builder.CreateICmpEQ(lhs, rhs);
 
@@ -348,73 +743,76 @@ llvm::Value* Compiler::buildExprBinary(tsg_expr_t* expr) {
   }
 }
 
-llvm::Value* Compiler::buildExprCall(tsg_expr_t* expr) {
-  assert(expr != nullptr && expr->kind == TSG_EXPR_CALL);
-
-  auto callee_obj = buildExpr(expr->call.callee);
-  tsg_type_t* callee_type = tsg_tyenv_get(tyenv, expr->call.callee->tyvar);
-  assert(callee_type != nullptr && callee_type->kind == TSG_TYPE_POLY);
+llvm::Value* Compiler::buildInstBr(MirInst* inst) {
+  assert(inst != nullptr && inst->opcode == MIR_BR);
 
-  std::vector<llvm::Value*> args;
-  args.push_back(callee_obj);
-
-  auto node = expr->call.args->head;
-  while (node) {
-    auto value = buildExpr(node->expr);
-    args.push_back(value);
-    node = node->next;
+  auto cond = values[inst->operands[0]];
+  auto site = inst->site;
+  if (site != nullptr && instrumenting) {
+    auto counter_ptr =
+        builder.CreateSelect(cond, createCounterPtr(&(site->counts[0])),
+                             createCounterPtr(&(site->counts[1])));
+    buildCount(counter_ptr);
   }
 
-  auto block = builder.GetInsertBlock();
-
-  tsg_type_t* func_type = tsg_tyenv_get(tyenv, expr->call.ftype);
-  assert(func_type != nullptr && func_type->kind == TSG_TYPE_FUNC);
-  tsg_tyenv_t* callee_env =
-      tsg_tymap_get(callee_type->poly.tymap, func_type->func.params);
-  llvm::Value* callee_func = fetchFunc(callee_type->poly.func, callee_env);
+  auto br = builder.CreateCondBr(cond, blocks[inst->targets[0]],
+                                 blocks[inst->targets[1]]);
+
+  if (site != nullptr && !instrumenting) {
+    // Branch weights are 32-bit. Like clang, scale the counts to fit and
+    // keep them above zero, as an arm that never ran may still run.
+    uint64_t counts[2] = {site->counts[0].load(), site->counts[1].load()};
+    uint64_t scale = std::max(counts[0], counts[1]) / UINT32_MAX + 1;
+    llvm::MDBuilder md_builder(context);
+    br->setMetadata(llvm::LLVMContext::MD_prof,
+                    md_builder.createBranchWeights(
+                        static_cast<uint32_t>(counts[0] / scale + 1),
+                        static_cast<uint32_t>(counts[1] / scale + 1)));
+  }
 
-  builder.SetInsertPoint(block);
-  return builder.CreateCall(callee_func, args);
+  return br;
 }
 
-llvm::Value* Compiler::buildExprIfelse(tsg_expr_t* expr) {
-  assert(expr != nullptr && expr->kind == TSG_EXPR_IFELSE);
-
-  llvm::Function* func = builder.GetInsertBlock()->getParent();
-  auto then_block = llvm::BasicBlock::Create(context, "then");
-  auto else_block = llvm::BasicBlock::Create(context, "else");
-  auto merge_block = llvm::BasicBlock::Create(context, "merge");
+llvm::Value* Compiler::buildInstCall(MirInst* inst, MirFunc* mir_func) {
+  assert(inst != nullptr && inst->opcode == MIR_CALL);
 
-  llvm::Value* cond = buildExpr(expr->ifelse.cond);
-  builder.CreateCondBr(cond, then_block, else_block);
+  if (inst->site != nullptr && instrumenting) {
+    buildCount(createCounterPtr(&(inst->site->counts[0])));
+  }
 
-  func->getBasicBlockList().push_back(then_block);
-  builder.SetInsertPoint(then_block);
-  llvm::Value* then_value = buildBlock(expr->ifelse.thn);
-  builder.CreateBr(merge_block);
-  then_block = builder.GetInsertBlock();
+  std::vector<llvm::Value*> args;
+  for (auto operand : inst->operands) {
+    args.push_back(values[operand]);
+  }
 
-  func->getBasicBlockList().push_back(else_block);
-  builder.SetInsertPoint(else_block);
-  llvm::Value* else_value = buildBlock(expr->ifelse.els);
-  builder.CreateBr(merge_block);
-  else_block = builder.GetInsertBlock();
+  llvm::Value* callee_func;
+  if (program != nullptr && program->isLazy()) {
+    callee_func =
+        fetchLazyFunc(inst->env, convInstanceTy(inst->func, inst->env));
+  } else if (program != nullptr && program->isPartitioned()) {
+    callee_func =
+        fetchExternFunc(inst->env, convInstanceTy(inst->func, inst->env));
+  } else {
+    callee_func = function_table->get(inst->env);
+  }
 
-  func->getBasicBlockList().push_back(merge_block);
-  builder.SetInsertPoint(merge_block);
-  auto phi = builder.CreatePHI(then_value->getType(), 2);
-  phi->addIncoming(then_value, then_block);
-  phi->addIncoming(else_value, else_block);
+  auto call = builder.CreateCall(callee_func, args);
+  call->setCallingConv(llvm::CallingConv::Fast);
 
-  return phi;
-}
+  // Both sides use fastcc, which makes this a guaranteed tail call. A
+  // closure may point into our frame, so only a frameless function can
+  // give up its stack to the callee.
+  auto caller = builder.GetInsertBlock()->getParent();
+  if (inst->tail && mir_func->getFrame() == nullptr &&
+      caller->getCallingConv() == llvm::CallingConv::Fast) {
+    call->setTailCall();
+  }
 
-llvm::Value* Compiler::buildExprIdent(tsg_expr_t* expr) {
-  assert(expr != nullptr && expr->kind == TSG_EXPR_IDENT);
-  return load(expr->ident.object);
+  return call;
 }
 
-llvm::Value* Compiler::buildExprNumber(tsg_expr_t* expr) {
-  assert(expr != nullptr && expr->kind == TSG_EXPR_NUMBER);
-  return builder.getInt32(expr->number.value);
+void Compiler::buildCount(llvm::Value* counter_ptr) {
+  builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter_ptr,
+                          builder.getInt64(1),
+                          llvm::AtomicOrdering::Monotonic);
 }
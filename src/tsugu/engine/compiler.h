@@ -8,56 +8,125 @@
 #define TSUGU_ENGINE_COMPILER_H
 
 #include "function_table.h"
+#include "memo_table.h"
+#include "mir.h"
+#include "pgo_profile.h"
 #include <tsugu/core/ast.h>
 #include <tsugu/core/tyenv.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace tsugu {
 
+class Program;
+
+/**
+ * Memory layout of a `tsg_frame_t` as the compiled code sees it.
+ * `offsets[0]` is the `$outer` slot, `offsets[i + 1]` is member `i`;
+ * `sizes` holds the store size of each slot in the same order.
+ */
+struct FrameLayout {
+  uint64_t size;
+  uint64_t align;
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> sizes;
+};
+
+/**
+ * Builds LLVM modules for a Program.
+ *
+ * Instances are lowered into a MirModule first, the whole program at once
+ * for an eager module and a single instance otherwise, and the MIR passes
+ * run at the program's optimization level. LLVM IR is then built from the
+ * MIR; instances outside the module are reached through their dispatch
+ * slots in lazy mode and by name in partitioned mode. Memoized instances
+ * get a MemoTable around their bodies.
+ *
+ * While the program is instrumented, the entry of every instance, each
+ * arm of its ifs and each of its calls add to their counts in the
+ * engine's PgoProfile. Otherwise, sites that hold counts become branch
+ * weights and entry counts for LLVM, and guide the MIR inliner.
+ */
 class Compiler {
  public:
-  Compiler();
+  Compiler(llvm::LLVMContext& llvm_context, Program* owner);
   virtual ~Compiler();
 
-  int32_t run(tsg_ast_t* ast);
+  std::unique_ptr<llvm::Module> compile(tsg_ast_t* ast);
+  std::unique_ptr<llvm::Module> compileStandalone(tsg_ast_t* ast);
+  std::unique_ptr<llvm::Module> compileInstance(tsg_func_t* func,
+                                                tsg_tyenv_t* env,
+                                                const std::string& name);
+  std::unique_ptr<llvm::Module> compileEntry(tsg_func_t* func,
+                                             tsg_tyenv_t* env,
+                                             const std::string& callee_name,
+                                             const std::string& name);
+
+  void layoutFrame(tsg_frame_t* frame, tsg_tyenv_t* env,
+                   const llvm::DataLayout& data_layout, FrameLayout* layout);
+
+  // counts for a compile without a program, as ahead of time
+  void setProfile(PgoProfile* pgo_profile) { profile = pgo_profile; }
+
+  // "name(type, ...)", as instances are named
+  static std::string describeInstance(tsg_func_t* func, tsg_tyenv_t* env);
 
  private:
-  llvm::LLVMContext context;
+  llvm::LLVMContext& context;
   llvm::IRBuilder<> builder;
   llvm::Module* module;
+  Program* program;
+  PgoProfile* profile;
+  bool instrumenting;
 
   tsg_tyenv_t* tyenv;
-  tsg_frame_t* frametype;
-  llvm::Value* frameptr;
+  std::unordered_map<MirInst*, llvm::Value*> values;
+  std::unordered_map<MirBlock*, llvm::BasicBlock*> blocks;
   FunctionTable* function_table;
+  MemoTable* memo_table;
 
-  void store(tsg_member_t* member, llvm::Value* value);
-  llvm::Value* load(tsg_member_t* member);
-  llvm::Value* createObjPtr(tsg_member_t* member);
-  llvm::Value* createObjPtrRaw(int32_t depth, int32_t index);
+  llvm::Value* createSlotPtr(llvm::Value* base, tsg_frame_t* frame,
+                             tsg_tyenv_t* env, int32_t hops, int32_t index);
+  llvm::Value* createHostPtr(uintptr_t address, llvm::Type* type);
+  llvm::Value* createCounterPtr(std::atomic<uint64_t>* counter);
 
   llvm::Type* convTy(tsg_type_t* type);
+  llvm::Type* convMirTy(MirType type);
   llvm::FunctionType* convFuncTy(tsg_type_t* type);
+  llvm::FunctionType* convInstanceTy(tsg_func_t* func, tsg_tyenv_t* env);
   llvm::StructType* convFrameTy(tsg_frame_t* frame);
   void convTyArr(std::vector<llvm::Type*>& types, tsg_type_arr_t* arr);
 
-  void buildAst(tsg_ast_t* ast, tsg_tyenv_t* env);
-  llvm::Function* fetchFunc(tsg_func_t* func, tsg_tyenv_t* env);
-  llvm::Function* buildFunc(tsg_func_t* func, tsg_tyenv_t* env);
-  llvm::Value* buildBlock(tsg_block_t* block);
-  void buildFuncList(tsg_func_list_t* funcs);
-  llvm::Value* buildStmtList(tsg_stmt_list_t* stmts);
-
-  llvm::Value* buildStmt(tsg_stmt_t* stmt);
-  llvm::Value* buildStmtVal(tsg_stmt_t* stmt);
-  llvm::Value* buildStmtExpr(tsg_stmt_t* stmt);
-
-  llvm::Value* buildExpr(tsg_expr_t* expr);
-  llvm::Value* buildExprBinary(tsg_expr_t* expr);
-  llvm::Value* buildExprCall(tsg_expr_t* expr);
-  llvm::Value* buildExprIfelse(tsg_expr_t* expr);
-  llvm::Value* buildExprIdent(tsg_expr_t* expr);
-  llvm::Value* buildExprNumber(tsg_expr_t* expr);
+  std::unique_ptr<llvm::Module> createModule(const std::string& name);
+  std::unique_ptr<llvm::Module> finishModule(
+      std::unique_ptr<llvm::Module> module_owner);
+
+  void internalizeExcept(llvm::Function* entry);
+
+  llvm::Function* buildInstance(tsg_func_t* func, tsg_tyenv_t* env,
+                                bool whole_program);
+  llvm::Value* fetchLazyFunc(tsg_tyenv_t* env, llvm::FunctionType* func_type);
+  llvm::Function* fetchExternFunc(tsg_tyenv_t* env,
+                                  llvm::FunctionType* func_type);
+  llvm::Function* declareFunc(MirFunc* mir_func);
+  void buildFunc(MirFunc* mir_func);
+  llvm::Function* buildEntry(tsg_func_t* func, tsg_tyenv_t* env,
+                             llvm::Function* callee, const std::string& name);
+  void buildStartup(llvm::Function* startup, llvm::Function* root,
+                    llvm::Function* printf_func);
+
+  llvm::Value* buildInst(MirInst* inst, MirFunc* mir_func);
+  llvm::Value* buildInstBinary(MirInst* inst);
+  llvm::Value* buildInstBr(MirInst* inst);
+  llvm::Value* buildInstCall(MirInst* inst, MirFunc* mir_func);
+  void buildCount(llvm::Value* counter_ptr);
 };
 
 }  // namespace tsugu
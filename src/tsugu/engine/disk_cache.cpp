@@ -0,0 +1,134 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file disk_cache.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "disk_cache.h"
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+
+using namespace tsugu;
+
+// bump when the meaning of a cached object changes without the IR changing
+static const char* CACHE_FORMAT = "tsugu-object-cache-1";
+
+const char* DiskCache::HOST_ADDRESSES = "tsugu.host_addresses";
+
+DiskCache::DiskCache(const std::string& cache_dir, int32_t opt_level)
+    : dir(cache_dir),
+      target(llvm::sys::getProcessTriple() + "/" +
+             llvm::sys::getHostCPUName().str() + "/O" +
+             std::to_string(opt_level)),
+      mutex(),
+      pending() {
+  stats.hits = 0;
+  stats.misses = 0;
+  stats.load_ms = 0;
+}
+
+DiskCache::~DiskCache() {}
+
+bool DiskCache::init() {
+  auto ec = llvm::sys::fs::create_directories(dir);
+  if (ec) {
+    llvm::errs() << dir << ": " << ec.message() << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+DiskCache::Stats DiskCache::getStats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+void DiskCache::notifyObjectCompiled(const llvm::Module* module,
+                                     llvm::MemoryBufferRef object) {
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = pending.find(module);
+    if (found == pending.end()) {
+      return;
+    }
+    key = found->second;
+    pending.erase(found);
+  }
+
+  std::string path = getPath(key);
+  int fd;
+  llvm::SmallString<128> temp_path;
+  auto ec = llvm::sys::fs::createUniqueFile(path + ".%%%%%%%%.tmp", fd,
+                                            temp_path);
+  if (ec) {
+    llvm::errs() << path << ": " << ec.message() << "\n";
+    return;
+  }
+
+  {
+    llvm::raw_fd_ostream out(fd, true);
+    out << object.getBuffer();
+  }
+
+  ec = llvm::sys::fs::rename(temp_path, path);
+  if (ec) {
+    llvm::errs() << path << ": " << ec.message() << "\n";
+    llvm::sys::fs::remove(temp_path);
+  }
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskCache::getObject(
+    const llvm::Module* module) {
+  if (module->getNamedMetadata(HOST_ADDRESSES) != nullptr) {
+    return nullptr;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::string key = computeKey(module);
+  auto buffer = llvm::MemoryBuffer::getFile(getPath(key));
+  auto end = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!buffer) {
+    stats.misses += 1;
+    pending[module] = key;
+    return nullptr;
+  }
+
+  stats.hits += 1;
+  stats.load_ms +=
+      std::chrono::duration<double, std::milli>(end - start).count();
+  return std::move(*buffer);
+}
+
+std::string DiskCache::computeKey(const llvm::Module* module) {
+  std::string ir;
+  llvm::raw_string_ostream ir_stream(ir);
+  module->print(ir_stream, nullptr);
+  ir_stream.flush();
+
+  llvm::MD5 hash;
+  hash.update(CACHE_FORMAT);
+  hash.update(LLVM_VERSION_STRING);
+  hash.update(target);
+  hash.update(ir);
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  return result.digest().str().str();
+}
+
+std::string DiskCache::getPath(const std::string& key) {
+  llvm::SmallString<128> path(dir);
+  llvm::sys::path::append(path, key + ".o");
+  return path.str().str();
+}
@@ -0,0 +1,65 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file disk_cache.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_DISK_CACHE_H
+#define TSUGU_ENGINE_DISK_CACHE_H
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace tsugu {
+
+/**
+ * Object code cache shared by every process that uses the same directory.
+ *
+ * The key hashes the module IR, the LLVM version, the target triple and
+ * CPU, and the codegen level. The IR already reflects the source and the
+ * compiler that lowered it. Modules that embed host addresses, such as
+ * lazy dispatch slots and profile counters, are marked by the Compiler and
+ * never cached.
+ *
+ * An entry is written to a unique temporary file and renamed into place,
+ * so concurrent readers only ever see complete objects.
+ */
+class DiskCache : public llvm::ObjectCache {
+ public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    double load_ms;
+  };
+
+  DiskCache(const std::string& cache_dir, int32_t opt_level);
+  virtual ~DiskCache();
+
+  bool init();
+  Stats getStats();
+
+  void notifyObjectCompiled(const llvm::Module* module,
+                            llvm::MemoryBufferRef object) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(
+      const llvm::Module* module) override;
+
+  static const char* HOST_ADDRESSES;
+
+ private:
+  std::string dir;
+  std::string target;
+  std::mutex mutex;
+  // keys computed by getObject() for the misses that are being compiled
+  std::unordered_map<const llvm::Module*, std::string> pending;
+  Stats stats;
+
+  std::string computeKey(const llvm::Module* module);
+  std::string getPath(const std::string& key);
+};
+
+}  // namespace tsugu
+
+#endif
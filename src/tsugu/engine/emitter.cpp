@@ -0,0 +1,74 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file emitter.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "emitter.h"
+
+#include "target.h"
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace tsugu;
+
+Emitter::Emitter() : machine(nullptr) {}
+
+Emitter::~Emitter() {}
+
+bool Emitter::init() {
+  machine = createObjectTargetMachine();
+  return machine != nullptr;
+}
+
+bool Emitter::emitObject(llvm::Module& module, const std::string& path) {
+  module.setTargetTriple(machine->getTargetTriple().str());
+  module.setDataLayout(machine->createDataLayout());
+
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    llvm::errs() << path << ": " << ec.message() << "\n";
+    return false;
+  }
+
+  llvm::legacy::PassManager passes;
+  if (machine->addPassesToEmitFile(passes, out, nullptr,
+                                   llvm::TargetMachine::CGFT_ObjectFile)) {
+    llvm::errs() << "cannot emit an object file for this target\n";
+    return false;
+  }
+
+  passes.run(module);
+  out.flush();
+
+  return true;
+}
+
+bool Emitter::linkExecutable(const std::string& object_path,
+                             const std::string& path) {
+  auto driver = llvm::sys::findProgramByName("cc");
+  if (!driver) {
+    llvm::errs() << "cc: " << driver.getError().message() << "\n";
+    return false;
+  }
+
+  std::vector<llvm::StringRef> args;
+  args.push_back(*driver);
+  args.push_back(object_path);
+  args.push_back("-o");
+  args.push_back(path);
+
+  std::string error;
+  int status = llvm::sys::ExecuteAndWait(*driver, args, llvm::None, {}, 0, 0,
+                                         &error);
+  if (status != 0) {
+    llvm::errs() << "link failed: " << (error.empty() ? *driver : error)
+                 << "\n";
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,40 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file emitter.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_EMITTER_H
+#define TSUGU_ENGINE_EMITTER_H
+
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include <memory>
+#include <string>
+
+namespace tsugu {
+
+/**
+ * Ahead-of-time backend.
+ *
+ * Writes a module built by `Compiler::compileStandalone` to a relocatable
+ * object. It can also link the object into an executable with the system C
+ * compiler driver. The result needs neither LLVM nor tsugu at run time.
+ */
+class Emitter {
+ public:
+  Emitter();
+  virtual ~Emitter();
+
+  bool init();
+
+  bool emitObject(llvm::Module& module, const std::string& path);
+  bool linkExecutable(const std::string& object_path, const std::string& path);
+
+ private:
+  std::unique_ptr<llvm::TargetMachine> machine;
+};
+
+}  // namespace tsugu
+
+#endif
@@ -7,9 +7,324 @@
 #include <tsugu/engine/engine.h>
 
 #include "compiler.h"
+#include "emitter.h"
+#include "jit.h"
+#include "program.h"
+#include <llvm/Support/FileSystem.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct tsg_engine_s {
+  tsg_engine_config_t config;
+  tsugu::JIT jit;
+};
+
+struct tsg_function_s {
+  typedef void (*entry_func_t)(void* outer, uint64_t* args, uint64_t* ret);
+
+  entry_func_t entry;
+  uint8_t* outer;
+  std::vector<tsg_value_kind_t> params;
+  tsg_value_kind_t result;
+};
+
+struct tsg_program_s {
+  tsugu::Program program;
+  // by tsg_engine_load; its root frame must stay as it is
+  bool loaded;
+  int32_t result;
+  // keyed by name and parameter kinds; failed lookups are kept as null
+  std::unordered_map<std::string, std::unique_ptr<tsg_function_t>> functions;
+
+  tsg_program_s(tsugu::JIT& jit, tsg_ast_t* ast,
+                const tsg_engine_config_t& config)
+      : program(jit, ast, config), loaded(false), result(0), functions() {}
+};
+
+void tsg_engine_config_init(tsg_engine_config_t* config) {
+  config->lazy = false;
+  config->interp_max_nodes = 1000;
+  config->tier_threshold = 1000;
+  config->tier_background = true;
+  config->cache_dir = nullptr;
+  config->compile_threads = 0;
+  config->profile = false;
+  config->opt_level = 0;
+  config->eval_steps = 1000000;
+  config->eval_memory = 64 * 1024;
+  config->memo_slots = 4096;
+  config->memo_counters = false;
+  config->pgo_instrument = false;
+  config->pgo_warmup = 0;
+  config->dump_ir = false;
+}
+
+tsg_engine_t* tsg_engine_create(const tsg_engine_config_t* config) {
+  tsg_engine_t* engine = new tsg_engine_t();
+
+  if (config != nullptr) {
+    engine->config = *config;
+  } else {
+    tsg_engine_config_init(&(engine->config));
+  }
+
+  if (engine->jit.init(engine->config) == false) {
+    delete engine;
+    return nullptr;
+  }
+
+  return engine;
+}
+
+void tsg_engine_destroy(tsg_engine_t* engine) {
+  delete engine;
+}
+
+void tsg_engine_get_stats(tsg_engine_t* engine, tsg_engine_stats_t* stats) {
+  stats->cache_hits = 0;
+  stats->cache_misses = 0;
+  stats->cache_load_ms = 0;
+  stats->memo_hits = 0;
+  stats->memo_misses = 0;
+
+  tsugu::DiskCache* cache = engine->jit.getCache();
+  if (cache != nullptr) {
+    auto cache_stats = cache->getStats();
+    stats->cache_hits = cache_stats.hits;
+    stats->cache_misses = cache_stats.misses;
+    stats->cache_load_ms = cache_stats.load_ms;
+  }
+
+  tsugu::MemoCounters* memo_counters = engine->jit.getMemoCounters();
+  if (memo_counters != nullptr) {
+    stats->memo_hits = memo_counters->hits.load();
+    stats->memo_misses = memo_counters->misses.load();
+  }
+}
+
+bool tsg_engine_load_profile(tsg_engine_t* engine, const char* path) {
+  return engine->jit.getPgoProfile()->load(path);
+}
+
+bool tsg_engine_save_profile(tsg_engine_t* engine, const char* path) {
+  return engine->jit.getPgoProfile()->save(path);
+}
+
+int32_t tsg_engine_run(tsg_engine_t* engine, tsg_ast_t* ast) {
+  int32_t result;
+  if (tsg_engine_try_run(engine, ast, &result) == false) {
+    return -1;
+  }
+
+  return result;
+}
+
+bool tsg_engine_try_run(tsg_engine_t* engine, tsg_ast_t* ast,
+                        int32_t* result) {
+  tsugu::Program program(engine->jit, ast, engine->config);
+  if (program.load() == false || program.link() == false) {
+    return false;
+  }
+
+  *result = program.run();
+  return true;
+}
+
+tsg_program_t* tsg_engine_load(tsg_engine_t* engine, tsg_ast_t* ast) {
+  // every instance is compiled on its own, as the host looks it up
+  tsg_engine_config_t config = engine->config;
+  config.lazy = true;
+
+  tsg_program_t* program = new tsg_program_t(engine->jit, ast, config);
+  program->loaded = true;
+  program->result = program->program.evaluate();
+  return program;
+}
+
+tsg_program_t* tsg_engine_compile(tsg_engine_t* engine, tsg_ast_t* ast) {
+  tsg_engine_config_t config = engine->config;
+  config.interp_max_nodes = 0;
+
+  tsg_program_t* program = new tsg_program_t(engine->jit, ast, config);
+  // linking `$main` makes the JIT generate code now, not on the first run
+  if (program->program.load() == false || program->program.link() == false) {
+    delete program;
+    return nullptr;
+  }
+
+  return program;
+}
+
+int32_t tsg_program_run(tsg_program_t* program) {
+  // running the top level again would replace the frame that the function
+  // handles have as their `$outer`
+  if (program->loaded) {
+    llvm::errs() << "a loaded program cannot be run again\n";
+    return -1;
+  }
+
+  return program->program.run();
+}
+
+void tsg_program_destroy(tsg_program_t* program) {
+  delete program;
+}
+
+int32_t tsg_program_result(const tsg_program_t* program) {
+  return program->result;
+}
+
+static tsg_type_kind_t conv_value_kind(tsg_value_kind_t kind) {
+  return (kind == TSG_VALUE_BOOL) ? TSG_TYPE_BOOL : TSG_TYPE_INT;
+}
+
+tsg_function_t* tsg_program_function(tsg_program_t* program, const char* name,
+                                     const tsg_value_kind_t* params,
+                                     size_t n_params) {
+  if (program->program.getRootFrame() == nullptr) {
+    llvm::errs() << "program has no top-level frame\n";
+    return nullptr;
+  }
+
+  std::string key(name);
+  key += ':';
+  for (size_t i = 0; i < n_params; i++) {
+    key += (params[i] == TSG_VALUE_BOOL) ? 'b' : 'i';
+  }
+
+  auto found = program->functions.find(key);
+  if (found != program->functions.end()) {
+    return found->second.get();
+  }
+
+  tsg_type_arr_t* args = tsg_type_arr_create(n_params);
+  for (size_t i = 0; i < n_params; i++) {
+    args->elem[i] = tsg_typetbl_prim(program->program.getTypes(),
+                                     conv_value_kind(params[i]));
+  }
+
+  std::unique_ptr<tsg_function_t> function;
+  tsg_type_t* func_type = nullptr;
+  void* entry = program->program.instantiate(name, args, &func_type);
+
+  if (entry != nullptr) {
+    tsg_type_kind_t ret_kind = func_type->func.ret->kind;
+    if (ret_kind == TSG_TYPE_BOOL || ret_kind == TSG_TYPE_INT) {
+      function.reset(new tsg_function_t());
+      function->entry = reinterpret_cast<tsg_function_t::entry_func_t>(entry);
+      function->outer = program->program.getRootFrame();
+      function->params.assign(params, params + n_params);
+      function->result =
+          (ret_kind == TSG_TYPE_BOOL) ? TSG_VALUE_BOOL : TSG_VALUE_INT;
+    } else {
+      llvm::errs() << name << " does not return an int or a bool\n";
+    }
+  }
+
+  tsg_function_t* result = function.get();
+  program->functions[key] = std::move(function);
+  return result;
+}
+
+tsg_value_kind_t tsg_function_result_kind(const tsg_function_t* function) {
+  return function->result;
+}
+
+bool tsg_function_call(const tsg_function_t* function, const tsg_value_t* args,
+                       tsg_value_t* ret) {
+  size_t n_params = function->params.size();
+
+  uint64_t small_cells[8];
+  std::vector<uint64_t> large_cells;
+  uint64_t* cells = small_cells;
+  if (n_params > 8) {
+    large_cells.resize(n_params);
+    cells = large_cells.data();
+  }
+
+  for (size_t i = 0; i < n_params; i++) {
+    if (args[i].kind != function->params[i]) {
+      return false;
+    }
+    cells[i] = (args[i].kind == TSG_VALUE_BOOL)
+                   ? static_cast<uint64_t>(args[i].b)
+                   : static_cast<uint32_t>(args[i].i);
+  }
+
+  uint64_t value = 0;
+  function->entry(function->outer, cells, &value);
+
+  ret->kind = function->result;
+  if (function->result == TSG_VALUE_BOOL) {
+    ret->b = (value != 0);
+  } else {
+    ret->i = static_cast<int32_t>(value);
+  }
+
+  return true;
+}
 
 int32_t tsg_engine_run_ast(tsg_ast_t* ast) {
-  tsugu::Compiler compiler;
-  int32_t ret = compiler.run(ast);
+  tsg_engine_t* engine = tsg_engine_create(nullptr);
+  if (engine == nullptr) {
+    return -1;
+  }
+
+  int32_t ret = tsg_engine_run(engine, ast);
+  tsg_engine_destroy(engine);
   return ret;
 }
+
+static bool emit_object(tsugu::Emitter& emitter, tsg_ast_t* ast,
+                        const std::string& path, const char* profile_path) {
+  tsugu::PgoProfile profile;
+  if (profile_path != nullptr && profile.load(profile_path) == false) {
+    return false;
+  }
+
+  llvm::LLVMContext context;
+  tsugu::Compiler compiler(context, nullptr);
+  if (profile_path != nullptr) {
+    compiler.setProfile(&profile);
+  }
+  auto module = compiler.compileStandalone(ast);
+  if (!module) {
+    return false;
+  }
+
+  return emitter.emitObject(*module, path);
+}
+
+bool tsg_engine_emit_object(tsg_ast_t* ast, const char* path,
+                            const char* profile_path) {
+  tsugu::Emitter emitter;
+  if (emitter.init() == false) {
+    return false;
+  }
+
+  return emit_object(emitter, ast, path, profile_path);
+}
+
+bool tsg_engine_emit_executable(tsg_ast_t* ast, const char* path,
+                                const char* profile_path) {
+  tsugu::Emitter emitter;
+  if (emitter.init() == false) {
+    return false;
+  }
+
+  llvm::SmallString<128> object_path;
+  auto ec = llvm::sys::fs::createTemporaryFile("tsugu", "o", object_path);
+  if (ec) {
+    llvm::errs() << "cannot create a temporary file: " << ec.message() << "\n";
+    return false;
+  }
+
+  std::string object_file(object_path.c_str());
+  bool ok = emit_object(emitter, ast, object_file, profile_path) &&
+            emitter.linkExecutable(object_file, path);
+
+  llvm::sys::fs::remove(object_path);
+  return ok;
+}
@@ -0,0 +1,356 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file evaluator.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "evaluator.h"
+
+#include <cassert>
+#include <climits>
+
+using namespace tsugu;
+
+static const int32_t MAX_EVAL_DEPTH = 1024;
+
+Evaluator::Evaluator(int64_t max_steps, int64_t max_memory)
+    : step_budget(max_steps),
+      memory_budget(max_memory),
+      memo(),
+      failures(),
+      folds(),
+      steps(0),
+      memory(0),
+      depth(0),
+      failed(false),
+      tyenv(nullptr),
+      frame(nullptr) {}
+
+Evaluator::~Evaluator() {}
+
+bool Evaluator::evaluate(tsg_func_t* func, tsg_tyenv_t* env,
+                         const std::vector<int32_t>& args, int32_t* result) {
+  if (!env->pure) {
+    return false;
+  }
+
+  std::vector<value_t> values;
+  for (auto arg : args) {
+    values.push_back(static_cast<uint32_t>(arg));
+  }
+
+  memo_key_t key(func, env, values);
+  if (failures.count(key) != 0) {
+    return false;
+  }
+
+  this->steps = 0;
+  this->failed = false;
+  value_t value = evalFunc(func, env, nullptr, values);
+  assert(this->frame == nullptr && this->depth == 0);
+
+  if (failed) {
+    failures.insert(key);
+    return false;
+  }
+
+  *result = static_cast<int32_t>(value);
+
+  Fold fold;
+  fold.func = func;
+  fold.env = env;
+  fold.args = args;
+  fold.value = *result;
+  fold.steps = steps;
+  folds.push_back(fold);
+
+  return true;
+}
+
+void Evaluator::printFolds(llvm::raw_ostream& os) const {
+  for (auto& fold : folds) {
+    auto type = tsg_tyenv_get(fold.env, fold.func->ftype);
+    os << "; folded " << tsg_ident_cstr(fold.func->decl->name) << "(";
+    for (size_t i = 0; i < fold.args.size(); i++) {
+      if (i > 0) {
+        os << ", ";
+      }
+      if (type->func.params->elem[i]->kind == TSG_TYPE_BOOL) {
+        os << (fold.args[i] ? "true" : "false");
+      } else {
+        os << fold.args[i];
+      }
+    }
+    os << ") = ";
+    if (type->func.ret->kind == TSG_TYPE_BOOL) {
+      os << (fold.value ? "true" : "false");
+    } else {
+      os << fold.value;
+    }
+    os << " in " << fold.steps << " steps\n";
+  }
+}
+
+bool Evaluator::evalBinary(tsg_token_kind_t op, int32_t lhs, int32_t rhs,
+                           int32_t* result) {
+  // ints wrap around like the i32 arithmetic of compiled code
+  auto l = static_cast<uint32_t>(lhs);
+  auto r = static_cast<uint32_t>(rhs);
+
+  switch (op) {
+    case TSG_TOKEN_EQ:
+      *result = (lhs == rhs);
+      return true;
+
+    case TSG_TOKEN_LT:
+      *result = (lhs < rhs);
+      return true;
+
+    case TSG_TOKEN_GT:
+      *result = (lhs > rhs);
+      return true;
+
+    case TSG_TOKEN_ADD:
+      *result = static_cast<int32_t>(l + r);
+      return true;
+
+    case TSG_TOKEN_SUB:
+      *result = static_cast<int32_t>(l - r);
+      return true;
+
+    case TSG_TOKEN_MUL:
+      *result = static_cast<int32_t>(l * r);
+      return true;
+
+    case TSG_TOKEN_DIV:
+      if (rhs == 0 || (lhs == INT32_MIN && rhs == -1)) {
+        return false;
+      }
+      *result = lhs / rhs;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+bool Evaluator::spend(int64_t n_steps, int64_t n_bytes) {
+  if (failed || steps + n_steps > step_budget ||
+      memory + n_bytes > memory_budget) {
+    failed = true;
+    return false;
+  }
+
+  steps += n_steps;
+  memory += n_bytes;
+  return true;
+}
+
+Evaluator::value_t Evaluator::evalFunc(tsg_func_t* func, tsg_tyenv_t* env,
+                                       Frame* outer,
+                                       const std::vector<value_t>& args) {
+  // the result of anything else may depend on the frames it reads
+  bool memoizable = env->pure;
+  memo_key_t key(func, env, args);
+  if (memoizable) {
+    auto found = memo.find(key);
+    if (found != memo.end()) {
+      return found->second;
+    }
+  }
+
+  // left to run time, like a call that outgrows the budgets
+  if (depth >= MAX_EVAL_DEPTH) {
+    failed = true;
+    return 0;
+  }
+
+  int64_t frame_bytes = static_cast<int64_t>(
+      sizeof(Frame) + func->frame->size * sizeof(value_t));
+  if (!spend(0, frame_bytes)) {
+    return 0;
+  }
+
+  Frame callee_frame;
+  callee_frame.outer = outer;
+  callee_frame.depth = func->frame->depth;
+  callee_frame.slots.resize(func->frame->size);
+
+  auto arg = args.begin();
+  for (auto node = func->params->head; node != nullptr; node = node->next) {
+    callee_frame.slots[node->decl->object->index] = *(arg++);
+  }
+
+  auto stashed_env = this->tyenv;
+  auto stashed_frame = this->frame;
+  this->tyenv = env;
+  this->frame = &callee_frame;
+
+  this->depth += 1;
+  value_t value = evalBlock(func->body);
+  this->depth -= 1;
+
+  this->frame = stashed_frame;
+  this->tyenv = stashed_env;
+  memory -= frame_bytes;
+
+  if (failed) {
+    return 0;
+  }
+
+  // Only finished calls are kept, and only while the memo fits.
+  int64_t memo_bytes = static_cast<int64_t>(
+      sizeof(memo_key_t) + sizeof(value_t) * (args.size() + 1));
+  if (memoizable && memory + memo_bytes <= memory_budget) {
+    memo[key] = value;
+    memory += memo_bytes;
+  }
+
+  return value;
+}
+
+Evaluator::value_t Evaluator::evalBlock(tsg_block_t* block) {
+  for (auto node = block->funcs->head; node != nullptr; node = node->next) {
+    auto object = node->func->decl->object;
+    frame->slots[object->index] = reinterpret_cast<value_t>(frame);
+  }
+
+  return evalStmtList(block->stmts);
+}
+
+Evaluator::value_t Evaluator::evalStmtList(tsg_stmt_list_t* stmts) {
+  value_t last_value = 0;
+
+  auto node = stmts->head;
+  while (node != nullptr && !failed) {
+    last_value = evalStmt(node->stmt);
+    node = node->next;
+  }
+
+  return last_value;
+}
+
+Evaluator::value_t Evaluator::evalStmt(tsg_stmt_t* stmt) {
+  switch (stmt->kind) {
+    case TSG_STMT_VAL: {
+      value_t value = evalExpr(stmt->val.expr);
+      frame->slots[stmt->val.decl->object->index] = value;
+      return value;
+    }
+
+    case TSG_STMT_EXPR:
+      return evalExpr(stmt->expr.expr);
+  }
+
+  assert(false);
+  return 0;
+}
+
+Evaluator::value_t Evaluator::evalExpr(tsg_expr_t* expr) {
+  if (!spend(1, 0)) {
+    return 0;
+  }
+
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      return evalExprBinary(expr);
+
+    case TSG_EXPR_CALL:
+      return evalExprCall(expr);
+
+    case TSG_EXPR_IFELSE:
+      return evalExprIfelse(expr);
+
+    case TSG_EXPR_IDENT:
+      return evalExprIdent(expr);
+
+    case TSG_EXPR_NUMBER:
+      return static_cast<uint32_t>(expr->number.value);
+  }
+
+  assert(false);
+  return 0;
+}
+
+Evaluator::value_t Evaluator::evalExprBinary(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_BINARY);
+
+  value_t lhs = evalExpr(expr->binary.lhs);
+  value_t rhs = evalExpr(expr->binary.rhs);
+  if (failed) {
+    return 0;
+  }
+
+  // as in the interpreter, any two values compare by their bits
+  if (expr->binary.op == TSG_TOKEN_EQ) {
+    return lhs == rhs;
+  }
+
+  int32_t result;
+  if (!evalBinary(expr->binary.op, static_cast<int32_t>(lhs),
+                  static_cast<int32_t>(rhs), &result)) {
+    failed = true;
+    return 0;
+  }
+
+  // bools are already 0 or 1
+  return static_cast<uint32_t>(result);
+}
+
+Evaluator::value_t Evaluator::evalExprCall(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_CALL);
+
+  value_t callee_obj = evalExpr(expr->call.callee);
+  tsg_type_t* callee_type = tsg_tyenv_get(tyenv, expr->call.callee->tyvar);
+  assert(callee_type != nullptr && callee_type->kind == TSG_TYPE_POLY);
+
+  std::vector<value_t> args;
+  args.reserve(expr->call.args->size);
+  for (auto node = expr->call.args->head; node; node = node->next) {
+    args.push_back(evalExpr(node->expr));
+  }
+
+  if (failed) {
+    return 0;
+  }
+
+  tsg_type_t* func_type = tsg_tyenv_get(tyenv, expr->call.ftype);
+  assert(func_type != nullptr && func_type->kind == TSG_TYPE_FUNC);
+  tsg_tyenv_t* callee_env = func_type->func.env;
+
+  return evalFunc(callee_type->poly.func, callee_env,
+                  reinterpret_cast<Frame*>(callee_obj), args);
+}
+
+Evaluator::value_t Evaluator::evalExprIfelse(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_IFELSE);
+
+  value_t cond = evalExpr(expr->ifelse.cond);
+  if (failed) {
+    return 0;
+  }
+
+  return evalBlock(cond ? expr->ifelse.thn : expr->ifelse.els);
+}
+
+Evaluator::value_t Evaluator::evalExprIdent(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_IDENT);
+
+  // closed functions are called without a frame
+  tsg_member_t* member = expr->ident.object;
+  if (member->func != nullptr && member->func->conv == TSG_FUNC_CLOSED) {
+    return 0;
+  }
+
+  return findFrame(member)->slots[member->index];
+}
+
+Evaluator::Frame* Evaluator::findFrame(tsg_member_t* member) {
+  Frame* found = frame;
+  while (found->depth > member->depth) {
+    found = found->outer;
+  }
+
+  assert(found != nullptr && found->depth == member->depth);
+  return found;
+}
@@ -0,0 +1,100 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file evaluator.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_EVALUATOR_H
+#define TSUGU_ENGINE_EVALUATOR_H
+
+#include <tsugu/core/ast.h>
+#include <tsugu/core/tyenv.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <vector>
+
+namespace tsugu {
+
+/**
+ * Runs calls of the verified AST at compile time, so that their results
+ * can be folded into constants.
+ *
+ * Only instances the verifier marks as pure are evaluated, so the only
+ * ways a call can fail are a division that would trap and running out of
+ * budget. Every attempt gets `max_steps` expressions to evaluate, and the
+ * frames it has live at once may take up to `max_memory` bytes. Calls nest
+ * on the native stack, so an attempt also gives up on a call made deeper
+ * than MAX_EVAL_DEPTH, whatever its budgets. Calls of pure instances
+ * are memoized across attempts while the memo fits in the same budget,
+ * which makes naive recursions like `fib` linear.
+ */
+class Evaluator {
+ public:
+  Evaluator(int64_t max_steps, int64_t max_memory);
+  virtual ~Evaluator();
+
+  // ints and bools are zero-extended; true on success
+  bool evaluate(tsg_func_t* func, tsg_tyenv_t* env,
+                const std::vector<int32_t>& args, int32_t* result);
+  void printFolds(llvm::raw_ostream& os) const;
+
+  // false where compiled code would trap
+  static bool evalBinary(tsg_token_kind_t op, int32_t lhs, int32_t rhs,
+                         int32_t* result);
+
+ private:
+  typedef uint64_t value_t;
+
+  struct Frame {
+    Frame* outer;
+    int32_t depth;
+    std::vector<value_t> slots;
+  };
+
+  struct Fold {
+    tsg_func_t* func;
+    tsg_tyenv_t* env;
+    std::vector<int32_t> args;
+    int32_t value;
+    int64_t steps;
+  };
+
+  typedef std::tuple<tsg_func_t*, tsg_tyenv_t*, std::vector<value_t>>
+      memo_key_t;
+
+  int64_t step_budget;
+  int64_t memory_budget;
+  std::map<memo_key_t, value_t> memo;
+  std::set<memo_key_t> failures;
+  std::vector<Fold> folds;
+
+  int64_t steps;
+  int64_t memory;
+  int32_t depth;
+  bool failed;
+  tsg_tyenv_t* tyenv;
+  Frame* frame;
+
+  bool spend(int64_t n_steps, int64_t n_bytes);
+  value_t evalFunc(tsg_func_t* func, tsg_tyenv_t* env, Frame* outer,
+                   const std::vector<value_t>& args);
+  value_t evalBlock(tsg_block_t* block);
+  value_t evalStmtList(tsg_stmt_list_t* stmts);
+  value_t evalStmt(tsg_stmt_t* stmt);
+
+  value_t evalExpr(tsg_expr_t* expr);
+  value_t evalExprBinary(tsg_expr_t* expr);
+  value_t evalExprCall(tsg_expr_t* expr);
+  value_t evalExprIfelse(tsg_expr_t* expr);
+  value_t evalExprIdent(tsg_expr_t* expr);
+
+  Frame* findFrame(tsg_member_t* member);
+};
+
+}  // namespace tsugu
+
+#endif
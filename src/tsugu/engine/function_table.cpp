@@ -6,13 +6,20 @@
 
 #include "function_table.h"
 
+#include <cassert>
+
 using namespace tsugu;
 
-void FunctionTable::set(tsg_func_t* func, tsg_tyenv_t* env,
-                        llvm::Function* instance) {
-  table[func][env] = instance;
+void FunctionTable::set(tsg_tyenv_t* env, llvm::Function* instance) {
+  assert(env->id >= 0);
+  size_t id = static_cast<size_t>(env->id);
+  if (id >= table.size()) {
+    table.resize(id + 1, nullptr);
+  }
+  table[id] = instance;
 }
 
-llvm::Function* FunctionTable::get(tsg_func_t* func, tsg_tyenv_t* env) {
-  return table[func][env];
+llvm::Function* FunctionTable::get(tsg_tyenv_t* env) const {
+  size_t id = static_cast<size_t>(env->id);
+  return env->id >= 0 && id < table.size() ? table[id] : nullptr;
 }
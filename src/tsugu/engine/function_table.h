@@ -10,23 +10,25 @@
 #include <tsugu/core/ast.h>
 #include <tsugu/core/tyenv.h>
 #include <llvm/IR/Function.h>
-#include <unordered_map>
+#include <vector>
 
 namespace tsugu {
 
+/**
+ * The LLVM function of each instance in one module, indexed by the id the
+ * verifier gave the instance in the insttbl of its AST.
+ */
 class FunctionTable {
  public:
   FunctionTable() : table() {}
   virtual ~FunctionTable() {}
 
-  void set(tsg_func_t* func, tsg_tyenv_t* env, llvm::Function* instance);
-  llvm::Function* get(tsg_func_t* func, tsg_tyenv_t* env);
+  void set(tsg_tyenv_t* env, llvm::Function* instance);
+  // null if the module has none for `env`
+  llvm::Function* get(tsg_tyenv_t* env) const;
 
  private:
-  typedef std::unordered_map<tsg_tyenv_t*, llvm::Function*> env_tbl_t;
-  typedef std::unordered_map<tsg_func_t*, env_tbl_t> func_tbl_t;
-
-  func_tbl_t table;
+  std::vector<llvm::Function*> table;
 };
 
 }  // namespace tsugu
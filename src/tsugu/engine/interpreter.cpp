@@ -0,0 +1,498 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file interpreter.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "interpreter.h"
+
+#include "program.h"
+#include <tsugu/core/platform.h>
+#include <algorithm>
+
+using namespace tsugu;
+
+static const size_t STACK_CHUNK_SIZE = 64 * 1024;
+static const int32_t MAX_EVAL_DEPTH = 256;
+
+Interpreter::Interpreter(Program& owner, int32_t tier_threshold,
+                         bool tier_background)
+    : program(owner),
+      threshold(tier_threshold),
+      background(tier_background),
+      instances(),
+      layouts(),
+      instance(nullptr),
+      frameptr(nullptr),
+      rootframe(nullptr),
+      eval_depth(0),
+      stack_chunks(),
+      stack_chunk(0),
+      stack_used(0),
+      worker(),
+      queue_mutex(),
+      queue_cond(),
+      compiled_cond(),
+      queue(),
+      stopping(false) {}
+
+Interpreter::~Interpreter() {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  queue_cond.notify_all();
+
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+int32_t Interpreter::run(tsg_ast_t* ast) {
+  Instance* root = fetchInstance(ast->root, ast->tyenv);
+  // `$main` runs exactly once, so there is nothing to gain by compiling it.
+  root->queued = true;
+
+  // The root frame is never popped. Functions defined at the top level keep
+  // a valid `$outer` and can still be called after `run` returns.
+  const FrameLayout* layout = root->layouts.back();
+  this->instance = root;
+  this->frameptr = allocFrame(layout);
+  *reinterpret_cast<uint8_t**>(frameptr + layout->offsets[0]) = nullptr;
+  this->rootframe = this->frameptr;
+
+  value_t value = evalBlock(root->func->body);
+
+  this->frameptr = nullptr;
+  this->instance = nullptr;
+
+  return static_cast<int32_t>(value);
+}
+
+Interpreter::Instance* Interpreter::fetchInstance(tsg_func_t* func,
+                                                  tsg_tyenv_t* env) {
+  size_t id = static_cast<size_t>(env->id);
+  if (id >= instances.size()) {
+    instances.resize(id + 1);
+  } else if (instances[id] != nullptr) {
+    return instances[id].get();
+  }
+
+  std::unique_ptr<Instance> created(new Instance());
+  created->func = func;
+  created->env = env;
+  created->id = -1;
+  created->calls = 0;
+  created->backedges = 0;
+  created->queued = false;
+  created->compiled = false;
+  created->failed.store(false);
+  created->entry.store(nullptr);
+
+  tsg_frame_t* frame = func->frame;
+  tsg_tyenv_t* frame_env = env;
+  created->layouts.resize(frame->depth + 1);
+  while (frame != nullptr) {
+    created->layouts[frame->depth] = fetchLayout(frame, frame_env);
+    frame = frame->outer;
+    frame_env = frame_env->outer;
+  }
+
+  Instance* result = created.get();
+  instances[id] = std::move(created);
+  return result;
+}
+
+const FrameLayout* Interpreter::fetchLayout(tsg_frame_t* frame,
+                                            tsg_tyenv_t* env) {
+  size_t id = static_cast<size_t>(env->id);
+  if (id >= layouts.size()) {
+    layouts.resize(id + 1);
+  } else if (layouts[id] != nullptr) {
+    return layouts[id].get();
+  }
+
+  std::unique_ptr<FrameLayout> layout(new FrameLayout());
+  program.getFrameLayout(frame, env, layout.get());
+
+  const FrameLayout* result = layout.get();
+  layouts[id] = std::move(layout);
+  return result;
+}
+
+void Interpreter::countCall(Instance* callee) {
+  if (callee == instance) {
+    callee->backedges += 1;
+  } else {
+    callee->calls += 1;
+  }
+
+  if (threshold <= 0 || callee->queued) {
+    return;
+  }
+
+  if (callee->calls + callee->backedges >= static_cast<uint64_t>(threshold)) {
+    promote(callee);
+  }
+}
+
+void Interpreter::promote(Instance* target) {
+  target->queued = true;
+  target->id = program.acquireInstanceId(target->env);
+
+  if (!background) {
+    finishCompile(target, program.compileEntry(target->id));
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (!worker.joinable()) {
+      worker = std::thread(&Interpreter::runWorker, this);
+    }
+    queue.push_back(target);
+  }
+  queue_cond.notify_one();
+}
+
+void Interpreter::runWorker() {
+  while (true) {
+    Instance* target;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      queue_cond.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+      target = queue.front();
+      queue.pop_front();
+    }
+
+    finishCompile(target, program.compileEntry(target->id));
+  }
+}
+
+Interpreter::entry_func_t Interpreter::compileNow(Instance* target) {
+  if (target->queued) {
+    // Take it back from the worker if it has not been started, or wait for
+    // it, so that it is never compiled twice.
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    auto it = std::find(queue.begin(), queue.end(), target);
+    if (it == queue.end()) {
+      // on the worker, or already done, with or without an entry
+      compiled_cond.wait(lock, [target] { return target->compiled; });
+      return target->entry.load(std::memory_order_acquire);
+    }
+    queue.erase(it);
+  } else {
+    target->queued = true;
+    target->id = program.acquireInstanceId(target->env);
+  }
+
+  return finishCompile(target, program.compileEntry(target->id));
+}
+
+Interpreter::entry_func_t Interpreter::finishCompile(Instance* target,
+                                                     void* address) {
+  auto entry = reinterpret_cast<entry_func_t>(address);
+  target->entry.store(entry, std::memory_order_release);
+  target->failed.store(entry == nullptr, std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    target->compiled = true;
+  }
+  compiled_cond.notify_all();
+
+  return entry;
+}
+
+uint8_t* Interpreter::allocFrame(const FrameLayout* layout) {
+  assert(layout->size <= STACK_CHUNK_SIZE);
+
+  size_t offset = (stack_used + layout->align - 1) & ~(layout->align - 1);
+  if (stack_chunks.empty() || offset + layout->size > STACK_CHUNK_SIZE) {
+    if (!stack_chunks.empty()) {
+      stack_chunk += 1;
+    }
+    if (stack_chunk == stack_chunks.size()) {
+      stack_chunks.emplace_back(new uint8_t[STACK_CHUNK_SIZE]);
+    }
+    offset = 0;
+  }
+
+  stack_used = offset + layout->size;
+  return stack_chunks[stack_chunk].get() + offset;
+}
+
+void Interpreter::store(tsg_member_t* member, value_t value) {
+  uint64_t size;
+  uint8_t* slot = findSlot(member, &size);
+
+  switch (size) {
+    case 1:
+      *reinterpret_cast<uint8_t*>(slot) = static_cast<uint8_t>(value);
+      break;
+
+    case 4:
+      *reinterpret_cast<uint32_t*>(slot) = static_cast<uint32_t>(value);
+      break;
+
+    case 8:
+      *reinterpret_cast<uint64_t*>(slot) = value;
+      break;
+
+    default:
+      assert(false);
+      break;
+  }
+}
+
+Interpreter::value_t Interpreter::load(tsg_member_t* member) {
+  uint64_t size;
+  uint8_t* slot = findSlot(member, &size);
+
+  switch (size) {
+    case 1:
+      return *reinterpret_cast<uint8_t*>(slot);
+
+    case 4:
+      return *reinterpret_cast<uint32_t*>(slot);
+
+    case 8:
+      return *reinterpret_cast<uint64_t*>(slot);
+  }
+
+  assert(false);
+  return 0;
+}
+
+uint8_t* Interpreter::findSlot(tsg_member_t* member, uint64_t* size) {
+  uint8_t* fp = this->frameptr;
+  int32_t depth = static_cast<int32_t>(instance->layouts.size()) - 1;
+  assert(0 <= member->depth && member->depth <= depth);
+
+  while (member->depth < depth) {
+    const FrameLayout* layout = instance->layouts[depth];
+    fp = *reinterpret_cast<uint8_t**>(fp + layout->offsets[0]);
+    depth -= 1;
+  }
+
+  const FrameLayout* layout = instance->layouts[depth];
+  *size = layout->sizes[member->index + 1];
+  return fp + layout->offsets[member->index + 1];
+}
+
+Interpreter::value_t Interpreter::callFunc(Instance* callee, uint8_t* outer,
+                                           value_t* args) {
+  entry_func_t entry = callee->entry.load(std::memory_order_acquire);
+  if (entry == nullptr && eval_depth >= MAX_EVAL_DEPTH &&
+      !callee->failed.load(std::memory_order_acquire)) {
+    entry = compileNow(callee);
+  }
+
+  if (entry != nullptr) {
+    value_t value = 0;
+    entry(outer, args, &value);
+    return value;
+  }
+
+  return evalFunc(callee, outer, args);
+}
+
+Interpreter::value_t Interpreter::evalFunc(Instance* callee, uint8_t* outer,
+                                           value_t* args) {
+  auto stashed_instance = this->instance;
+  auto stashed_frameptr = this->frameptr;
+  auto stashed_chunk = this->stack_chunk;
+  auto stashed_used = this->stack_used;
+
+  const FrameLayout* layout = callee->layouts.back();
+  this->instance = callee;
+  this->frameptr = allocFrame(layout);
+  *reinterpret_cast<uint8_t**>(frameptr + layout->offsets[0]) = outer;
+
+  auto node = callee->func->params->head;
+  while (node != nullptr) {
+    store(node->decl->object, *(args++));
+    node = node->next;
+  }
+
+  this->eval_depth += 1;
+  value_t value = evalBlock(callee->func->body);
+  this->eval_depth -= 1;
+
+  this->stack_used = stashed_used;
+  this->stack_chunk = stashed_chunk;
+  this->frameptr = stashed_frameptr;
+  this->instance = stashed_instance;
+
+  return value;
+}
+
+Interpreter::value_t Interpreter::evalBlock(tsg_block_t* block) {
+  evalFuncList(block->funcs);
+  return evalStmtList(block->stmts);
+}
+
+void Interpreter::evalFuncList(tsg_func_list_t* funcs) {
+  auto node = funcs->head;
+  while (node != nullptr) {
+    store(node->func->decl->object, reinterpret_cast<value_t>(frameptr));
+    node = node->next;
+  }
+}
+
+Interpreter::value_t Interpreter::evalStmtList(tsg_stmt_list_t* stmts) {
+  value_t last_value = 0;
+
+  auto node = stmts->head;
+  while (node != nullptr) {
+    last_value = evalStmt(node->stmt);
+    node = node->next;
+  }
+
+  return last_value;
+}
+
+Interpreter::value_t Interpreter::evalStmt(tsg_stmt_t* stmt) {
+  switch (stmt->kind) {
+    case TSG_STMT_VAL:
+      return evalStmtVal(stmt);
+
+    case TSG_STMT_EXPR:
+      return evalStmtExpr(stmt);
+  }
+
+  assert(false);
+  return 0;
+}
+
+Interpreter::value_t Interpreter::evalStmtVal(tsg_stmt_t* stmt) {
+  assert(stmt != nullptr && stmt->kind == TSG_STMT_VAL);
+
+  value_t value = evalExpr(stmt->val.expr);
+  store(stmt->val.decl->object, value);
+
+  return value;
+}
+
+Interpreter::value_t Interpreter::evalStmtExpr(tsg_stmt_t* stmt) {
+  assert(stmt != nullptr && stmt->kind == TSG_STMT_EXPR);
+  return evalExpr(stmt->expr.expr);
+}
+
+Interpreter::value_t Interpreter::evalExpr(tsg_expr_t* expr) {
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      return evalExprBinary(expr);
+
+    case TSG_EXPR_CALL:
+      return evalExprCall(expr);
+
+    case TSG_EXPR_IFELSE:
+      return evalExprIfelse(expr);
+
+    case TSG_EXPR_IDENT:
+      return evalExprIdent(expr);
+
+    case TSG_EXPR_NUMBER:
+      return evalExprNumber(expr);
+  }
+
+  assert(false);
+  return 0;
+}
+
+Interpreter::value_t Interpreter::evalExprBinary(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_BINARY);
+
+  value_t lhs = evalExpr(expr->binary.lhs);
+  value_t rhs = evalExpr(expr->binary.rhs);
+
+  // ints wrap around like the i32 arithmetic of compiled code
+  auto l = static_cast<uint32_t>(lhs);
+  auto r = static_cast<uint32_t>(rhs);
+
+  switch (expr->binary.op) {
+    case TSG_TOKEN_EQ:
+      return lhs == rhs;
+
+    case TSG_TOKEN_LT:
+      return static_cast<int32_t>(l) < static_cast<int32_t>(r);
+
+    case TSG_TOKEN_GT:
+      return static_cast<int32_t>(l) > static_cast<int32_t>(r);
+
+    case TSG_TOKEN_ADD:
+      return static_cast<uint32_t>(l + r);
+
+    case TSG_TOKEN_SUB:
+      return static_cast<uint32_t>(l - r);
+
+    case TSG_TOKEN_MUL:
+      return static_cast<uint32_t>(l * r);
+
+    case TSG_TOKEN_DIV:
+      return static_cast<uint32_t>(static_cast<int32_t>(l) /
+                                   static_cast<int32_t>(r));
+
+    default:
+      assert(false);
+      return 0;
+  }
+}
+
+Interpreter::value_t Interpreter::evalExprCall(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_CALL);
+
+  value_t callee_obj = evalExpr(expr->call.callee);
+  tsg_type_t* callee_type =
+      tsg_tyenv_get(instance->env, expr->call.callee->tyvar);
+  assert(callee_type != nullptr && callee_type->kind == TSG_TYPE_POLY);
+
+  std::vector<value_t> args;
+  args.reserve(expr->call.args->size);
+
+  auto node = expr->call.args->head;
+  while (node) {
+    args.push_back(evalExpr(node->expr));
+    node = node->next;
+  }
+
+  tsg_type_t* func_type = tsg_tyenv_get(instance->env, expr->call.ftype);
+  assert(func_type != nullptr && func_type->kind == TSG_TYPE_FUNC);
+  tsg_tyenv_t* callee_env = func_type->func.env;
+
+  Instance* callee = fetchInstance(callee_type->poly.func, callee_env);
+  countCall(callee);
+
+  return callFunc(callee, reinterpret_cast<uint8_t*>(callee_obj), args.data());
+}
+
+Interpreter::value_t Interpreter::evalExprIfelse(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_IFELSE);
+
+  if (evalExpr(expr->ifelse.cond)) {
+    return evalBlock(expr->ifelse.thn);
+  } else {
+    return evalBlock(expr->ifelse.els);
+  }
+}
+
+Interpreter::value_t Interpreter::evalExprIdent(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_IDENT);
+
+  // As in compiled code, where a closed function may have been called
+  // without frames to walk.
+  tsg_func_t* func = expr->ident.object->func;
+  if (func != nullptr && func->conv == TSG_FUNC_CLOSED) {
+    return 0;
+  }
+
+  return load(expr->ident.object);
+}
+
+Interpreter::value_t Interpreter::evalExprNumber(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_NUMBER);
+  return static_cast<uint32_t>(expr->number.value);
+}
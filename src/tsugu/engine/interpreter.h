@@ -0,0 +1,126 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file interpreter.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_INTERPRETER_H
+#define TSUGU_ENGINE_INTERPRETER_H
+
+#include "compiler.h"
+#include <tsugu/core/ast.h>
+#include <tsugu/core/tyenv.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tsugu {
+
+class Program;
+
+/**
+ * Tier-0 execution of a verified AST.
+ *
+ * Frames are laid out exactly like the `$sf` structs of compiled code, so
+ * a compiled instance can be handed an interpreter frame as its `$outer`.
+ * Each instance counts its calls and its self-recursive calls (the only
+ * back-edges in the language). An instance that crosses the threshold is
+ * compiled, on a background thread unless asked otherwise, and later calls
+ * go to native code through its entry thunk.
+ *
+ * Interpreted calls nest on the native stack, so a call made deeper than
+ * MAX_EVAL_DEPTH compiles its callee on the spot, whatever its counts, and
+ * goes to native code, where calls in tail position do not grow the stack.
+ * An instance whose compile failed is interpreted from then on.
+ */
+class Interpreter {
+ public:
+  Interpreter(Program& owner, int32_t tier_threshold, bool tier_background);
+  virtual ~Interpreter();
+
+  int32_t run(tsg_ast_t* ast);
+  uint8_t* getRootFrame() const { return rootframe; }
+
+ private:
+  // ints and bools zero-extended, functions as the address of their frame
+  typedef uint64_t value_t;
+  typedef void (*entry_func_t)(void* outer, value_t* args, value_t* ret);
+
+  struct Instance {
+    tsg_func_t* func;
+    tsg_tyenv_t* env;
+    int32_t id;
+    // layout of the frame at each depth, this instance's own one last
+    std::vector<const FrameLayout*> layouts;
+    uint64_t calls;
+    uint64_t backedges;
+    bool queued;
+    // set under the queue mutex once a compile of it is done, on whichever
+    // thread it ran, and whether or not it gave an entry
+    bool compiled;
+    // the compile gave no entry; calls of it stay interpreted
+    std::atomic<bool> failed;
+    std::atomic<entry_func_t> entry;
+  };
+
+  Program& program;
+  int32_t threshold;
+  bool background;
+  // both by the id of the env
+  std::vector<std::unique_ptr<Instance>> instances;
+  std::vector<std::unique_ptr<FrameLayout>> layouts;
+
+  Instance* instance;
+  uint8_t* frameptr;
+  uint8_t* rootframe;
+  int32_t eval_depth;
+
+  std::vector<std::unique_ptr<uint8_t[]>> stack_chunks;
+  size_t stack_chunk;
+  size_t stack_used;
+
+  std::thread worker;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cond;
+  std::condition_variable compiled_cond;
+  std::deque<Instance*> queue;
+  bool stopping;
+
+  Instance* fetchInstance(tsg_func_t* func, tsg_tyenv_t* env);
+  const FrameLayout* fetchLayout(tsg_frame_t* frame, tsg_tyenv_t* env);
+  void countCall(Instance* callee);
+  void promote(Instance* target);
+  entry_func_t compileNow(Instance* target);
+  entry_func_t finishCompile(Instance* target, void* address);
+  void runWorker();
+
+  uint8_t* allocFrame(const FrameLayout* layout);
+  void store(tsg_member_t* member, value_t value);
+  value_t load(tsg_member_t* member);
+  uint8_t* findSlot(tsg_member_t* member, uint64_t* size);
+
+  value_t callFunc(Instance* callee, uint8_t* outer, value_t* args);
+  value_t evalFunc(Instance* callee, uint8_t* outer, value_t* args);
+  value_t evalBlock(tsg_block_t* block);
+  void evalFuncList(tsg_func_list_t* funcs);
+  value_t evalStmtList(tsg_stmt_list_t* stmts);
+
+  value_t evalStmt(tsg_stmt_t* stmt);
+  value_t evalStmtVal(tsg_stmt_t* stmt);
+  value_t evalStmtExpr(tsg_stmt_t* stmt);
+
+  value_t evalExpr(tsg_expr_t* expr);
+  value_t evalExprBinary(tsg_expr_t* expr);
+  value_t evalExprCall(tsg_expr_t* expr);
+  value_t evalExprIfelse(tsg_expr_t* expr);
+  value_t evalExprIdent(tsg_expr_t* expr);
+  value_t evalExprNumber(tsg_expr_t* expr);
+};
+
+}  // namespace tsugu
+
+#endif
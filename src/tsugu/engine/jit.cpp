@@ -0,0 +1,143 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file jit.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "jit.h"
+
+#include "target.h"
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+
+using namespace tsugu;
+
+JIT::JIT()
+    : cache(nullptr),
+      memo_counters(nullptr),
+      pgo_profile(llvm::make_unique<PgoProfile>()),
+      perf_map(nullptr),
+      optimizer(nullptr),
+      lljit(nullptr),
+      mutex(),
+      n_programs(0) {}
+
+JIT::~JIT() {}
+
+bool JIT::init(const tsg_engine_config_t& config) {
+  initializeNativeTarget();
+
+  optimizer = llvm::make_unique<Optimizer>(config.opt_level, config.dump_ir);
+
+  auto host = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!host) {
+    llvm::logAllUnhandledErrors(host.takeError(), llvm::errs(), "");
+    return false;
+  }
+  host->setCodeGenOptLevel(Optimizer::getCodeGenLevel(config.opt_level));
+  // fastcc calls marked `tail` must not grow the stack
+  host->getOptions().GuaranteedTailCallOpt = true;
+
+  llvm::orc::LLJITBuilder builder;
+  builder.setJITTargetMachineBuilder(std::move(*host));
+  if (config.compile_threads > 1) {
+    builder.setNumCompileThreads(config.compile_threads);
+  }
+
+  if (config.cache_dir != nullptr) {
+    cache = llvm::make_unique<DiskCache>(config.cache_dir, config.opt_level);
+    if (cache->init() == false) {
+      return false;
+    }
+  }
+
+  if (config.memo_counters) {
+    memo_counters = llvm::make_unique<MemoCounters>();
+    memo_counters->hits.store(0);
+    memo_counters->misses.store(0);
+  }
+
+  // A target machine per module, as programs may be compiled on several
+  // threads at once.
+  auto object_cache = cache.get();
+  builder.setCompileFunctionCreator(
+      [object_cache](llvm::orc::JITTargetMachineBuilder jtmb)
+          -> llvm::Expected<llvm::orc::IRCompileLayer::CompileFunction> {
+        return llvm::orc::IRCompileLayer::CompileFunction(
+            llvm::orc::ConcurrentIRCompiler(std::move(jtmb), object_cache));
+      });
+
+  auto jit = builder.create();
+  if (!jit) {
+    llvm::logAllUnhandledErrors(jit.takeError(), llvm::errs(), "");
+    return false;
+  }
+
+  lljit = std::move(*jit);
+
+  if (config.profile) {
+    return registerListeners();
+  }
+
+  return true;
+}
+
+bool JIT::registerListeners() {
+  perf_map = llvm::make_unique<PerfMap>();
+  if (perf_map->init() == false) {
+    return false;
+  }
+
+  // LLJIT links with RuntimeDyld on ELF and COFF targets
+  auto& layer = static_cast<llvm::orc::RTDyldObjectLinkingLayer&>(
+      lljit->getObjLinkingLayer());
+  layer.registerJITEventListener(*perf_map);
+  layer.registerJITEventListener(
+      *llvm::JITEventListener::createGDBRegistrationListener());
+
+  // null unless LLVM was built with LLVM_USE_PERF
+  auto perf_listener = llvm::JITEventListener::createPerfJITEventListener();
+  if (perf_listener != nullptr) {
+    layer.registerJITEventListener(*perf_listener);
+  }
+
+  return true;
+}
+
+const llvm::DataLayout& JIT::getDataLayout() const {
+  return lljit->getDataLayout();
+}
+
+llvm::orc::JITDylib& JIT::createProgram() {
+  std::lock_guard<std::mutex> lock(mutex);
+  n_programs += 1;
+  return lljit->createJITDylib("program." + std::to_string(n_programs));
+}
+
+bool JIT::addModule(llvm::orc::JITDylib& program,
+                    std::unique_ptr<llvm::Module> module,
+                    llvm::orc::ThreadSafeContext module_context) {
+  {
+    auto context_lock = module_context.getLock();
+    optimizer->optimize(*module);
+  }
+
+  auto err = lljit->addIRModule(
+      program, llvm::orc::ThreadSafeModule(std::move(module), module_context));
+  if (err) {
+    llvm::logAllUnhandledErrors(std::move(err), llvm::errs(), "");
+    return false;
+  }
+
+  return true;
+}
+
+void* JIT::lookup(llvm::orc::JITDylib& program, const std::string& name) {
+  auto symbol = lljit->lookup(program, name);
+  if (!symbol) {
+    llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), "");
+    return nullptr;
+  }
+
+  return reinterpret_cast<void*>(symbol->getAddress());
+}
@@ -0,0 +1,81 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file jit.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_JIT_H
+#define TSUGU_ENGINE_JIT_H
+
+#include "disk_cache.h"
+#include "memo_table.h"
+#include "optimizer.h"
+#include "perf_map.h"
+#include "pgo_profile.h"
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/Module.h>
+#include <tsugu/engine/engine.h>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace tsugu {
+
+/**
+ * Long-lived ORC session shared by every program run on an engine.
+ *
+ * The target machine and the execution session are set up once. Each
+ * program gets its own JITDylib, so symbol names such as `$main` never
+ * collide between programs, and brings its own context with its modules.
+ * Programs may be created and compiled from several threads at once.
+ *
+ * With a cache directory, object code is looked up in a DiskCache before
+ * codegen and stored there after it. With several compile threads, modules
+ * that have their own contexts are lowered concurrently.
+ *
+ * Modules are optimized as they are added, at the configured level, and
+ * codegen runs at the matching level.
+ *
+ * With memo counters on, the memo tables of every program count their hits
+ * and misses into one MemoCounters. Instrumented code counts into the
+ * engine's one PgoProfile, which is also where saved profiles are loaded.
+ *
+ * When profiling, every loaded object is reported to a PerfMap, to gdb's
+ * JIT interface and, if LLVM was built with perf support, to perf's jitdump.
+ */
+class JIT {
+ public:
+  JIT();
+  virtual ~JIT();
+
+  bool init(const tsg_engine_config_t& config);
+
+  const llvm::DataLayout& getDataLayout() const;
+
+  llvm::orc::JITDylib& createProgram();
+  bool addModule(llvm::orc::JITDylib& program,
+                 std::unique_ptr<llvm::Module> module,
+                 llvm::orc::ThreadSafeContext module_context);
+  void* lookup(llvm::orc::JITDylib& program, const std::string& name);
+
+  DiskCache* getCache() { return cache.get(); }
+  MemoCounters* getMemoCounters() { return memo_counters.get(); }
+  PgoProfile* getPgoProfile() { return pgo_profile.get(); }
+
+ private:
+  std::unique_ptr<DiskCache> cache;
+  std::unique_ptr<MemoCounters> memo_counters;
+  std::unique_ptr<PgoProfile> pgo_profile;
+  std::unique_ptr<PerfMap> perf_map;
+  std::unique_ptr<Optimizer> optimizer;
+  std::unique_ptr<llvm::orc::LLJIT> lljit;
+  std::mutex mutex;
+  uint64_t n_programs;
+
+  bool registerListeners();
+};
+
+}  // namespace tsugu
+
+#endif
@@ -0,0 +1,524 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file lowering.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "lowering.h"
+
+#include "compiler.h"
+#include <algorithm>
+#include <cassert>
+
+using namespace tsugu;
+
+static bool block_defines_closures(tsg_block_t* block);
+static bool expr_defines_closures(tsg_expr_t* expr);
+
+static bool block_defines_closures(tsg_block_t* block) {
+  for (auto node = block->funcs->head; node != nullptr; node = node->next) {
+    if (node->func->conv == TSG_FUNC_CLOSURE) {
+      return true;
+    }
+  }
+
+  for (auto node = block->stmts->head; node != nullptr; node = node->next) {
+    tsg_stmt_t* stmt = node->stmt;
+    switch (stmt->kind) {
+      case TSG_STMT_VAL:
+        if (expr_defines_closures(stmt->val.expr)) {
+          return true;
+        }
+        break;
+
+      case TSG_STMT_EXPR:
+        if (expr_defines_closures(stmt->expr.expr)) {
+          return true;
+        }
+        break;
+    }
+  }
+
+  return false;
+}
+
+static bool expr_defines_closures(tsg_expr_t* expr) {
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      return expr_defines_closures(expr->binary.lhs) ||
+             expr_defines_closures(expr->binary.rhs);
+
+    case TSG_EXPR_CALL:
+      if (expr_defines_closures(expr->call.callee)) {
+        return true;
+      }
+      for (auto node = expr->call.args->head; node; node = node->next) {
+        if (expr_defines_closures(node->expr)) {
+          return true;
+        }
+      }
+      return false;
+
+    case TSG_EXPR_IFELSE:
+      return expr_defines_closures(expr->ifelse.cond) ||
+             block_defines_closures(expr->ifelse.thn) ||
+             block_defines_closures(expr->ifelse.els);
+
+    case TSG_EXPR_IDENT:
+    case TSG_EXPR_NUMBER:
+      return false;
+  }
+
+  return false;
+}
+
+Lowering::Lowering(MirModule& target, bool follow_calls, Evaluator* folder,
+                   PgoProfile* pgo_profile, bool instrument)
+    : module(target),
+      whole_program(follow_calls),
+      evaluator(folder),
+      profile(pgo_profile),
+      instrumenting(instrument),
+      tyenv(nullptr),
+      current(nullptr),
+      current_name(),
+      insert_block(nullptr),
+      outer(nullptr),
+      values() {}
+
+Lowering::~Lowering() {}
+
+MirFunc* Lowering::lowerFunc(tsg_func_t* func, tsg_tyenv_t* env) {
+  assert(func->tyset == env->tyset);
+
+  auto mir_func = module.create(func, env);
+
+  auto stashed_env = this->tyenv;
+  auto stashed_current = this->current;
+  auto stashed_name = this->current_name;
+  auto stashed_insert_block = this->insert_block;
+  auto stashed_outer = this->outer;
+  std::unordered_map<tsg_member_t*, MirInst*> stashed_values;
+  stashed_values.swap(this->values);
+  this->tyenv = env;
+  this->current = mir_func;
+  this->current_name = Compiler::describeInstance(func, env);
+  this->insert_block = mir_func->createBlock("entry");
+  this->outer = nullptr;
+  mir_func->setEntrySite(findSite(nullptr));
+
+  if (func->conv == TSG_FUNC_CLOSURE) {
+    this->outer = mir_func->createParam(MIR_PTR, "$outer");
+  }
+
+  auto type = tsg_tyenv_get(env, func->ftype);
+  auto param_type = type->func.params->elem;
+  for (auto node = func->params->head; node != nullptr; node = node->next) {
+    auto param = mir_func->createParam(convTy(*(param_type++)),
+                                       tsg_ident_cstr(node->decl->name));
+    this->values[node->decl->object] = param;
+  }
+
+  for (int32_t i = 0; i < func->n_captures; i++) {
+    auto capture = func->captures[i];
+    this->values[capture] = mir_func->createParam(
+        convTy(tsg_tyenv_get(env, capture->tyvar)), "$captured");
+  }
+
+  // Only nested closures reach a frame, through their `$outer`, and they
+  // find only captured members in it. Without any, the frame is left out.
+  if (block_defines_closures(func->body)) {
+    auto frame = emit(MIR_FRAME, MIR_PTR);
+    frame->frame = func->frame;
+    frame->env = env;
+    frame->name = "$sf";
+    mir_func->setFrame(frame);
+
+    // the closures of a function without `$outer` never look past its frame
+    auto outer_frame = outer != nullptr ? outer : emit(MIR_NULL, MIR_PTR);
+    auto slot = emit(MIR_STORE, MIR_VOID);
+    slot->operands.push_back(frame);
+    slot->operands.push_back(outer_frame);
+    slot->frame = func->frame;
+    slot->env = env;
+    slot->index = 0;
+
+    for (auto node = func->params->head; node != nullptr; node = node->next) {
+      store(node->decl->object, this->values[node->decl->object]);
+    }
+  }
+
+  // the body returns on every path, from its tail positions
+  lowerBlock(func->body, true);
+
+  this->values.swap(stashed_values);
+  this->outer = stashed_outer;
+  this->insert_block = stashed_insert_block;
+  this->current = stashed_current;
+  this->current_name = stashed_name;
+  this->tyenv = stashed_env;
+
+  return mir_func;
+}
+
+MirInst* Lowering::emit(MirOpcode opcode, MirType type) {
+  auto inst = current->createInst(opcode, type);
+  inst->parent = insert_block;
+  insert_block->insts.push_back(inst);
+  return inst;
+}
+
+MirInst* Lowering::emitConst(MirType type, int32_t imm) {
+  auto inst = emit(MIR_CONST, type);
+  inst->imm = imm;
+  return inst;
+}
+
+MirType Lowering::convTy(tsg_type_t* type) {
+  switch (type->kind) {
+    case TSG_TYPE_BOOL:
+      return MIR_BOOL;
+
+    case TSG_TYPE_INT:
+      return MIR_INT;
+
+    case TSG_TYPE_FUNC:
+    case TSG_TYPE_POLY:
+      return MIR_PTR;
+
+    case TSG_TYPE_PEND:
+      assert(false);
+      return MIR_VOID;
+  }
+
+  assert(false);
+  return MIR_VOID;
+}
+
+PgoSite* Lowering::findSite(const tsg_source_range_t* loc) {
+  if (profile == nullptr) {
+    return nullptr;
+  }
+  if (instrumenting) {
+    return profile->getSite(current_name, loc);
+  }
+  return profile->findSite(current_name, loc);
+}
+
+void Lowering::store(tsg_member_t* member, MirInst* value) {
+  values[member] = value;
+
+  auto frame = current->getFrame();
+  if (member->captured && frame != nullptr) {
+    auto inst = emit(MIR_STORE, MIR_VOID);
+    inst->operands.push_back(frame);
+    inst->operands.push_back(value);
+    inst->frame = frame->frame;
+    inst->env = tyenv;
+    inst->index = member->index + 1;
+  }
+}
+
+MirInst* Lowering::load(tsg_member_t* member) {
+  // our own members, and the captures of a lifted function
+  auto found = values.find(member);
+  if (found != values.end()) {
+    return found->second;
+  }
+
+  // no frame of our own; start from the outer one
+  auto base = current->getFrame();
+  auto frame = current->getFunc()->frame;
+  if (base == nullptr) {
+    assert(outer != nullptr);
+    base = outer;
+    frame = frame->outer;
+  }
+  assert(0 <= member->depth && member->depth <= frame->depth);
+
+  auto inst = emit(MIR_LOAD, convTy(tsg_tyenv_get(tyenv, member->tyvar)));
+  inst->operands.push_back(base);
+  inst->frame = frame;
+  inst->env = tyenv;
+  inst->hops = frame->depth - member->depth;
+  inst->index = member->index + 1;
+  return inst;
+}
+
+void Lowering::lowerReturn(MirInst* value) {
+  auto ret = emit(MIR_RET, MIR_VOID);
+  if (value != nullptr) {
+    ret->operands.push_back(value);
+  }
+}
+
+MirInst* Lowering::lowerBlock(tsg_block_t* block, bool tail) {
+  lowerFuncList(block->funcs);
+  return lowerStmtList(block->stmts, tail);
+}
+
+void Lowering::lowerFuncList(tsg_func_list_t* funcs) {
+  auto node = funcs->head;
+  while (node != nullptr) {
+    // the others are called without a frame; see lowerExprIdent
+    if (node->func->conv == TSG_FUNC_CLOSURE) {
+      auto closure = emit(MIR_CLOSURE, MIR_PTR);
+      closure->operands.push_back(current->getFrame());
+      store(node->func->decl->object, closure);
+    }
+    node = node->next;
+  }
+}
+
+MirInst* Lowering::lowerStmtList(tsg_stmt_list_t* stmts, bool tail) {
+  MirInst* last_value = nullptr;
+
+  auto node = stmts->head;
+  while (node != nullptr) {
+    tsg_stmt_t* stmt = node->stmt;
+    if (tail && node->next == nullptr && stmt->kind == TSG_STMT_EXPR) {
+      lowerTailExpr(stmt->expr.expr);
+      return nullptr;
+    }
+
+    last_value = lowerStmt(stmt);
+    node = node->next;
+  }
+
+  if (tail) {
+    lowerReturn(last_value);
+  }
+
+  return last_value;
+}
+
+MirInst* Lowering::lowerStmt(tsg_stmt_t* stmt) {
+  switch (stmt->kind) {
+    case TSG_STMT_VAL:
+      return lowerStmtVal(stmt);
+
+    case TSG_STMT_EXPR:
+      return lowerStmtExpr(stmt);
+  }
+
+  assert(false);
+  return nullptr;
+}
+
+MirInst* Lowering::lowerStmtVal(tsg_stmt_t* stmt) {
+  assert(stmt != nullptr && stmt->kind == TSG_STMT_VAL);
+
+  MirInst* value = lowerExpr(stmt->val.expr);
+  store(stmt->val.decl->object, value);
+
+  return value;
+}
+
+MirInst* Lowering::lowerStmtExpr(tsg_stmt_t* stmt) {
+  assert(stmt != nullptr && stmt->kind == TSG_STMT_EXPR);
+  return lowerExpr(stmt->expr.expr);
+}
+
+MirInst* Lowering::lowerExpr(tsg_expr_t* expr) {
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      return lowerExprBinary(expr);
+
+    case TSG_EXPR_CALL:
+      return lowerExprCall(expr, false);
+
+    case TSG_EXPR_IFELSE:
+      return lowerExprIfelse(expr, false);
+
+    case TSG_EXPR_IDENT:
+      return lowerExprIdent(expr);
+
+    case TSG_EXPR_NUMBER:
+      return lowerExprNumber(expr);
+  }
+
+  assert(false);
+  return nullptr;
+}
+
+void Lowering::lowerTailExpr(tsg_expr_t* expr) {
+  // Calls and conditionals in tail position return by themselves.
+  switch (expr->kind) {
+    case TSG_EXPR_CALL:
+      lowerExprCall(expr, true);
+      return;
+
+    case TSG_EXPR_IFELSE:
+      lowerExprIfelse(expr, true);
+      return;
+
+    case TSG_EXPR_BINARY:
+    case TSG_EXPR_IDENT:
+    case TSG_EXPR_NUMBER:
+      lowerReturn(lowerExpr(expr));
+      return;
+  }
+
+  assert(false);
+}
+
+MirInst* Lowering::lowerExprBinary(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_BINARY);
+
+  MirInst* lhs = lowerExpr(expr->binary.lhs);
+  MirInst* rhs = lowerExpr(expr->binary.rhs);
+
+  MirType type = MIR_INT;
+  switch (expr->binary.op) {
+    case TSG_TOKEN_EQ:
+    case TSG_TOKEN_LT:
+    case TSG_TOKEN_GT:
+      type = MIR_BOOL;
+      break;
+
+    default:
+      break;
+  }
+
+  int32_t folded;
+  if (evaluator != nullptr && lhs->opcode == MIR_CONST &&
+      rhs->opcode == MIR_CONST &&
+      Evaluator::evalBinary(expr->binary.op, lhs->imm, rhs->imm, &folded)) {
+    return emitConst(type, folded);
+  }
+
+  auto inst = emit(MIR_BINARY, type);
+  inst->operands.push_back(lhs);
+  inst->operands.push_back(rhs);
+  inst->op = expr->binary.op;
+  return inst;
+}
+
+MirInst* Lowering::lowerExprCall(tsg_expr_t* expr, bool tail) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_CALL);
+
+  auto callee_obj = lowerExpr(expr->call.callee);
+  tsg_type_t* callee_type = tsg_tyenv_get(tyenv, expr->call.callee->tyvar);
+  assert(callee_type != nullptr && callee_type->kind == TSG_TYPE_POLY);
+  tsg_func_t* callee = callee_type->poly.func;
+
+  std::vector<MirInst*> args;
+  if (callee->conv == TSG_FUNC_CLOSURE) {
+    args.push_back(callee_obj);
+  }
+
+  auto node = expr->call.args->head;
+  while (node) {
+    args.push_back(lowerExpr(node->expr));
+    node = node->next;
+  }
+
+  for (int32_t i = 0; i < callee->n_captures; i++) {
+    args.push_back(load(callee->captures[i]));
+  }
+
+  tsg_type_t* func_type = tsg_tyenv_get(tyenv, expr->call.ftype);
+  assert(func_type != nullptr && func_type->kind == TSG_TYPE_FUNC);
+  tsg_tyenv_t* callee_env = func_type->func.env;
+
+  auto ret_type = convTy(func_type->func.ret);
+  int32_t folded;
+  if (evaluator != nullptr && callee_env->pure &&
+      std::all_of(args.begin(), args.end(),
+                  [](MirInst* arg) { return arg->opcode == MIR_CONST; })) {
+    std::vector<int32_t> consts;
+    for (auto arg : args) {
+      consts.push_back(arg->imm);
+    }
+
+    if (evaluator->evaluate(callee, callee_env, consts, &folded)) {
+      auto value = emitConst(ret_type, folded);
+      if (tail == false) {
+        return value;
+      }
+      lowerReturn(value);
+      return nullptr;
+    }
+  }
+
+  if (whole_program && module.get(callee_env) == nullptr) {
+    lowerFunc(callee, callee_env);
+  }
+
+  auto call = emit(MIR_CALL, ret_type);
+  call->operands.swap(args);
+  call->func = callee;
+  call->env = callee_env;
+  call->tail = tail;
+  call->site = findSite(&(expr->loc));
+  if (tail == false) {
+    return call;
+  }
+
+  lowerReturn(call);
+  return nullptr;
+}
+
+MirInst* Lowering::lowerExprIfelse(tsg_expr_t* expr, bool tail) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_IFELSE);
+
+  auto then_block = current->createBlock("then");
+  auto else_block = current->createBlock("else");
+
+  MirInst* cond = lowerExpr(expr->ifelse.cond);
+  auto br = emit(MIR_BR, MIR_VOID);
+  br->operands.push_back(cond);
+  br->targets.push_back(then_block);
+  br->targets.push_back(else_block);
+  br->site = findSite(&(expr->loc));
+
+  if (tail) {
+    // each arm returns on its own, so there is nothing to merge
+    insert_block = then_block;
+    lowerBlock(expr->ifelse.thn, true);
+
+    insert_block = else_block;
+    lowerBlock(expr->ifelse.els, true);
+
+    return nullptr;
+  }
+
+  auto merge_block = current->createBlock("merge");
+
+  insert_block = then_block;
+  MirInst* then_value = lowerBlock(expr->ifelse.thn, false);
+  emit(MIR_JUMP, MIR_VOID)->targets.push_back(merge_block);
+  then_block = insert_block;
+
+  insert_block = else_block;
+  MirInst* else_value = lowerBlock(expr->ifelse.els, false);
+  emit(MIR_JUMP, MIR_VOID)->targets.push_back(merge_block);
+  else_block = insert_block;
+
+  insert_block = merge_block;
+  auto phi = emit(MIR_PHI, then_value->type);
+  phi->operands.push_back(then_value);
+  phi->targets.push_back(then_block);
+  phi->operands.push_back(else_value);
+  phi->targets.push_back(else_block);
+
+  return phi;
+}
+
+MirInst* Lowering::lowerExprIdent(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_IDENT);
+
+  // A function that needs no frame is known from its type alone.
+  tsg_func_t* func = expr->ident.object->func;
+  if (func != nullptr && func->conv != TSG_FUNC_CLOSURE) {
+    return emit(MIR_NULL, MIR_PTR);
+  }
+
+  return load(expr->ident.object);
+}
+
+MirInst* Lowering::lowerExprNumber(tsg_expr_t* expr) {
+  assert(expr != nullptr && expr->kind == TSG_EXPR_NUMBER);
+
+  return emitConst(MIR_INT, expr->number.value);
+}
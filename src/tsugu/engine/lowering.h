@@ -0,0 +1,89 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file lowering.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_LOWERING_H
+#define TSUGU_ENGINE_LOWERING_H
+
+#include "evaluator.h"
+#include "mir.h"
+#include "pgo_profile.h"
+#include <tsugu/core/ast.h>
+#include <tsugu/core/tyenv.h>
+#include <string>
+#include <unordered_map>
+
+namespace tsugu {
+
+/**
+ * Lowers instances of the verified AST into a MirModule.
+ *
+ * Members are bound exactly once, so within its own function a member is
+ * simply the instruction that computed it. Only the members some nested
+ * closure reads are also stored into the frame, and only functions that
+ * define such closures get one; everything else reaches outer members
+ * through LOADs from `$outer`.
+ *
+ * With `follow_calls`, every instance a lowered one calls is lowered too,
+ * in the order they are first called; otherwise calls merely name them.
+ *
+ * Given an Evaluator, operators and calls of pure instances whose
+ * operands are all constants are folded, and a folded callee is not
+ * lowered for that call.
+ *
+ * Given a PgoProfile, the entry of each instance and its ifs and calls
+ * get their sites in it. With `instrument` the sites are created, to be
+ * counted into; otherwise only sites that some run has counted are used.
+ */
+class Lowering {
+ public:
+  Lowering(MirModule& target, bool follow_calls, Evaluator* folder,
+           PgoProfile* pgo_profile, bool instrument);
+  virtual ~Lowering();
+
+  MirFunc* lowerFunc(tsg_func_t* func, tsg_tyenv_t* env);
+
+ private:
+  MirModule& module;
+  bool whole_program;
+  Evaluator* evaluator;
+  PgoProfile* profile;
+  bool instrumenting;
+
+  tsg_tyenv_t* tyenv;
+  MirFunc* current;
+  std::string current_name;
+  MirBlock* insert_block;
+  MirInst* outer;
+  std::unordered_map<tsg_member_t*, MirInst*> values;
+
+  MirInst* emit(MirOpcode opcode, MirType type);
+  MirInst* emitConst(MirType type, int32_t imm);
+  MirType convTy(tsg_type_t* type);
+  PgoSite* findSite(const tsg_source_range_t* loc);
+
+  void store(tsg_member_t* member, MirInst* value);
+  MirInst* load(tsg_member_t* member);
+
+  void lowerReturn(MirInst* value);
+  MirInst* lowerBlock(tsg_block_t* block, bool tail);
+  void lowerFuncList(tsg_func_list_t* funcs);
+  MirInst* lowerStmtList(tsg_stmt_list_t* stmts, bool tail);
+  MirInst* lowerStmt(tsg_stmt_t* stmt);
+  MirInst* lowerStmtVal(tsg_stmt_t* stmt);
+  MirInst* lowerStmtExpr(tsg_stmt_t* stmt);
+
+  MirInst* lowerExpr(tsg_expr_t* expr);
+  void lowerTailExpr(tsg_expr_t* expr);
+  MirInst* lowerExprBinary(tsg_expr_t* expr);
+  MirInst* lowerExprCall(tsg_expr_t* expr, bool tail);
+  MirInst* lowerExprIfelse(tsg_expr_t* expr, bool tail);
+  MirInst* lowerExprIdent(tsg_expr_t* expr);
+  MirInst* lowerExprNumber(tsg_expr_t* expr);
+};
+
+}  // namespace tsugu
+
+#endif
@@ -0,0 +1,228 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file memo_table.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "memo_table.h"
+
+#include "disk_cache.h"
+
+using namespace tsugu;
+
+// slots a key may be found in, from its home slot on
+static const uint32_t MEMO_PROBES = 4;
+// Fibonacci hashing; the top bits of the product pick the home slot
+static const uint32_t MEMO_HASH_MULTIPLIER = 0x9E3779B1;
+
+static uint32_t log2_floor(uint32_t n) {
+  uint32_t bits = 0;
+  while (n > 1) {
+    n >>= 1;
+    bits += 1;
+  }
+  return bits;
+}
+
+MemoTable::MemoTable(llvm::IRBuilder<>& ir_builder, llvm::Function* instance,
+                     int32_t n_slots, MemoCounters* memo_counters)
+    : builder(ir_builder),
+      func(instance),
+      slots(roundSlots(n_slots)),
+      counters(memo_counters),
+      stride(static_cast<uint32_t>(instance->arg_size()) + 2),
+      table(nullptr),
+      home(nullptr),
+      result(nullptr) {}
+
+MemoTable::~MemoTable() {}
+
+uint32_t MemoTable::roundSlots(int32_t n_slots) {
+  uint32_t n = n_slots > 0 ? static_cast<uint32_t>(n_slots) : 0;
+  if (n < MEMO_PROBES) {
+    return MEMO_PROBES;
+  }
+  return static_cast<uint32_t>(1) << log2_floor(n);
+}
+
+void MemoTable::buildLookup(llvm::BasicBlock* body) {
+  auto& context = builder.getContext();
+  auto module = func->getParent();
+
+  auto table_type = llvm::ArrayType::get(builder.getInt32Ty(), slots * stride);
+  table = new llvm::GlobalVariable(
+      *module, table_type, false, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(table_type), func->getName() + ".memo");
+
+  auto entry_block = builder.GetInsertBlock();
+  auto probe_block =
+      llvm::BasicBlock::Create(context, "memo.probe", func, body);
+  auto check_block =
+      llvm::BasicBlock::Create(context, "memo.check", func, body);
+  auto next_block =
+      llvm::BasicBlock::Create(context, "memo.next", func, body);
+  auto hit_block =
+      llvm::BasicBlock::Create(context, "memo.hit", func, body);
+  auto miss_block =
+      llvm::BasicBlock::Create(context, "memo.miss", func, body);
+  auto store_block = llvm::BasicBlock::Create(context, "memo.store", func);
+
+  llvm::Value* hash = builder.getInt32(0);
+  for (auto& arg : func->args()) {
+    hash = builder.CreateMul(builder.CreateXor(hash, createKey(&arg)),
+                             builder.getInt32(MEMO_HASH_MULTIPLIER));
+  }
+  home = builder.CreateLShr(hash, 32 - log2_floor(slots), "memo.home");
+  builder.CreateBr(probe_block);
+
+  builder.SetInsertPoint(probe_block);
+  auto probe = builder.CreatePHI(builder.getInt32Ty(), 2, "memo.i");
+  probe->addIncoming(builder.getInt32(0), entry_block);
+  auto slot = builder.CreateAnd(builder.CreateAdd(home, probe),
+                                builder.getInt32(slots - 1));
+  auto seq_ptr = createSlotPtr(slot, 0);
+  auto seq = builder.CreateAlignedLoad(seq_ptr, 4, "memo.seq");
+  seq->setAtomic(llvm::AtomicOrdering::Acquire);
+  builder.CreateCondBr(builder.CreateICmpEQ(seq, builder.getInt32(0)),
+                       miss_block, check_block);
+
+  builder.SetInsertPoint(check_block);
+  llvm::Value* match = builder.CreateICmpEQ(
+      builder.CreateAnd(seq, builder.getInt32(1)), builder.getInt32(0));
+  uint32_t field = 1;
+  for (auto& arg : func->args()) {
+    auto key = builder.CreateAlignedLoad(createSlotPtr(slot, field), 4);
+    key->setAtomic(llvm::AtomicOrdering::Monotonic);
+    match = builder.CreateAnd(match,
+                              builder.CreateICmpEQ(key, createKey(&arg)));
+    field += 1;
+  }
+  auto value = builder.CreateAlignedLoad(createSlotPtr(slot, field), 4);
+  value->setAtomic(llvm::AtomicOrdering::Monotonic);
+  builder.CreateFence(llvm::AtomicOrdering::Acquire);
+  auto seq_again = builder.CreateAlignedLoad(seq_ptr, 4);
+  seq_again->setAtomic(llvm::AtomicOrdering::Monotonic);
+  match = builder.CreateAnd(match, builder.CreateICmpEQ(seq, seq_again));
+  builder.CreateCondBr(match, hit_block, next_block);
+
+  builder.SetInsertPoint(next_block);
+  auto next_probe = builder.CreateAdd(probe, builder.getInt32(1));
+  probe->addIncoming(next_probe, next_block);
+  builder.CreateCondBr(
+      builder.CreateICmpULT(next_probe, builder.getInt32(MEMO_PROBES)),
+      probe_block, miss_block);
+
+  builder.SetInsertPoint(hit_block);
+  if (counters != nullptr) {
+    buildCount(&(counters->hits));
+  }
+  builder.CreateRet(builder.CreateTrunc(value, func->getReturnType()));
+
+  builder.SetInsertPoint(miss_block);
+  if (counters != nullptr) {
+    buildCount(&(counters->misses));
+  }
+  builder.CreateBr(body);
+
+  buildStore(store_block);
+}
+
+void MemoTable::buildReturn(llvm::Value* value) {
+  result->addIncoming(value, builder.GetInsertBlock());
+  builder.CreateBr(result->getParent());
+}
+
+llvm::Value* MemoTable::createKey(llvm::Value* value) {
+  // bools are kept as 0 or 1
+  return builder.CreateZExt(value, builder.getInt32Ty());
+}
+
+llvm::Value* MemoTable::createSlotPtr(llvm::Value* slot, uint32_t field) {
+  auto index =
+      builder.CreateAdd(builder.CreateMul(slot, builder.getInt32(stride)),
+                        builder.getInt32(field));
+
+  std::vector<llvm::Value*> elem_idx;
+  elem_idx.push_back(builder.getInt32(0));
+  elem_idx.push_back(index);
+  return builder.CreateGEP(table, elem_idx);
+}
+
+void MemoTable::buildCount(std::atomic<uint64_t>* counter) {
+  // such code is only valid in this process; keep it out of the disk cache
+  func->getParent()->getOrInsertNamedMetadata(DiskCache::HOST_ADDRESSES);
+
+  auto address = builder.getInt64(reinterpret_cast<uintptr_t>(counter));
+  auto counter_ptr =
+      builder.CreateIntToPtr(address, builder.getInt64Ty()->getPointerTo());
+  builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter_ptr,
+                          builder.getInt64(1),
+                          llvm::AtomicOrdering::Monotonic);
+}
+
+void MemoTable::buildStore(llvm::BasicBlock* store_block) {
+  auto& context = builder.getContext();
+  auto find_block = llvm::BasicBlock::Create(context, "memo.find", func);
+  auto skip_block = llvm::BasicBlock::Create(context, "memo.skip", func);
+  auto lock_block = llvm::BasicBlock::Create(context, "memo.lock", func);
+  auto cmpxchg_block =
+      llvm::BasicBlock::Create(context, "memo.cmpxchg", func);
+  auto write_block = llvm::BasicBlock::Create(context, "memo.write", func);
+  auto done_block = llvm::BasicBlock::Create(context, "memo.done", func);
+
+  builder.SetInsertPoint(store_block);
+  result = builder.CreatePHI(func->getReturnType(), 2, "memo.result");
+  builder.CreateBr(find_block);
+
+  // the first empty slot of the window, or else the last one
+  builder.SetInsertPoint(find_block);
+  auto probe = builder.CreatePHI(builder.getInt32Ty(), 2, "memo.j");
+  probe->addIncoming(builder.getInt32(0), store_block);
+  auto slot = builder.CreateAnd(builder.CreateAdd(home, probe),
+                                builder.getInt32(slots - 1));
+  auto seq_ptr = createSlotPtr(slot, 0);
+  auto seq = builder.CreateAlignedLoad(seq_ptr, 4, "memo.seq");
+  seq->setAtomic(llvm::AtomicOrdering::Monotonic);
+  auto take = builder.CreateOr(
+      builder.CreateICmpEQ(seq, builder.getInt32(0)),
+      builder.CreateICmpEQ(probe, builder.getInt32(MEMO_PROBES - 1)));
+  builder.CreateCondBr(take, lock_block, skip_block);
+
+  builder.SetInsertPoint(skip_block);
+  probe->addIncoming(builder.CreateAdd(probe, builder.getInt32(1)),
+                     skip_block);
+  builder.CreateBr(find_block);
+
+  // Taking the slot makes its number odd. If another writer holds it, or
+  // gets it first, this result is simply not kept.
+  builder.SetInsertPoint(lock_block);
+  auto is_free = builder.CreateICmpEQ(
+      builder.CreateAnd(seq, builder.getInt32(1)), builder.getInt32(0));
+  builder.CreateCondBr(is_free, cmpxchg_block, done_block);
+
+  builder.SetInsertPoint(cmpxchg_block);
+  auto locked = builder.CreateAtomicCmpXchg(
+      seq_ptr, seq, builder.CreateAdd(seq, builder.getInt32(1)),
+      llvm::AtomicOrdering::Acquire, llvm::AtomicOrdering::Monotonic);
+  builder.CreateCondBr(builder.CreateExtractValue(locked, 1), write_block,
+                       done_block);
+
+  builder.SetInsertPoint(write_block);
+  uint32_t field = 1;
+  for (auto& arg : func->args()) {
+    auto store = builder.CreateAlignedStore(createKey(&arg),
+                                            createSlotPtr(slot, field), 4);
+    store->setAtomic(llvm::AtomicOrdering::Monotonic);
+    field += 1;
+  }
+  auto value_store = builder.CreateAlignedStore(
+      createKey(result), createSlotPtr(slot, field), 4);
+  value_store->setAtomic(llvm::AtomicOrdering::Monotonic);
+  auto seq_store = builder.CreateAlignedStore(
+      builder.CreateAdd(seq, builder.getInt32(2)), seq_ptr, 4);
+  seq_store->setAtomic(llvm::AtomicOrdering::Release);
+  builder.CreateBr(done_block);
+
+  builder.SetInsertPoint(done_block);
+  builder.CreateRet(result);
+}
@@ -0,0 +1,73 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file memo_table.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_MEMO_TABLE_H
+#define TSUGU_ENGINE_MEMO_TABLE_H
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <atomic>
+#include <cstdint>
+
+namespace tsugu {
+
+/**
+ * Hits and misses of the memo tables of a program, counted by the compiled
+ * code itself when the engine asks for them.
+ */
+struct MemoCounters {
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+};
+
+/**
+ * Builds the memo table of one memoized instance into its function.
+ *
+ * The table is an internal global of the module, so modules that have one
+ * can still be cached. Each slot holds a sequence number, the arguments as
+ * i32s and the result. The number is 0 while the slot is empty and odd
+ * while a writer fills it; readers take an entry only if the number was
+ * even and unchanged around their reads, so threads running the same
+ * program never see torn entries.
+ *
+ * Keys are looked up in a window of a few slots from their home slot, and
+ * the lookup stops at an empty one. A result goes to the first empty slot
+ * of its window or, when there is none, evicts the entry in the last one.
+ */
+class MemoTable {
+ public:
+  MemoTable(llvm::IRBuilder<>& ir_builder, llvm::Function* instance,
+            int32_t n_slots, MemoCounters* counters);
+  virtual ~MemoTable();
+
+  // at the insert point, which must be the first block; misses go to `body`
+  void buildLookup(llvm::BasicBlock* body);
+  // leaves through the block that stores `value` into the table
+  void buildReturn(llvm::Value* value);
+
+  // the largest power of two not above `n_slots`, at least one window
+  static uint32_t roundSlots(int32_t n_slots);
+
+ private:
+  llvm::IRBuilder<>& builder;
+  llvm::Function* func;
+  uint32_t slots;
+  MemoCounters* counters;
+  uint32_t stride;
+
+  llvm::GlobalVariable* table;
+  llvm::Value* home;
+  llvm::PHINode* result;
+
+  llvm::Value* createKey(llvm::Value* value);
+  llvm::Value* createSlotPtr(llvm::Value* slot, uint32_t field);
+  void buildCount(std::atomic<uint64_t>* counter);
+  void buildStore(llvm::BasicBlock* store_block);
+};
+
+}  // namespace tsugu
+
+#endif
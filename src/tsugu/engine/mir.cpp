@@ -0,0 +1,151 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file mir.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "mir.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+using namespace tsugu;
+
+MirInst* MirBlock::getTerminator() const {
+  if (insts.empty() || !insts.back()->isTerminator()) {
+    return nullptr;
+  }
+  return insts.back();
+}
+
+MirFunc::MirFunc(tsg_func_t* instance_func, tsg_tyenv_t* instance_env)
+    : func(instance_func),
+      env(instance_env),
+      params(),
+      blocks(),
+      frame(nullptr),
+      memoized(false),
+      entry_site(nullptr),
+      block_pool(),
+      inst_pool() {}
+
+MirFunc::~MirFunc() {}
+
+MirBlock* MirFunc::createBlock(const std::string& name) {
+  block_pool.emplace_back(new MirBlock());
+  auto block = block_pool.back().get();
+  block->name = name;
+  blocks.push_back(block);
+  return block;
+}
+
+MirInst* MirFunc::createInst(MirOpcode opcode, MirType type) {
+  inst_pool.emplace_back(new MirInst());
+  auto inst = inst_pool.back().get();
+  inst->opcode = opcode;
+  inst->type = type;
+  inst->imm = 0;
+  inst->index = 0;
+  inst->hops = 0;
+  inst->op = TSG_TOKEN_EOF;
+  inst->frame = nullptr;
+  inst->func = nullptr;
+  inst->env = nullptr;
+  inst->tail = false;
+  inst->site = nullptr;
+  inst->parent = nullptr;
+  return inst;
+}
+
+MirInst* MirFunc::createParam(MirType type, const std::string& name) {
+  auto param = createInst(MIR_PARAM, type);
+  param->index = static_cast<int32_t>(params.size());
+  param->name = name;
+  params.push_back(param);
+  return param;
+}
+
+static void visit_block(MirBlock* block,
+                        std::unordered_set<MirBlock*>& visited,
+                        std::vector<MirBlock*>& postorder) {
+  visited.insert(block);
+
+  auto term = block->getTerminator();
+  if (term != nullptr) {
+    // later targets first, so that `then` comes before `else` in the end
+    for (auto target = term->targets.rbegin(); target != term->targets.rend();
+         ++target) {
+      if (visited.count(*target) == 0) {
+        visit_block(*target, visited, postorder);
+      }
+    }
+  }
+
+  postorder.push_back(block);
+}
+
+std::vector<MirBlock*> MirFunc::getBlocksInOrder() const {
+  std::unordered_set<MirBlock*> visited;
+  std::vector<MirBlock*> order;
+  visit_block(getEntry(), visited, order);
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+size_t MirFunc::size() const {
+  size_t n = 0;
+  for (auto block : blocks) {
+    n += block->insts.size();
+  }
+  return n;
+}
+
+void MirFunc::replaceAllUses(MirInst* from, MirInst* to) {
+  for (auto block : blocks) {
+    for (auto inst : block->insts) {
+      std::replace(inst->operands.begin(), inst->operands.end(), from, to);
+    }
+  }
+}
+
+void MirFunc::erase(MirInst* inst) {
+  auto& insts = inst->parent->insts;
+  insts.erase(std::find(insts.begin(), insts.end(), inst));
+  inst->parent = nullptr;
+}
+
+MirModule::MirModule() : funcs(), table() {}
+
+MirModule::~MirModule() {}
+
+MirFunc* MirModule::get(tsg_tyenv_t* env) const {
+  size_t id = static_cast<size_t>(env->id);
+  return env->id >= 0 && id < table.size() ? table[id] : nullptr;
+}
+
+MirFunc* MirModule::create(tsg_func_t* func, tsg_tyenv_t* env) {
+  funcs.emplace_back(new MirFunc(func, env));
+  auto mir_func = funcs.back().get();
+  size_t id = static_cast<size_t>(env->id);
+  if (id >= table.size()) {
+    table.resize(id + 1, nullptr);
+  }
+  table[id] = mir_func;
+  return mir_func;
+}
+
+void MirModule::erase(MirFunc* mir_func) {
+  table[mir_func->getEnv()->id] = nullptr;
+  funcs.erase(std::find_if(funcs.begin(), funcs.end(),
+                           [mir_func](const std::unique_ptr<MirFunc>& owned) {
+                             return owned.get() == mir_func;
+                           }));
+}
+
+std::vector<MirFunc*> MirModule::getFuncs() const {
+  std::vector<MirFunc*> result;
+  for (auto& mir_func : funcs) {
+    result.push_back(mir_func.get());
+  }
+  return result;
+}
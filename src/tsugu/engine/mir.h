@@ -0,0 +1,169 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file mir.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_MIR_H
+#define TSUGU_ENGINE_MIR_H
+
+#include "pgo_profile.h"
+#include <tsugu/core/ast.h>
+#include <tsugu/core/tyenv.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace tsugu {
+
+struct MirBlock;
+
+enum MirType {
+  MIR_VOID,
+  MIR_BOOL,
+  MIR_INT,
+  // a function value or a frame
+  MIR_PTR,
+};
+
+enum MirOpcode {
+  // argument `index`: `$outer` if any, the parameters, then the captures
+  MIR_PARAM,
+  // `imm`, an int or a bool
+  MIR_CONST,
+  // a function value that needs no frame
+  MIR_NULL,
+  // `op` applied to the two operands
+  MIR_BINARY,
+  // this call's frame, laid out as `frame`
+  MIR_FRAME,
+  // the frame in operand 0 as a function value
+  MIR_CLOSURE,
+  // operand 1 into slot `index` of the `frame` in operand 0
+  MIR_STORE,
+  // slot `index` of the frame `hops` outer links out of the `frame` in
+  // operand 0
+  MIR_LOAD,
+  // instance `func` in `env`, with the operands as its arguments
+  MIR_CALL,
+  // operand i when entered from `targets[i]`
+  MIR_PHI,
+  // to `targets[0]` if operand 0 holds, else to `targets[1]`
+  MIR_BR,
+  // to `targets[0]`
+  MIR_JUMP,
+  // operand 0, if any
+  MIR_RET,
+};
+
+struct MirInst {
+  MirOpcode opcode;
+  MirType type;
+  std::vector<MirInst*> operands;
+  std::vector<MirBlock*> targets;
+  int32_t imm;
+  int32_t index;
+  int32_t hops;
+  tsg_token_kind_t op;
+  // the frame a FRAME lays out, or the one a STORE or LOAD starts from
+  tsg_frame_t* frame;
+  // the callee of a CALL
+  tsg_func_t* func;
+  // the callee's types for a CALL, the frame's for the others
+  tsg_tyenv_t* env;
+  // a CALL whose value the next instruction returns
+  bool tail;
+  // the profile counts of a BR or a CALL, if it is profiled
+  PgoSite* site;
+  std::string name;
+  MirBlock* parent;
+
+  bool isTerminator() const {
+    return opcode == MIR_BR || opcode == MIR_JUMP || opcode == MIR_RET;
+  }
+};
+
+struct MirBlock {
+  std::string name;
+  std::vector<MirInst*> insts;
+
+  MirInst* getTerminator() const;
+};
+
+/**
+ * The body of one instance, in SSA form: a function in `env`.
+ *
+ * Blocks and instructions are owned by the function and live as long as
+ * it does; passes unlink them from their blocks instead of freeing them.
+ * The first block is the entry, and PHIs come first in their blocks.
+ */
+class MirFunc {
+ public:
+  MirFunc(tsg_func_t* instance_func, tsg_tyenv_t* instance_env);
+  virtual ~MirFunc();
+
+  tsg_func_t* getFunc() const { return func; }
+  tsg_tyenv_t* getEnv() const { return env; }
+  const std::vector<MirInst*>& getParams() const { return params; }
+  const std::vector<MirBlock*>& getBlocks() const { return blocks; }
+  MirBlock* getEntry() const { return blocks.front(); }
+  // the FRAME, if any closure may reach this call's frame
+  MirInst* getFrame() const { return frame; }
+  void setFrame(MirInst* inst) { frame = inst; }
+  // whether calls look the result up in a memo table before the body runs
+  bool isMemoized() const { return memoized; }
+  void setMemoized(bool value) { memoized = value; }
+  // the profile count of calls of this instance, if it is profiled
+  PgoSite* getEntrySite() const { return entry_site; }
+  void setEntrySite(PgoSite* site) { entry_site = site; }
+
+  MirBlock* createBlock(const std::string& name);
+  MirInst* createInst(MirOpcode opcode, MirType type);
+  MirInst* createParam(MirType type, const std::string& name);
+
+  // reachable blocks, each after the blocks that dominate it
+  std::vector<MirBlock*> getBlocksInOrder() const;
+  size_t size() const;
+
+  void replaceAllUses(MirInst* from, MirInst* to);
+  void erase(MirInst* inst);
+
+ private:
+  tsg_func_t* func;
+  tsg_tyenv_t* env;
+  std::vector<MirInst*> params;
+  std::vector<MirBlock*> blocks;
+  MirInst* frame;
+  bool memoized;
+  PgoSite* entry_site;
+
+  std::vector<std::unique_ptr<MirBlock>> block_pool;
+  std::vector<std::unique_ptr<MirInst>> inst_pool;
+};
+
+/**
+ * The instances lowered for one LLVM module. The first one created is the
+ * root, the one the module is built for; the others are those it calls,
+ * if the whole program is lowered at once. They are found by the id of
+ * their env.
+ */
+class MirModule {
+ public:
+  MirModule();
+  virtual ~MirModule();
+
+  MirFunc* get(tsg_tyenv_t* env) const;
+  MirFunc* create(tsg_func_t* func, tsg_tyenv_t* env);
+  void erase(MirFunc* mir_func);
+
+  MirFunc* getRoot() const { return funcs.front().get(); }
+  std::vector<MirFunc*> getFuncs() const;
+
+ private:
+  std::vector<std::unique_ptr<MirFunc>> funcs;
+  std::vector<MirFunc*> table;
+};
+
+}  // namespace tsugu
+
+#endif
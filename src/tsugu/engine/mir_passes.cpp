@@ -0,0 +1,715 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file mir_passes.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "mir_passes.h"
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace tsugu;
+
+// callers stop inlining once they have grown this large
+static const size_t MAX_CALLER_SIZE = 1024;
+// inlining exposes new known callees, such as the closures passed to the
+// inlined function; a few rounds are enough to reach them
+static const int32_t MAX_INLINE_ROUNDS = 3;
+// profiled calls made at least this often inline callees this many times
+// larger than the threshold
+static const uint64_t HOT_CALL_COUNT = 1000;
+static const size_t HOT_CALL_SCALE = 4;
+
+typedef std::unordered_map<MirBlock*, MirBlock*> idom_map_t;
+
+static size_t inline_threshold(int32_t level) {
+  // 16 instructions at -O1, 32 at -O2 and 64 at -O3
+  return static_cast<size_t>(8) << level;
+}
+
+// the LLVM type the Compiler gives a value of `type`
+static void describe_lowered(std::string* out, tsg_type_t* type) {
+  switch (type->kind) {
+    case TSG_TYPE_BOOL:
+      *out += "i1";
+      break;
+
+    case TSG_TYPE_INT:
+      *out += "i32";
+      break;
+
+    case TSG_TYPE_FUNC:
+      *out += "(i8*";
+      for (size_t i = 0; i < type->func.params->size; i++) {
+        *out += ", ";
+        describe_lowered(out, type->func.params->elem[i]);
+      }
+      *out += ") -> ";
+      describe_lowered(out, type->func.ret);
+      break;
+
+    case TSG_TYPE_POLY:
+      *out += "i8*";
+      break;
+
+    case TSG_TYPE_PEND:
+      *out += "?";
+      break;
+  }
+}
+
+// the slot types of `frame` and those it is nested in, as laid out in `env`
+static void describe_frame(std::string* out, tsg_frame_t* frame,
+                           tsg_tyenv_t* env) {
+  for (; frame != nullptr; frame = frame->outer) {
+    *out += "{";
+    for (auto node = frame->head; node != nullptr; node = node->next) {
+      describe_lowered(out, tsg_tyenv_get(env, node->member->tyvar));
+      *out += ",";
+    }
+    *out += "}";
+  }
+}
+
+static MirInst* strip_closure(MirInst* inst) {
+  return inst->opcode == MIR_CLOSURE ? inst->operands[0] : inst;
+}
+
+static void compute_dominators(MirFunc* mir_func, idom_map_t& idom) {
+  auto order = mir_func->getBlocksInOrder();
+
+  std::unordered_map<MirBlock*, size_t> number;
+  std::unordered_map<MirBlock*, std::vector<MirBlock*>> preds;
+  for (size_t i = 0; i < order.size(); i++) {
+    number[order[i]] = i;
+    for (auto target : order[i]->getTerminator()->targets) {
+      preds[target].push_back(order[i]);
+    }
+  }
+
+  // Cooper, Harvey and Kennedy's iteration over reverse postorder
+  idom[order[0]] = order[0];
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); i++) {
+      MirBlock* new_idom = nullptr;
+      for (auto pred : preds[order[i]]) {
+        auto found = idom.find(pred);
+        if (found == idom.end() || found->second == nullptr) {
+          continue;
+        }
+        if (new_idom == nullptr) {
+          new_idom = pred;
+          continue;
+        }
+
+        auto a = pred;
+        auto b = new_idom;
+        while (a != b) {
+          while (number[a] > number[b]) {
+            a = idom[a];
+          }
+          while (number[b] > number[a]) {
+            b = idom[b];
+          }
+        }
+        new_idom = a;
+      }
+
+      if (idom[order[i]] != new_idom) {
+        idom[order[i]] = new_idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+static bool dominates(const idom_map_t& idom, MirInst* a, MirInst* b) {
+  if (a->parent == b->parent) {
+    auto& insts = a->parent->insts;
+    return std::find(insts.begin(), insts.end(), a) <
+           std::find(insts.begin(), insts.end(), b);
+  }
+
+  auto block = b->parent;
+  while (block != a->parent) {
+    auto found = idom.find(block);
+    if (found == idom.end() || found->second == block) {
+      return false;
+    }
+    block = found->second;
+  }
+
+  return true;
+}
+
+MirPassManager::MirPassManager(int32_t opt_level, bool memoize,
+                               bool profiled)
+    : level(opt_level < 0 ? 0 : (opt_level > 3 ? 3 : opt_level)),
+      memoizing(memoize),
+      using_profile(profiled) {}
+
+MirPassManager::~MirPassManager() {}
+
+void MirPassManager::run(MirModule& module, bool whole_program) {
+  if (level > 0) {
+    // Callees come before their callers, so that they are inlined as they
+    // end up after their own inlining, frames dropped where they can be.
+    auto funcs = module.getFuncs();
+    for (int32_t round = 0; round < MAX_INLINE_ROUNDS; round++) {
+      bool changed = false;
+      for (auto func = funcs.rbegin(); func != funcs.rend(); ++func) {
+        if (inlineCalls(module, *func)) {
+          eliminateFrame(*func);
+          changed = true;
+        }
+      }
+      if (changed == false) {
+        break;
+      }
+    }
+
+    for (auto mir_func : funcs) {
+      eliminateFrame(mir_func);
+    }
+
+    if (whole_program) {
+      removeDeadFuncs(module);
+    }
+  }
+
+  for (auto mir_func : module.getFuncs()) {
+    eliminateTailRecursion(mir_func);
+  }
+
+  if (level > 0 && whole_program) {
+    mergeIdenticalFuncs(module);
+  }
+
+  if (memoizing) {
+    for (auto mir_func : module.getFuncs()) {
+      markMemoized(mir_func);
+    }
+  }
+}
+
+bool MirPassManager::inlineCalls(MirModule& module, MirFunc* caller) {
+  std::vector<MirInst*> calls;
+  for (auto block : caller->getBlocks()) {
+    for (auto inst : block->insts) {
+      if (inst->opcode == MIR_CALL) {
+        calls.push_back(inst);
+      }
+    }
+  }
+
+  bool changed = false;
+  for (auto call : calls) {
+    auto callee = module.get(call->env);
+    if (callee != nullptr && canInline(caller, call, callee)) {
+      inlineCall(caller, call, callee);
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+bool MirPassManager::canInline(MirFunc* caller, MirInst* call,
+                               MirFunc* callee) const {
+  // A frame is allocated once per call, at the top of the function.
+  if (callee == caller || callee->getFrame() != nullptr) {
+    return false;
+  }
+
+  size_t threshold = inline_threshold(level);
+  if (using_profile && call->site != nullptr) {
+    uint64_t calls = call->site->counts[0].load();
+    if (calls == 0) {
+      return false;
+    }
+    if (calls >= HOT_CALL_COUNT) {
+      threshold *= HOT_CALL_SCALE;
+    }
+  }
+
+  if (callee->size() > threshold || caller->size() > MAX_CALLER_SIZE) {
+    return false;
+  }
+
+  // a recursive callee would merely be unrolled
+  for (auto block : callee->getBlocks()) {
+    for (auto inst : block->insts) {
+      if (inst->opcode == MIR_CALL && inst->func == callee->getFunc() &&
+          inst->env == callee->getEnv()) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+void MirPassManager::inlineCall(MirFunc* caller, MirInst* call,
+                                MirFunc* callee) {
+  auto block = call->parent;
+  auto& insts = block->insts;
+  auto pos = std::find(insts.begin(), insts.end(), call);
+
+  std::unordered_map<MirInst*, MirInst*> value_map;
+  std::unordered_map<MirBlock*, MirBlock*> block_map;
+  auto& params = callee->getParams();
+  for (size_t i = 0; i < params.size(); i++) {
+    value_map[params[i]] = call->operands[i];
+  }
+
+  // A tail call's value is returned right away, so the callee's returns
+  // stay returns and its tail calls stay tail calls. Otherwise the rest
+  // of the block moves to `cont`, where the returned values meet.
+  MirBlock* cont = nullptr;
+  MirInst* result = nullptr;
+  if (call->tail) {
+    assert(pos + 1 != insts.end() && (*(pos + 1))->opcode == MIR_RET);
+    insts.erase(pos + 1, insts.end());
+  } else {
+    cont = caller->createBlock("cont");
+    for (auto moved = pos + 1; moved != insts.end(); ++moved) {
+      (*moved)->parent = cont;
+      cont->insts.push_back(*moved);
+    }
+    insts.erase(pos + 1, insts.end());
+
+    for (auto each : caller->getBlocks()) {
+      for (auto inst : each->insts) {
+        if (inst->opcode == MIR_PHI) {
+          std::replace(inst->targets.begin(), inst->targets.end(), block,
+                       cont);
+        }
+      }
+    }
+
+    if (call->type != MIR_VOID) {
+      result = caller->createInst(MIR_PHI, call->type);
+      result->parent = cont;
+      cont->insts.insert(cont->insts.begin(), result);
+    }
+  }
+  caller->erase(call);
+
+  for (auto callee_block : callee->getBlocks()) {
+    block_map[callee_block] = caller->createBlock(callee_block->name);
+  }
+  block_map[callee->getEntry()]->name =
+      tsg_ident_cstr(callee->getFunc()->decl->name);
+
+  std::vector<MirInst*> cloned;
+  for (auto callee_block : callee->getBlocks()) {
+    auto new_block = block_map[callee_block];
+    for (auto inst : callee_block->insts) {
+      if (inst->opcode == MIR_RET && cont != nullptr) {
+        auto jump = caller->createInst(MIR_JUMP, MIR_VOID);
+        jump->targets.push_back(cont);
+        jump->parent = new_block;
+        new_block->insts.push_back(jump);
+        if (result != nullptr) {
+          result->operands.push_back(inst->operands[0]);
+          result->targets.push_back(new_block);
+        }
+        continue;
+      }
+
+      auto copy = caller->createInst(inst->opcode, inst->type);
+      *copy = *inst;
+      copy->tail = inst->tail && call->tail;
+      copy->parent = new_block;
+      new_block->insts.push_back(copy);
+      value_map[inst] = copy;
+      cloned.push_back(copy);
+    }
+  }
+  if (result != nullptr) {
+    cloned.push_back(result);
+  }
+
+  for (auto inst : cloned) {
+    for (auto& operand : inst->operands) {
+      auto found = value_map.find(operand);
+      if (found != value_map.end()) {
+        operand = found->second;
+      }
+    }
+    for (auto& target : inst->targets) {
+      auto found = block_map.find(target);
+      if (found != block_map.end()) {
+        target = found->second;
+      }
+    }
+  }
+
+  auto jump = caller->createInst(MIR_JUMP, MIR_VOID);
+  jump->targets.push_back(block_map[callee->getEntry()]);
+  jump->parent = block;
+  insts.push_back(jump);
+
+  if (result != nullptr) {
+    caller->replaceAllUses(call, result);
+  }
+}
+
+void MirPassManager::eliminateFrame(MirFunc* mir_func) {
+  auto frame = mir_func->getFrame();
+  if (frame == nullptr) {
+    return;
+  }
+
+  // Members are bound exactly once, so each slot has a single store.
+  std::unordered_map<int32_t, MirInst*> stores;
+  std::vector<MirInst*> loads;
+  for (auto block : mir_func->getBlocks()) {
+    for (auto inst : block->insts) {
+      if (inst->opcode == MIR_STORE && inst->operands[0] == frame) {
+        stores[inst->index] = inst;
+      } else if (inst->opcode == MIR_LOAD &&
+                 strip_closure(inst->operands[0]) == frame) {
+        loads.push_back(inst);
+      }
+    }
+  }
+
+  idom_map_t idom;
+  compute_dominators(mir_func, idom);
+
+  // Inlined closures read our frame; they can have the stored values, or
+  // go on from our `$outer`, wherever the store is sure to have happened.
+  for (auto load : loads) {
+    while (strip_closure(load->operands[0]) == frame) {
+      auto found = stores.find(load->hops == 0 ? load->index : 0);
+      if (found == stores.end() || !dominates(idom, found->second, load)) {
+        break;
+      }
+
+      auto value = found->second->operands[1];
+      if (load->hops == 0) {
+        mir_func->replaceAllUses(load, value);
+        mir_func->erase(load);
+        break;
+      }
+
+      if (value->opcode == MIR_NULL) {
+        break;
+      }
+      load->operands[0] = value;
+      load->hops -= 1;
+      load->frame = load->frame->outer;
+    }
+  }
+
+  // The frame goes if nothing but its own stores and closures is left.
+  std::vector<MirInst*> frame_insts;
+  for (auto block : mir_func->getBlocks()) {
+    for (auto inst : block->insts) {
+      bool own_store = inst->opcode == MIR_STORE && inst->operands[0] == frame;
+      bool own_closure =
+          inst->opcode == MIR_CLOSURE && inst->operands[0] == frame;
+      if (own_store || own_closure) {
+        frame_insts.push_back(inst);
+        continue;
+      }
+
+      for (auto operand : inst->operands) {
+        if (strip_closure(operand) == frame) {
+          return;
+        }
+      }
+    }
+  }
+
+  for (auto inst : frame_insts) {
+    mir_func->erase(inst);
+  }
+  mir_func->erase(frame);
+  mir_func->setFrame(nullptr);
+}
+
+void MirPassManager::eliminateTailRecursion(MirFunc* mir_func) {
+  // A closure may point into our frame, so only a frameless function can
+  // give up its stack to the callee.
+  if (mir_func->getFrame() != nullptr) {
+    return;
+  }
+
+  std::vector<MirInst*> calls;
+  for (auto block : mir_func->getBlocks()) {
+    auto ret = block->getTerminator();
+    if (ret == nullptr || ret->opcode != MIR_RET || block->insts.size() < 2) {
+      continue;
+    }
+
+    auto call = block->insts[block->insts.size() - 2];
+    if (call->opcode == MIR_CALL && call->tail &&
+        call->func == mir_func->getFunc() &&
+        call->env == mir_func->getEnv()) {
+      calls.push_back(call);
+    }
+  }
+
+  if (calls.empty()) {
+    return;
+  }
+
+  // The entry block becomes the loop header, entered from a new one.
+  auto entry = mir_func->getEntry();
+  auto header = mir_func->createBlock("tailrecurse");
+  header->insts.swap(entry->insts);
+  for (auto inst : header->insts) {
+    inst->parent = header;
+  }
+  for (auto block : mir_func->getBlocks()) {
+    for (auto inst : block->insts) {
+      if (inst->opcode == MIR_PHI) {
+        std::replace(inst->targets.begin(), inst->targets.end(), entry,
+                     header);
+      }
+    }
+  }
+
+  auto jump = mir_func->createInst(MIR_JUMP, MIR_VOID);
+  jump->targets.push_back(header);
+  jump->parent = entry;
+  entry->insts.push_back(jump);
+
+  // `$outer` and the captures are the same on every iteration.
+  auto func = mir_func->getFunc();
+  size_t first_param = func->conv == TSG_FUNC_CLOSURE ? 1 : 0;
+  size_t n_params = func->params->size;
+
+  std::vector<MirInst*> phis;
+  for (size_t i = 0; i < n_params; i++) {
+    auto param = mir_func->getParams()[first_param + i];
+    auto phi = mir_func->createInst(MIR_PHI, param->type);
+    phi->name = param->name + ".tr";
+    mir_func->replaceAllUses(param, phi);
+    phi->operands.push_back(param);
+    phi->targets.push_back(entry);
+    phi->parent = header;
+    header->insts.insert(header->insts.begin() + i, phi);
+    phis.push_back(phi);
+  }
+
+  for (auto call : calls) {
+    auto block = call->parent;
+    for (size_t i = 0; i < n_params; i++) {
+      phis[i]->operands.push_back(call->operands[first_param + i]);
+      phis[i]->targets.push_back(block);
+    }
+
+    mir_func->erase(block->getTerminator());
+    mir_func->erase(call);
+
+    auto loop = mir_func->createInst(MIR_JUMP, MIR_VOID);
+    loop->targets.push_back(header);
+    loop->parent = block;
+    block->insts.push_back(loop);
+  }
+}
+
+void MirPassManager::removeDeadFuncs(MirModule& module) {
+  std::unordered_set<MirFunc*> live;
+  std::vector<MirFunc*> worklist;
+  live.insert(module.getRoot());
+  worklist.push_back(module.getRoot());
+
+  while (!worklist.empty()) {
+    auto mir_func = worklist.back();
+    worklist.pop_back();
+
+    for (auto block : mir_func->getBlocks()) {
+      for (auto inst : block->insts) {
+        if (inst->opcode != MIR_CALL) {
+          continue;
+        }
+        auto callee = module.get(inst->env);
+        if (callee != nullptr && live.insert(callee).second) {
+          worklist.push_back(callee);
+        }
+      }
+    }
+  }
+
+  for (auto mir_func : module.getFuncs()) {
+    if (live.count(mir_func) == 0) {
+      module.erase(mir_func);
+    }
+  }
+}
+
+void MirPassManager::mergeIdenticalFuncs(MirModule& module) {
+  // Merging callees can make their callers identical in turn.
+  while (true) {
+    auto funcs = module.getFuncs();
+
+    // The root comes first, so it is never the one merged away.
+    std::unordered_map<std::string, MirFunc*> keys;
+    std::unordered_map<MirFunc*, MirFunc*> merged;
+    for (auto mir_func : funcs) {
+      auto found = keys.emplace(describeFunc(mir_func), mir_func);
+      if (!found.second) {
+        merged[mir_func] = found.first->second;
+      }
+    }
+
+    if (merged.empty()) {
+      return;
+    }
+
+    for (auto mir_func : funcs) {
+      if (merged.count(mir_func) != 0) {
+        continue;
+      }
+      for (auto block : mir_func->getBlocks()) {
+        for (auto inst : block->insts) {
+          if (inst->opcode != MIR_CALL) {
+            continue;
+          }
+          auto found = merged.find(module.get(inst->env));
+          if (found != merged.end()) {
+            inst->func = found->second->getFunc();
+            inst->env = found->second->getEnv();
+          }
+        }
+      }
+    }
+
+    for (auto& entry : merged) {
+      module.erase(entry.first);
+    }
+  }
+}
+
+std::string MirPassManager::describeFunc(MirFunc* mir_func) const {
+  auto func = mir_func->getFunc();
+  auto env = mir_func->getEnv();
+
+  // the signature, as Compiler::convInstanceTy() lowers it
+  std::string out;
+  auto type = tsg_tyenv_get(env, func->ftype);
+  describe_lowered(&out, type->func.ret);
+  out += func->conv == TSG_FUNC_CLOSURE ? " (i8*" : " (";
+  for (size_t i = 0; i < type->func.params->size; i++) {
+    out += ",";
+    describe_lowered(&out, type->func.params->elem[i]);
+  }
+  for (int32_t i = 0; i < func->n_captures; i++) {
+    out += ",";
+    describe_lowered(&out, tsg_tyenv_get(env, func->captures[i]->tyvar));
+  }
+  out += ")";
+
+  // Counters are per instance while they are being counted into; branch
+  // weights from a profile make no difference to what the code does.
+  bool distinct_sites = !using_profile;
+  if (distinct_sites && mir_func->getEntrySite() != nullptr) {
+    out += " site " + std::to_string(reinterpret_cast<uintptr_t>(
+                          mir_func->getEntrySite()));
+  }
+
+  // then the body, with values and blocks by their position in it
+  auto order = mir_func->getBlocksInOrder();
+  std::unordered_map<MirInst*, size_t> values;
+  std::unordered_map<MirBlock*, size_t> blocks;
+  for (auto param : mir_func->getParams()) {
+    values.emplace(param, values.size());
+  }
+  for (auto block : order) {
+    blocks.emplace(block, blocks.size());
+    for (auto inst : block->insts) {
+      values.emplace(inst, values.size());
+    }
+  }
+
+  for (auto block : order) {
+    out += "\n" + std::to_string(blocks[block]) + ":";
+    for (auto inst : block->insts) {
+      out += "\n" + std::to_string(inst->opcode) + " " +
+             std::to_string(inst->type);
+      for (auto operand : inst->operands) {
+        out += " %" + std::to_string(values[operand]);
+      }
+      for (auto target : inst->targets) {
+        out += " @" + std::to_string(blocks[target]);
+      }
+
+      switch (inst->opcode) {
+        case MIR_CONST:
+          out += " " + std::to_string(inst->imm);
+          break;
+
+        case MIR_BINARY:
+          out += " " + std::to_string(inst->op);
+          break;
+
+        case MIR_FRAME:
+        case MIR_STORE:
+        case MIR_LOAD:
+          out += " " + std::to_string(inst->index) + " " +
+                 std::to_string(inst->hops) + " ";
+          describe_frame(&out, inst->frame, inst->env);
+          break;
+
+        case MIR_CALL:
+          if (inst->func == func && inst->env == env) {
+            out += " self";
+          } else {
+            out += " " +
+                   std::to_string(reinterpret_cast<uintptr_t>(inst->func)) +
+                   ":" +
+                   std::to_string(reinterpret_cast<uintptr_t>(inst->env));
+          }
+          out += inst->tail ? " tail" : "";
+          break;
+
+        default:
+          break;
+      }
+
+      if (distinct_sites && inst->site != nullptr) {
+        out += " site " +
+               std::to_string(reinterpret_cast<uintptr_t>(inst->site));
+      }
+    }
+  }
+
+  return out;
+}
+
+void MirPassManager::markMemoized(MirFunc* mir_func) {
+  if (!mir_func->getEnv()->pure) {
+    return;
+  }
+
+  int32_t self_calls = 0;
+  for (auto block : mir_func->getBlocksInOrder()) {
+    for (auto inst : block->insts) {
+      if (inst->opcode != MIR_CALL) {
+        continue;
+      }
+      // The result is stored on the way out, which would take every call
+      // out of tail position; the stack must not grow where it did not.
+      if (inst->tail) {
+        return;
+      }
+      if (inst->func == mir_func->getFunc() &&
+          inst->env == mir_func->getEnv()) {
+        self_calls += 1;
+      }
+    }
+  }
+
+  // a single recursion is linear already, and gains nothing from a memo
+  mir_func->setMemoized(self_calls > 1);
+}
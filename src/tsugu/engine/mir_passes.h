@@ -0,0 +1,63 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file mir_passes.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_MIR_PASSES_H
+#define TSUGU_ENGINE_MIR_PASSES_H
+
+#include "mir.h"
+#include <cstdint>
+#include <string>
+
+namespace tsugu {
+
+/**
+ * Language-level passes over a MirModule, cheap enough to run on every
+ * module before the LLVM pipeline gets it.
+ *
+ * At -O1 and above, small calls are inlined (every callee is known), the
+ * frames no closure can reach after that are dropped along with their
+ * slots, and, when the module holds the whole program, instances nothing
+ * calls any more are removed. Self-recursive tail calls of frameless
+ * functions always become loops, as tail calls must not grow the stack.
+ *
+ * Instances of a whole program that would be lowered to the same LLVM
+ * function, as those that differ only in the functions passed to them
+ * where they are never called, are merged into the first one, and the
+ * calls of the others go to it.
+ *
+ * With `memoize`, pure instances that call themselves more than once, and
+ * so may take exponential time, are marked to be memoized.
+ *
+ * With `profiled`, the sites of calls hold the counts of earlier runs.
+ * Calls that never ran are not inlined, and hot ones may inline larger
+ * callees.
+ */
+class MirPassManager {
+ public:
+  MirPassManager(int32_t opt_level, bool memoize, bool profiled);
+  virtual ~MirPassManager();
+
+  void run(MirModule& module, bool whole_program);
+
+ private:
+  int32_t level;
+  bool memoizing;
+  bool using_profile;
+
+  bool inlineCalls(MirModule& module, MirFunc* caller);
+  bool canInline(MirFunc* caller, MirInst* call, MirFunc* callee) const;
+  void inlineCall(MirFunc* caller, MirInst* call, MirFunc* callee);
+  void eliminateFrame(MirFunc* mir_func);
+  void eliminateTailRecursion(MirFunc* mir_func);
+  void removeDeadFuncs(MirModule& module);
+  void mergeIdenticalFuncs(MirModule& module);
+  std::string describeFunc(MirFunc* mir_func) const;
+  void markMemoized(MirFunc* mir_func);
+};
+
+}  // namespace tsugu
+
+#endif
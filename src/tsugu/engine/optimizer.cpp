@@ -0,0 +1,74 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file optimizer.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "optimizer.h"
+
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+
+using namespace tsugu;
+
+Optimizer::Optimizer(int32_t opt_level, bool dump_modules)
+    : level(opt_level < 0 ? 0 : (opt_level > 3 ? 3 : opt_level)),
+      dump_ir(dump_modules) {}
+
+Optimizer::~Optimizer() {}
+
+void Optimizer::optimize(llvm::Module& module) const {
+  if (level == 0) {
+    return;
+  }
+
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = level;
+  builder.SizeLevel = 0;
+  builder.Inliner = llvm::createFunctionInliningPass(level, 0, false);
+  builder.LoopVectorize = (level > 1);
+  builder.SLPVectorize = (level > 1);
+  builder.MergeFunctions = true;
+
+  llvm::legacy::FunctionPassManager function_passes(&module);
+  llvm::legacy::PassManager module_passes;
+  builder.populateFunctionPassManager(function_passes);
+
+  // Instances are internal, so the constants and pointers they are called
+  // with can be pushed into them before the inliner runs, and instances it
+  // leaves uncalled are dropped afterwards.
+  module_passes.add(llvm::createIPSCCPPass());
+  module_passes.add(llvm::createArgumentPromotionPass());
+  builder.populateModulePassManager(module_passes);
+  module_passes.add(llvm::createGlobalDCEPass());
+
+  function_passes.doInitialization();
+  for (auto& func : module) {
+    function_passes.run(func);
+  }
+  function_passes.doFinalization();
+
+  module_passes.run(module);
+
+  // like the Compiler, show what goes to codegen
+  if (dump_ir) {
+    module.print(llvm::errs(), nullptr);
+  }
+}
+
+llvm::CodeGenOpt::Level Optimizer::getCodeGenLevel(int32_t opt_level) {
+  switch (opt_level) {
+    case 0:
+      return llvm::CodeGenOpt::None;
+    case 1:
+      return llvm::CodeGenOpt::Less;
+    case 2:
+      return llvm::CodeGenOpt::Default;
+    default:
+      return (opt_level < 0) ? llvm::CodeGenOpt::None
+                             : llvm::CodeGenOpt::Aggressive;
+  }
+}
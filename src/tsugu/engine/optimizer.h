@@ -0,0 +1,43 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file optimizer.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_OPTIMIZER_H
+#define TSUGU_ENGINE_OPTIMIZER_H
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/CodeGen.h>
+
+namespace tsugu {
+
+/**
+ * The standard LLVM function and module pipelines at -O1 to -O3.
+ *
+ * Every instance but `$main` has internal linkage, so interprocedural
+ * passes see whole programs: IPSCCP and argument promotion specialize
+ * instances for the values they are called with, the inliner folds them
+ * into their callers, and global DCE drops the ones left uncalled. The
+ * instances that optimize down to the same code are merged into one. SROA
+ * and mem2reg turn the `$sf` frames that do not escape into registers.
+ * Level 0 leaves modules untouched. With `dump_ir`, optimized modules are
+ * printed to stderr as they go to codegen.
+ */
+class Optimizer {
+ public:
+  Optimizer(int32_t opt_level, bool dump_modules);
+  virtual ~Optimizer();
+
+  void optimize(llvm::Module& module) const;
+
+  static llvm::CodeGenOpt::Level getCodeGenLevel(int32_t opt_level);
+
+ private:
+  int32_t level;
+  bool dump_ir;
+};
+
+}  // namespace tsugu
+
+#endif
@@ -0,0 +1,79 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file perf_map.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "perf_map.h"
+
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Process.h>
+#include <string>
+
+using namespace tsugu;
+
+PerfMap::PerfMap() : mutex(), out(nullptr) {}
+
+PerfMap::~PerfMap() {}
+
+bool PerfMap::init() {
+  std::string path =
+      "/tmp/perf-" + std::to_string(llvm::sys::Process::getProcessId()) +
+      ".map";
+
+  std::error_code ec;
+  out = llvm::make_unique<llvm::raw_fd_ostream>(path, ec,
+                                                llvm::sys::fs::OF_Append);
+  if (ec) {
+    llvm::errs() << "perf map: " << path << ": " << ec.message() << "\n";
+    out = nullptr;
+    return false;
+  }
+
+  return true;
+}
+
+void PerfMap::notifyObjectLoaded(
+    ObjectKey, const llvm::object::ObjectFile& object,
+    const llvm::RuntimeDyld::LoadedObjectInfo& info) {
+  // the debug object has its symbols relocated to where the code was loaded
+  auto debug_owner = info.getObjectForDebug(object);
+  auto debug_object = debug_owner.getBinary();
+  if (debug_object == nullptr) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& entry : llvm::object::computeSymbolSizes(*debug_object)) {
+    auto& symbol = entry.first;
+
+    auto type = symbol.getType();
+    if (!type) {
+      llvm::consumeError(type.takeError());
+      continue;
+    }
+    if (*type != llvm::object::SymbolRef::ST_Function) {
+      continue;
+    }
+
+    auto name = symbol.getName();
+    if (!name) {
+      llvm::consumeError(name.takeError());
+      continue;
+    }
+
+    auto address = symbol.getAddress();
+    if (!address) {
+      llvm::consumeError(address.takeError());
+      continue;
+    }
+
+    *out << llvm::format("%llx %llx ",
+                         static_cast<unsigned long long>(*address),
+                         static_cast<unsigned long long>(entry.second))
+         << *name << "\n";
+  }
+  out->flush();
+}
@@ -0,0 +1,44 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file perf_map.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_PERF_MAP_H
+#define TSUGU_ENGINE_PERF_MAP_H
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <mutex>
+
+namespace tsugu {
+
+/**
+ * Writes `/tmp/perf-<pid>.map`, the symbol file `perf report` reads for
+ * code it cannot find in any mapped binary.
+ *
+ * One `<address> <size> <name>` line is appended for every function of
+ * every object the JIT loads. The Compiler names each instance after its
+ * function and argument types, so those names show up as they are in
+ * profiles and flame graphs.
+ */
+class PerfMap : public llvm::JITEventListener {
+ public:
+  PerfMap();
+  virtual ~PerfMap();
+
+  bool init();
+
+  void notifyObjectLoaded(
+      ObjectKey key, const llvm::object::ObjectFile& object,
+      const llvm::RuntimeDyld::LoadedObjectInfo& info) override;
+
+ private:
+  std::mutex mutex;
+  std::unique_ptr<llvm::raw_fd_ostream> out;
+};
+
+}  // namespace tsugu
+
+#endif
@@ -0,0 +1,127 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file pgo_profile.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "pgo_profile.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <vector>
+
+using namespace tsugu;
+
+PgoProfile::PgoProfile() : mutex(), sites() {}
+
+PgoProfile::~PgoProfile() {}
+
+PgoSite* PgoProfile::getSite(const std::string& instance,
+                             const tsg_source_range_t* loc) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return createSite(getKey(instance, loc));
+}
+
+PgoSite* PgoProfile::findSite(const std::string& instance,
+                              const tsg_source_range_t* loc) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = sites.find(getKey(instance, loc));
+  return found != sites.end() ? found->second.get() : nullptr;
+}
+
+bool PgoProfile::isEmpty() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return sites.empty();
+}
+
+bool PgoProfile::load(const std::string& path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    llvm::errs() << path << ": " << buffer.getError().message() << "\n";
+    return false;
+  }
+
+  llvm::SmallVector<llvm::StringRef, 64> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  int32_t line_no = 0;
+  for (auto line : lines) {
+    line_no += 1;
+    if (line.startswith("#")) {
+      continue;
+    }
+
+    llvm::SmallVector<llvm::StringRef, 4> fields;
+    line.split(fields, '\t');
+    uint64_t counts[2];
+    if (fields.size() != 4 || fields[2].getAsInteger(10, counts[0]) ||
+        fields[3].getAsInteger(10, counts[1])) {
+      llvm::errs() << path << ":" << line_no << ": malformed profile\n";
+      return false;
+    }
+
+    auto site = createSite(fields[0].str() + "\t" + fields[1].str());
+    site->counts[0].fetch_add(counts[0]);
+    site->counts[1].fetch_add(counts[1]);
+  }
+
+  return true;
+}
+
+bool PgoProfile::save(const std::string& path) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    llvm::errs() << path << ": " << ec.message() << "\n";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  // sorted, so that profiles of the same runs compare equal
+  std::vector<const std::string*> keys;
+  for (auto& entry : sites) {
+    keys.push_back(&(entry.first));
+  }
+  std::sort(keys.begin(), keys.end(),
+            [](const std::string* a, const std::string* b) { return *a < *b; });
+
+  out << "# tsugu profile\n";
+  for (auto key : keys) {
+    auto site = sites[*key].get();
+    out << *key << "\t" << site->counts[0].load() << "\t"
+        << site->counts[1].load() << "\n";
+  }
+
+  out.close();
+  if (out.has_error()) {
+    llvm::errs() << path << ": " << out.error().message() << "\n";
+    out.clear_error();
+    return false;
+  }
+
+  return true;
+}
+
+std::string PgoProfile::getKey(const std::string& instance,
+                               const tsg_source_range_t* loc) {
+  if (loc == nullptr) {
+    return instance + "\tentry";
+  }
+  return instance + "\t" + std::to_string(loc->begin.line) + ":" +
+         std::to_string(loc->begin.column);
+}
+
+PgoSite* PgoProfile::createSite(const std::string& key) {
+  auto& site = sites[key];
+  if (site == nullptr) {
+    site.reset(new PgoSite());
+    site->counts[0].store(0);
+    site->counts[1].store(0);
+  }
+  return site.get();
+}
@@ -0,0 +1,70 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file pgo_profile.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_PGO_PROFILE_H
+#define TSUGU_ENGINE_PGO_PROFILE_H
+
+#include <tsugu/core/token.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace tsugu {
+
+/**
+ * Counts of one profiled point of an instance: for an if, the times each
+ * arm was taken; for a call or the entry of the instance, the calls, with
+ * `counts[1]` unused.
+ */
+struct PgoSite {
+  std::atomic<uint64_t> counts[2];
+};
+
+/**
+ * Execution counts of the compiled code of every program on an engine.
+ *
+ * Sites are keyed by the instance name, as Compiler::describeInstance()
+ * gives it, and the source position of the if or call, so they survive
+ * inlining and stay valid from one run of the same source to the next.
+ * Instrumented code adds to the counts of a site through its address,
+ * which never changes once the site is created.
+ *
+ * A profile is saved as text, one site per line: the instance name, the
+ * position as "line:column" or "entry", and the two counts, separated by
+ * tabs. Loading adds the saved counts to those already held.
+ */
+class PgoProfile {
+ public:
+  PgoProfile();
+  virtual ~PgoProfile();
+
+  // the site at `loc`, or the entry if null; created with zero counts
+  PgoSite* getSite(const std::string& instance,
+                   const tsg_source_range_t* loc);
+  // the same, but null unless some run or profile has created it
+  PgoSite* findSite(const std::string& instance,
+                    const tsg_source_range_t* loc);
+
+  bool isEmpty();
+
+  bool load(const std::string& path);
+  bool save(const std::string& path);
+
+ private:
+  std::mutex mutex;
+  std::unordered_map<std::string, std::unique_ptr<PgoSite>> sites;
+
+  static std::string getKey(const std::string& instance,
+                            const tsg_source_range_t* loc);
+  PgoSite* createSite(const std::string& key);
+};
+
+}  // namespace tsugu
+
+#endif
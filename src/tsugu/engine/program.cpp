@@ -0,0 +1,432 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file program.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "program.h"
+
+#include "compiler.h"
+#include "interpreter.h"
+#include <tsugu/core/verifier.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <cassert>
+#include <cstring>
+
+using namespace tsugu;
+
+static int32_t count_func(tsg_func_t* func);
+static int32_t count_block(tsg_block_t* block);
+static int32_t count_expr(tsg_expr_t* expr);
+
+static int32_t count_func(tsg_func_t* func) {
+  return 1 + count_block(func->body);
+}
+
+static int32_t count_block(tsg_block_t* block) {
+  int32_t count = 0;
+
+  for (auto node = block->funcs->head; node != nullptr; node = node->next) {
+    count += count_func(node->func);
+  }
+
+  for (auto node = block->stmts->head; node != nullptr; node = node->next) {
+    tsg_stmt_t* stmt = node->stmt;
+    switch (stmt->kind) {
+      case TSG_STMT_VAL:
+        count += 1 + count_expr(stmt->val.expr);
+        break;
+
+      case TSG_STMT_EXPR:
+        count += 1 + count_expr(stmt->expr.expr);
+        break;
+    }
+  }
+
+  return count;
+}
+
+static int32_t count_expr(tsg_expr_t* expr) {
+  switch (expr->kind) {
+    case TSG_EXPR_BINARY:
+      return 1 + count_expr(expr->binary.lhs) + count_expr(expr->binary.rhs);
+
+    case TSG_EXPR_CALL: {
+      int32_t count = 1 + count_expr(expr->call.callee);
+      for (auto node = expr->call.args->head; node; node = node->next) {
+        count += count_expr(node->expr);
+      }
+      return count;
+    }
+
+    case TSG_EXPR_IFELSE:
+      return 1 + count_expr(expr->ifelse.cond) +
+             count_block(expr->ifelse.thn) + count_block(expr->ifelse.els);
+
+    case TSG_EXPR_IDENT:
+    case TSG_EXPR_NUMBER:
+      return 1;
+  }
+
+  return 1;
+}
+
+Program::Program(JIT& program_jit, tsg_ast_t* program_ast,
+                 const tsg_engine_config_t& program_config)
+    : jit(program_jit),
+      dylib(&(program_jit.createProgram())),
+      context(llvm::make_unique<llvm::LLVMContext>()),
+      ast(program_ast),
+      config(program_config),
+      interpret(program_config.interp_max_nodes > 0 &&
+                count_func(program_ast->root) <=
+                    program_config.interp_max_nodes),
+      broken(false),
+      main(nullptr),
+      runs(0),
+      reoptimized(false),
+      mutex(),
+      slots(),
+      entries(),
+      is_referenced(),
+      referenced(),
+      interpreter(nullptr) {}
+
+Program::~Program() {}
+
+bool Program::load() {
+  if (interpret) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  return loadModules();
+}
+
+bool Program::loadModules() {
+  if (isPartitioned()) {
+    return loadPartitioned();
+  }
+
+  std::unique_ptr<llvm::Module> module;
+  {
+    auto context_lock = context.getLock();
+    Compiler compiler(*context.getContext(), this);
+    module = compiler.compile(ast);
+  }
+  if (!module) {
+    return false;
+  }
+
+  return jit.addModule(*dylib, std::move(module), context);
+}
+
+bool Program::loadPartitioned() {
+  // `$main` finds the first instances, and each instance those it calls.
+  for (int32_t i = -1; i < static_cast<int32_t>(referenced.size()); i++) {
+    llvm::orc::ThreadSafeContext module_context(
+        llvm::make_unique<llvm::LLVMContext>());
+    Compiler compiler(*module_context.getContext(), this);
+
+    std::unique_ptr<llvm::Module> module;
+    if (i < 0) {
+      module = compiler.compile(ast);
+    } else {
+      int32_t id = referenced[i];
+      auto instance = tsg_insttbl_get(ast->instances, id);
+      module = compiler.compileInstance(instance->func, instance->env,
+                                        getInstanceName(id));
+    }
+    if (!module) {
+      return false;
+    }
+
+    if (jit.addModule(*dylib, std::move(module), module_context) == false) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Program::link() {
+  // looked up once; a program may be run again and again
+  if (interpret || main.load() != nullptr) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto f =
+      (main_func_t)jit.lookup(*dylib, tsg_ident_cstr(ast->root->decl->name));
+  if (!f) {
+    llvm::errs() << "function not found\n";
+    return false;
+  }
+  main.store(f);
+
+  return true;
+}
+
+int32_t Program::run() {
+  if (interpret) {
+    return evaluate();
+  }
+
+  if (link() == false) {
+    return -1;
+  }
+
+  main_func_t f = main.load();
+  int32_t result = f();
+
+  // the run that completes the warm-up compiles the program again
+  if (config.pgo_warmup > 0 &&
+      runs.fetch_add(1) + 1 == static_cast<uint64_t>(config.pgo_warmup) &&
+      reoptimize() == false) {
+    llvm::errs() << "recompiling with the profile failed\n";
+  }
+
+  return result;
+}
+
+bool Program::reoptimize() {
+  std::lock_guard<std::mutex> lock(mutex);
+  reoptimized.store(true);
+
+  if (isLazy()) {
+    // only the instances that ran have counts worth compiling with
+    auto profile = getPgoProfile();
+    for (int32_t id = 0; id < static_cast<int32_t>(slots.size()); id++) {
+      auto instance = tsg_insttbl_get(ast->instances, id);
+      auto entry = profile->findSite(
+          Compiler::describeInstance(instance->func, instance->env), nullptr);
+      if (slots[id].load(std::memory_order_relaxed) == nullptr ||
+          entry == nullptr || entry->counts[0].load() == 0) {
+        continue;
+      }
+
+      void* address = compileInstance(id, getInstanceName(id) + ".pgo");
+      if (address == nullptr) {
+        return false;
+      }
+      slots[id].store(address, std::memory_order_release);
+    }
+    return true;
+  }
+
+  // `$main` and the instances keep their names, so they go to a new dylib
+  dylib = &(jit.createProgram());
+  if (loadModules() == false) {
+    return false;
+  }
+
+  auto f =
+      (main_func_t)jit.lookup(*dylib, tsg_ident_cstr(ast->root->decl->name));
+  if (!f) {
+    return false;
+  }
+  main.store(f);
+
+  return true;
+}
+
+int32_t Program::evaluate() {
+  // once; the root frame of the interpreter is the `$outer` of the entries
+  // handed out by instantiate
+  assert(!interpreter);
+  interpreter.reset(
+      new Interpreter(*this, config.tier_threshold, config.tier_background));
+  return interpreter->run(ast);
+}
+
+void* Program::instantiate(const char* name, tsg_type_arr_t* args,
+                           tsg_type_t** func_type) {
+  int32_t id = -1;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    tsg_func_t* func = findToplevelFunc(name);
+    if (func == nullptr) {
+      llvm::errs() << "function not found: " << name << "\n";
+      tsg_type_arr_destroy(args);
+      return nullptr;
+    }
+    if (args->size != func->params->size) {
+      llvm::errs() << "wrong number of arguments: " << name << "\n";
+      tsg_type_arr_destroy(args);
+      return nullptr;
+    }
+    if (broken) {
+      llvm::errs() << "program has a failed instantiation\n";
+      tsg_type_arr_destroy(args);
+      return nullptr;
+    }
+
+    tsg_type_t* type = verifyInstance(func, args);
+    if (type == nullptr) {
+      return nullptr;
+    }
+    id = getInstanceId(type->func.env);
+    *func_type = type;
+  }
+
+  return compileEntry(id);
+}
+
+uint8_t* Program::getRootFrame() {
+  return interpreter ? interpreter->getRootFrame() : nullptr;
+}
+
+tsg_func_t* Program::findToplevelFunc(const char* name) {
+  auto node = ast->root->body->funcs->head;
+  while (node != nullptr) {
+    if (strcmp(tsg_ident_cstr(node->func->decl->name), name) == 0) {
+      return node->func;
+    }
+    node = node->next;
+  }
+
+  return nullptr;
+}
+
+tsg_type_t* Program::verifyInstance(tsg_func_t* func, tsg_type_arr_t* args) {
+  tsg_verifier_t* verifier = tsg_verifier_create();
+  tsg_type_t* type = tsg_verifier_instantiate(verifier, ast, func, args);
+
+  if (type == nullptr) {
+    tsg_errlist_t errors;
+    tsg_verifier_error(verifier, &errors);
+    for (tsg_error_t* error = errors.head; error; error = error->next) {
+      llvm::errs() << error->loc.begin.line << ":" << error->loc.begin.column
+                   << ": " << error->message << "\n";
+    }
+    // the failed instance, and whatever it instantiated, may be half-typed
+    broken = true;
+  }
+
+  tsg_verifier_destroy(verifier);
+  return type;
+}
+
+int32_t Program::getInstanceId(tsg_tyenv_t* env) {
+  int32_t id = env->id;
+  assert(id >= 0);
+
+  // slots are never moved, compiled code holds their addresses
+  while (slots.size() <= static_cast<size_t>(id)) {
+    slots.emplace_back(nullptr);
+    is_referenced.push_back(false);
+  }
+  if (!is_referenced[id]) {
+    is_referenced[id] = true;
+    referenced.push_back(id);
+  }
+
+  return id;
+}
+
+int32_t Program::acquireInstanceId(tsg_tyenv_t* env) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return getInstanceId(env);
+}
+
+std::atomic<void*>* Program::getInstanceSlot(int32_t id) {
+  return &(slots[id]);
+}
+
+std::string Program::getInstanceName(int32_t id) {
+  auto instance = tsg_insttbl_get(ast->instances, id);
+  return Compiler::describeInstance(instance->func, instance->env) + "." +
+         std::to_string(id);
+}
+
+void Program::getFrameLayout(tsg_frame_t* frame, tsg_tyenv_t* env,
+                             FrameLayout* layout) {
+  auto context_lock = context.getLock();
+
+  Compiler compiler(*context.getContext(), this);
+  compiler.layoutFrame(frame, env, jit.getDataLayout(), layout);
+}
+
+void* Program::compileEntry(int32_t id) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (static_cast<size_t>(id) < entries.size() && entries[id] != nullptr) {
+      return entries[id];
+    }
+  }
+
+  if (resolveInstance(this, id) == nullptr) {
+    return nullptr;
+  }
+
+  // looked up again, another thread may have built it in the meantime
+  std::lock_guard<std::mutex> lock(mutex);
+  if (static_cast<size_t>(id) < entries.size() && entries[id] != nullptr) {
+    return entries[id];
+  }
+
+  std::string callee_name = getInstanceName(id);
+  std::string name = callee_name + ".entry";
+
+  std::unique_ptr<llvm::Module> module;
+  {
+    auto context_lock = context.getLock();
+    Compiler compiler(*context.getContext(), this);
+    auto instance = tsg_insttbl_get(ast->instances, id);
+    module = compiler.compileEntry(instance->func, instance->env, callee_name,
+                                   name);
+  }
+  if (!module) {
+    return nullptr;
+  }
+
+  if (jit.addModule(*dylib, std::move(module), context) == false) {
+    return nullptr;
+  }
+
+  void* address = jit.lookup(*dylib, name);
+  if (entries.size() <= static_cast<size_t>(id)) {
+    entries.resize(id + 1, nullptr);
+  }
+  entries[id] = address;
+
+  return address;
+}
+
+void* Program::resolveInstance(Program* program, int32_t id) {
+  std::lock_guard<std::mutex> lock(program->mutex);
+
+  void* address = program->slots[id].load(std::memory_order_relaxed);
+  if (address == nullptr) {
+    address = program->compileInstance(id, program->getInstanceName(id));
+    if (address == nullptr) {
+      llvm::report_fatal_error(llvm::Twine("failed to compile ") +
+                               program->getInstanceName(id));
+    }
+    program->slots[id].store(address, std::memory_order_release);
+  }
+
+  return address;
+}
+
+void* Program::compileInstance(int32_t id, const std::string& name) {
+  // Codegen may run on a compile thread that takes the context lock itself,
+  // so hold it only while building IR.
+  std::unique_ptr<llvm::Module> module;
+  {
+    auto context_lock = context.getLock();
+    Compiler compiler(*context.getContext(), this);
+    auto instance = tsg_insttbl_get(ast->instances, id);
+    module = compiler.compileInstance(instance->func, instance->env, name);
+  }
+  if (!module) {
+    return nullptr;
+  }
+
+  if (jit.addModule(*dylib, std::move(module), context) == false) {
+    return nullptr;
+  }
+
+  return jit.lookup(*dylib, name);
+}
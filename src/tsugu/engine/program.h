@@ -0,0 +1,137 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file program.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_PROGRAM_H
+#define TSUGU_ENGINE_PROGRAM_H
+
+#include "compiler.h"
+#include "jit.h"
+#include <tsugu/core/ast.h>
+#include <tsugu/core/tyenv.h>
+#include <tsugu/engine/engine.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tsugu {
+
+class Interpreter;
+
+/**
+ * A verified AST loaded into its own JITDylib, with its own LLVMContext so
+ * that programs sharing a JIT can be compiled from several threads.
+ *
+ * In eager mode every reachable instance is lowered into one module up
+ * front. In lazy mode only `$main` is lowered by `load()`. Each other
+ * instance gets a dispatch slot, at the id the verifier numbered it with,
+ * which starts out null. A call site loads the slot and, while it is still
+ * null, calls `resolveInstance`. That builds and codegens just this
+ * instance and fills the slot.
+ *
+ * With several compile threads, eager mode puts every instance in a module
+ * of its own, with its own context, and calls between instances go through
+ * external declarations. The JIT then runs codegen for the modules in
+ * parallel as their symbols are looked up.
+ *
+ * Small programs start in the Interpreter instead. Nothing is compiled
+ * until an instance gets hot; it is then compiled like a lazy instance,
+ * together with an entry thunk the interpreter can call.
+ *
+ * A program loaded as a reusable handle evaluates its top level once in
+ * the interpreter and keeps that root frame. Top-level functions are then
+ * instantiated on demand for the argument types the host asks for, and
+ * called through their entry thunks with the root frame as `$outer`.
+ *
+ * An instrumented program that has been run `pgo_warmup` times is compiled
+ * again, without counters and with what they counted. An eager program
+ * gets new modules in a new JITDylib, and later runs call its new `$main`;
+ * a lazy one recompiles the instances that ran and repoints their slots.
+ */
+class Program {
+ public:
+  Program(JIT& program_jit, tsg_ast_t* program_ast,
+          const tsg_engine_config_t& program_config);
+  virtual ~Program();
+
+  bool load();
+  bool link();
+  int32_t run();
+  int32_t evaluate();
+
+  void* instantiate(const char* name, tsg_type_arr_t* args,
+                    tsg_type_t** func_type);
+  uint8_t* getRootFrame();
+  tsg_typetbl_t* getTypes() const { return ast->types; }
+
+  bool isLazy() const { return config.lazy || interpret; }
+  bool isPartitioned() const {
+    return !isLazy() && config.compile_threads > 1;
+  }
+  int32_t getOptLevel() const { return config.opt_level; }
+  int32_t getEvalSteps() const { return config.eval_steps; }
+  int32_t getEvalMemory() const { return config.eval_memory; }
+  int32_t getMemoSlots() const { return config.memo_slots; }
+  bool isDumpingIr() const { return config.dump_ir; }
+  MemoCounters* getMemoCounters() { return jit.getMemoCounters(); }
+  PgoProfile* getPgoProfile() { return jit.getPgoProfile(); }
+  bool isInstrumenting() const {
+    return config.pgo_instrument && !reoptimized.load();
+  }
+  int32_t getInstanceId(tsg_tyenv_t* env);
+  int32_t acquireInstanceId(tsg_tyenv_t* env);
+  std::atomic<void*>* getInstanceSlot(int32_t id);
+  std::string getInstanceName(int32_t id);
+
+  void getFrameLayout(tsg_frame_t* frame, tsg_tyenv_t* env,
+                      FrameLayout* layout);
+  void* compileEntry(int32_t id);
+
+  static void* resolveInstance(Program* program, int32_t id);
+
+ private:
+  typedef int32_t (*main_func_t)(void);
+
+  JIT& jit;
+  llvm::orc::JITDylib* dylib;
+  llvm::orc::ThreadSafeContext context;
+  tsg_ast_t* ast;
+  tsg_engine_config_t config;
+  bool interpret;
+  bool broken;
+  std::atomic<main_func_t> main;
+  std::atomic<uint64_t> runs;
+  std::atomic<bool> reoptimized;
+
+  // Instances are numbered by the verifier, see tsg_insttbl_t. The slots
+  // and flags are indexed by that id, and `referenced` lists the instances
+  // compiled code has referred to, in that order. Slots are written under
+  // the mutex with release stores, which compiled code pairs with acquire
+  // loads, as it reads them without the lock. `dylib` changes when the
+  // program is recompiled, so it is only read under the mutex too. An
+  // instance gets one entry thunk, whoever asks for it first, the
+  // interpreter or the host; `entries` keeps its address, or null.
+  std::mutex mutex;
+  std::deque<std::atomic<void*>> slots;
+  std::vector<void*> entries;
+  std::vector<bool> is_referenced;
+  std::vector<int32_t> referenced;
+
+  std::unique_ptr<Interpreter> interpreter;
+
+  bool loadModules();
+  bool loadPartitioned();
+  bool reoptimize();
+  tsg_func_t* findToplevelFunc(const char* name);
+  tsg_type_t* verifyInstance(tsg_func_t* func, tsg_type_arr_t* args);
+  void* compileInstance(int32_t id, const std::string& name);
+};
+
+}  // namespace tsugu
+
+#endif
@@ -0,0 +1,44 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file target.cpp
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include "target.h"
+
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mutex>
+
+static std::once_flag native_target_initialized;
+
+static void initialize_native_target() {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+}
+
+void tsugu::initializeNativeTarget() {
+  std::call_once(native_target_initialized, initialize_native_target);
+}
+
+std::unique_ptr<llvm::TargetMachine> tsugu::createObjectTargetMachine() {
+  initializeNativeTarget();
+
+  std::string triple = llvm::sys::getDefaultTargetTriple();
+  std::string error;
+  auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+  if (target == nullptr) {
+    llvm::errs() << error << "\n";
+    return nullptr;
+  }
+
+  llvm::TargetOptions options;
+  options.GuaranteedTailCallOpt = true;
+  auto machine = target->createTargetMachine(
+      triple, "generic", "", options,
+      llvm::Optional<llvm::Reloc::Model>(llvm::Reloc::PIC_));
+
+  return std::unique_ptr<llvm::TargetMachine>(machine);
+}
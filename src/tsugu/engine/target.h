@@ -0,0 +1,26 @@
+/*----------------------------------- vi: set ft=cpp ts=2 sw=2 et: --*-cpp-*--*/
+/**
+ * @file target.h
+ *
+ ** --------------------------------------------------------------------------*/
+
+#ifndef TSUGU_ENGINE_TARGET_H
+#define TSUGU_ENGINE_TARGET_H
+
+#include <llvm/Target/TargetMachine.h>
+#include <memory>
+
+namespace tsugu {
+
+void initializeNativeTarget();
+
+/**
+ * Target machine for objects that are written out, not run in-process.
+ * It codegens for a generic CPU of the host triple with PIC relocations,
+ * so the objects link into ordinary position-independent executables.
+ */
+std::unique_ptr<llvm::TargetMachine> createObjectTargetMachine();
+
+}  // namespace tsugu
+
+#endif
@@ -42,6 +42,49 @@ size_t tsg_strlen(const char* str) {
   return 0;
 }
 
+tsg_mutex_t* tsg_mutex_create(void) {
+  return NULL;
+}
+
+void tsg_mutex_destroy(tsg_mutex_t* mutex) {
+  (void)mutex;
+}
+
+void tsg_mutex_lock(tsg_mutex_t* mutex) {
+  (void)mutex;
+}
+
+void tsg_mutex_unlock(tsg_mutex_t* mutex) {
+  (void)mutex;
+}
+
+tsg_cond_t* tsg_cond_create(void) {
+  return NULL;
+}
+
+void tsg_cond_destroy(tsg_cond_t* cond) {
+  (void)cond;
+}
+
+void tsg_cond_wait(tsg_cond_t* cond, tsg_mutex_t* mutex) {
+  (void)cond;
+  (void)mutex;
+}
+
+void tsg_cond_broadcast(tsg_cond_t* cond) {
+  (void)cond;
+}
+
+tsg_thread_t* tsg_thread_create(void (*entry)(void* arg), void* arg) {
+  (void)entry;
+  (void)arg;
+  return NULL;
+}
+
+void tsg_thread_join(tsg_thread_t* thread) {
+  (void)thread;
+}
+
 void tsg_assert_failure(const char* expr, const char* file, int line,
                         const char* func) {
   (void)expr;
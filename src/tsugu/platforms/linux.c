@@ -5,6 +5,7 @@
  ** --------------------------------------------------------------------------*/
 
 #include <tsugu/core/platform.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,96 @@ size_t tsg_strlen(const char* str) {
   return strlen(str);
 }
 
+struct tsg_mutex_s {
+  pthread_mutex_t mutex;
+};
+
+struct tsg_cond_s {
+  pthread_cond_t cond;
+};
+
+struct tsg_thread_s {
+  pthread_t thread;
+  void (*entry)(void* arg);
+  void* arg;
+};
+
+tsg_mutex_t* tsg_mutex_create(void) {
+  tsg_mutex_t* mutex = (tsg_mutex_t*)malloc(sizeof(tsg_mutex_t));
+  if (mutex != NULL && pthread_mutex_init(&(mutex->mutex), NULL) != 0) {
+    free(mutex);
+    return NULL;
+  }
+  return mutex;
+}
+
+void tsg_mutex_destroy(tsg_mutex_t* mutex) {
+  if (mutex == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&(mutex->mutex));
+  free(mutex);
+}
+
+void tsg_mutex_lock(tsg_mutex_t* mutex) {
+  pthread_mutex_lock(&(mutex->mutex));
+}
+
+void tsg_mutex_unlock(tsg_mutex_t* mutex) {
+  pthread_mutex_unlock(&(mutex->mutex));
+}
+
+tsg_cond_t* tsg_cond_create(void) {
+  tsg_cond_t* cond = (tsg_cond_t*)malloc(sizeof(tsg_cond_t));
+  if (cond != NULL && pthread_cond_init(&(cond->cond), NULL) != 0) {
+    free(cond);
+    return NULL;
+  }
+  return cond;
+}
+
+void tsg_cond_destroy(tsg_cond_t* cond) {
+  if (cond == NULL) {
+    return;
+  }
+  pthread_cond_destroy(&(cond->cond));
+  free(cond);
+}
+
+void tsg_cond_wait(tsg_cond_t* cond, tsg_mutex_t* mutex) {
+  pthread_cond_wait(&(cond->cond), &(mutex->mutex));
+}
+
+void tsg_cond_broadcast(tsg_cond_t* cond) {
+  pthread_cond_broadcast(&(cond->cond));
+}
+
+static void* run_thread(void* arg) {
+  tsg_thread_t* thread = (tsg_thread_t*)arg;
+  thread->entry(thread->arg);
+  return NULL;
+}
+
+tsg_thread_t* tsg_thread_create(void (*entry)(void* arg), void* arg) {
+  tsg_thread_t* thread = (tsg_thread_t*)malloc(sizeof(tsg_thread_t));
+  if (thread == NULL) {
+    return NULL;
+  }
+
+  thread->entry = entry;
+  thread->arg = arg;
+  if (pthread_create(&(thread->thread), NULL, run_thread, thread) != 0) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+void tsg_thread_join(tsg_thread_t* thread) {
+  pthread_join(thread->thread, NULL);
+  free(thread);
+}
+
 void tsg_assert_failure(const char* expr, const char* file, int line,
                         const char* func) {
   fprintf(stderr, "%s:%d: %s: Assertion '%s' failed.\n", file, line, func,
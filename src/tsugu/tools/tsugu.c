@@ -4,16 +4,25 @@
  *
  ** --------------------------------------------------------------------------*/
 
+// open_memstream, clock_gettime, sysconf and dprintf
+#define _POSIX_C_SOURCE 200809L
+
 #include <tsugu/core/parser.h>
 #include <tsugu/core/resolver.h>
 #include <tsugu/core/scanner.h>
 #include <tsugu/core/verifier.h>
 #include <tsugu/engine/engine.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 static bool read_source(FILE* fp, uint8_t** outbuf, size_t* outsize) {
   size_t read_size = 0;
@@ -46,25 +55,22 @@ static bool read_source(FILE* fp, uint8_t** outbuf, size_t* outsize) {
   return true;
 }
 
-static void print_error(tsg_error_t* error) {
-  fprintf(stderr, "%" PRIi32 ":%" PRIi32 ": %s\n", error->loc.begin.line,
+static void print_error(FILE* out, tsg_error_t* error) {
+  fprintf(out, "%" PRIi32 ":%" PRIi32 ": %s\n", error->loc.begin.line,
           error->loc.begin.column, error->message);
 }
 
-void print_errors(tsg_errlist_t* errors) {
+void print_errors(FILE* out, tsg_errlist_t* errors) {
   tsg_error_t* error = errors->head;
   while (error) {
-    print_error(error);
+    print_error(out, error);
     error = error->next;
   }
 }
 
-int main(void) {
-  uint8_t* buffer;
-  size_t source_size;
-  read_source(stdin, &buffer, &source_size);
-
-  tsg_scanner_t* scanner = tsg_scanner_create(buffer, source_size);
+// parses the source; errors go to `out`
+static tsg_ast_t* parse_source(uint8_t* buffer, size_t size, FILE* out) {
+  tsg_scanner_t* scanner = tsg_scanner_create(buffer, size);
   tsg_parser_t* parser = tsg_parser_create(scanner);
   tsg_errlist_t errors;
 
@@ -72,37 +78,1033 @@ int main(void) {
   tsg_parser_error(parser, &errors);
 
   if (errors.head) {
-    print_errors(&errors);
-    return 1;
+    print_errors(out, &errors);
+    tsg_ast_destroy(ast);
+    ast = NULL;
   }
 
   tsg_parser_destroy(parser);
   tsg_scanner_destroy(scanner);
-  free(buffer);
 
-  printf("parse ok\n");
+  return ast;
+}
+
+// resolves names and verifies types, with `verify_threads` more threads;
+// errors go to `out`
+static bool check_ast(tsg_ast_t* ast, int verify_threads, FILE* out) {
+  tsg_errlist_t errors;
 
   tsg_resolver_t* resolver = tsg_resolver_create();
-  if (tsg_resolver_resolve(resolver, ast) == false) {
+  bool ok = tsg_resolver_resolve(resolver, ast);
+  if (ok == false) {
     tsg_resolver_error(resolver, &errors);
-    print_errors(&errors);
+    print_errors(out, &errors);
+  } else {
+    tsg_verifier_t* verifier = tsg_verifier_create();
+    tsg_verifier_set_threads(verifier, (int32_t)verify_threads);
+    ok = tsg_verifier_verify(verifier, ast);
+    if (ok == false) {
+      tsg_verifier_error(verifier, &errors);
+      print_errors(out, &errors);
+    }
+    tsg_verifier_destroy(verifier);
+  }
+
+  tsg_resolver_destroy(resolver);
+
+  return ok;
+}
+
+static void print_stats(tsg_engine_t* engine) {
+  tsg_engine_stats_t stats;
+  tsg_engine_get_stats(engine, &stats);
+  fprintf(stderr, "cache: %" PRIu64 " hits, %" PRIu64 " misses, %.3f ms\n",
+          stats.cache_hits, stats.cache_misses, stats.cache_load_ms);
+  fprintf(stderr, "memo: %" PRIu64 " hits, %" PRIu64 " misses\n",
+          stats.memo_hits, stats.memo_misses);
+}
+
+#define MAX_CALLS 16
+#define MAX_CALL_ARGS 16
+
+// `--call=name(1, true)` calls a top-level function of a loaded program
+static bool call_function(tsg_program_t* program, const char* spec) {
+  const char* open = strchr(spec, '(');
+  if (open == NULL || open == spec) {
+    fprintf(stderr, "bad call: %s\n", spec);
+    return false;
+  }
+
+  char name[256];
+  size_t name_len = (size_t)(open - spec);
+  if (name_len >= sizeof(name)) {
+    fprintf(stderr, "bad call: %s\n", spec);
+    return false;
+  }
+  memcpy(name, spec, name_len);
+  name[name_len] = '\0';
+
+  tsg_value_kind_t kinds[MAX_CALL_ARGS];
+  tsg_value_t args[MAX_CALL_ARGS];
+  size_t n_args = 0;
+
+  const char* p = open + 1;
+  while (*p != ')') {
+    while (*p == ' ') {
+      p++;
+    }
+    if (*p == ')') {
+      break;
+    }
+    if (n_args == MAX_CALL_ARGS || *p == '\0') {
+      fprintf(stderr, "bad call: %s\n", spec);
+      return false;
+    }
+
+    tsg_value_t* arg = &(args[n_args]);
+    if (strncmp(p, "true", 4) == 0) {
+      arg->kind = TSG_VALUE_BOOL;
+      arg->b = true;
+      p += 4;
+    } else if (strncmp(p, "false", 5) == 0) {
+      arg->kind = TSG_VALUE_BOOL;
+      arg->b = false;
+      p += 5;
+    } else {
+      char* end;
+      arg->kind = TSG_VALUE_INT;
+      arg->i = (int32_t)strtol(p, &end, 10);
+      if (end == p) {
+        fprintf(stderr, "bad call: %s\n", spec);
+        return false;
+      }
+      p = end;
+    }
+    kinds[n_args] = arg->kind;
+    n_args++;
+
+    while (*p == ' ') {
+      p++;
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != ')') {
+      fprintf(stderr, "bad call: %s\n", spec);
+      return false;
+    }
+  }
+
+  tsg_function_t* function = tsg_program_function(program, name, kinds, n_args);
+  if (function == NULL) {
+    return false;
+  }
+
+  tsg_value_t ret;
+  if (tsg_function_call(function, args, &ret) == false) {
+    return false;
+  }
+
+  if (ret.kind == TSG_VALUE_BOOL) {
+    printf("%s = %s\n", spec, ret.b ? "true" : "false");
+  } else {
+    printf("%s = %" PRIi32 "\n", spec, ret.i);
+  }
+
+  return true;
+}
+
+typedef struct {
+  tsg_engine_config_t config;
+  const char* emit_obj;
+  const char* emit_exe;
+  const char* pgo_load;
+  const char* pgo_save;
+  int runs;
+  bool stats;
+  const char* calls[MAX_CALLS];
+  int n_calls;
+  const char* manifest;
+  int jobs;
+  int verify_threads;
+  bool check_only;
+  char** paths;
+  int n_paths;
+  const char* serve;
+  const char* connect;
+  int max_programs;
+  int max_requests;
+} options_t;
+
+static bool parse_args(int argc, char** argv, options_t* options) {
+  tsg_engine_config_t* config = &(options->config);
+  tsg_engine_config_init(config);
+  options->emit_obj = NULL;
+  options->emit_exe = NULL;
+  options->pgo_load = NULL;
+  options->pgo_save = NULL;
+  options->runs = 1;
+  options->stats = false;
+  options->n_calls = 0;
+  options->manifest = NULL;
+  options->jobs = 0;
+  options->verify_threads = 0;
+  options->check_only = false;
+  options->paths = (char**)malloc(sizeof(char*) * (size_t)argc);
+  options->n_paths = 0;
+  options->serve = NULL;
+  options->connect = NULL;
+  options->max_programs = 64;
+  options->max_requests = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--emit-obj=", 11) == 0) {
+      options->emit_obj = argv[i] + 11;
+    } else if (strncmp(argv[i], "--emit-exe=", 11) == 0) {
+      options->emit_exe = argv[i] + 11;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      config->lazy = true;
+    } else if (strcmp(argv[i], "--interp") == 0) {
+      config->interp_max_nodes = INT32_MAX;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      config->interp_max_nodes = 0;
+    } else if (strncmp(argv[i], "--tier-threshold=", 17) == 0) {
+      config->tier_threshold = (int32_t)atoi(argv[i] + 17);
+    } else if (strcmp(argv[i], "--tier-sync") == 0) {
+      config->tier_background = false;
+    } else if (strlen(argv[i]) == 3 && strncmp(argv[i], "-O", 2) == 0 &&
+               '0' <= argv[i][2] && argv[i][2] <= '3') {
+      config->opt_level = argv[i][2] - '0';
+    } else if (strncmp(argv[i], "--eval-steps=", 13) == 0) {
+      config->eval_steps = (int32_t)atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--eval-memory=", 14) == 0) {
+      config->eval_memory = (int32_t)atoi(argv[i] + 14);
+    } else if (strncmp(argv[i], "--memo-slots=", 13) == 0) {
+      config->memo_slots = (int32_t)atoi(argv[i] + 13);
+    } else if (strcmp(argv[i], "--pgo-instrument") == 0) {
+      config->pgo_instrument = true;
+    } else if (strncmp(argv[i], "--pgo-warmup=", 13) == 0) {
+      config->pgo_warmup = (int32_t)atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--pgo-load=", 11) == 0) {
+      options->pgo_load = argv[i] + 11;
+    } else if (strncmp(argv[i], "--pgo-save=", 11) == 0) {
+      options->pgo_save = argv[i] + 11;
+    } else if (strncmp(argv[i], "--runs=", 7) == 0) {
+      options->runs = atoi(argv[i] + 7);
+    } else if (strcmp(argv[i], "--dump-ir") == 0) {
+      config->dump_ir = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      config->profile = true;
+    } else if (strncmp(argv[i], "--compile-threads=", 18) == 0) {
+      config->compile_threads = (int32_t)atoi(argv[i] + 18);
+    } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+      config->cache_dir = argv[i] + 12;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      options->stats = true;
+      config->memo_counters = true;
+    } else if (strncmp(argv[i], "--call=", 7) == 0) {
+      if (options->n_calls == MAX_CALLS) {
+        fprintf(stderr, "too many calls\n");
+        return false;
+      }
+      options->calls[options->n_calls++] = argv[i] + 7;
+    } else if (strncmp(argv[i], "--manifest=", 11) == 0) {
+      options->manifest = argv[i] + 11;
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      options->jobs = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--verify-threads=", 17) == 0) {
+      options->verify_threads = atoi(argv[i] + 17);
+    } else if (strcmp(argv[i], "--check") == 0) {
+      options->check_only = true;
+    } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+      options->serve = argv[i] + 8;
+    } else if (strncmp(argv[i], "--connect=", 10) == 0) {
+      options->connect = argv[i] + 10;
+    } else if (strncmp(argv[i], "--max-programs=", 15) == 0) {
+      options->max_programs = atoi(argv[i] + 15);
+    } else if (strncmp(argv[i], "--max-requests=", 15) == 0) {
+      options->max_requests = atoi(argv[i] + 15);
+    } else if (argv[i][0] != '-') {
+      options->paths[options->n_paths++] = argv[i];
+    } else {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Batch mode runs many source files in one process. A pool of worker
+// threads shares one engine, so LLVM and the target are set up only once,
+// and the reports come out in input order.
+
+typedef struct {
+  const char* path;
+  bool ok;
+  int32_t result;
+  double frontend_ms;
+  double engine_ms;
+  // errors of this job, written to a memory stream
+  char* log;
+  size_t log_size;
+} job_t;
+
+typedef struct {
+  tsg_engine_t* engine;
+  int verify_threads;
+  job_t* jobs;
+  size_t n_jobs;
+  size_t next;
+  pthread_mutex_t mutex;
+} batch_t;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static void run_job(tsg_engine_t* engine, int verify_threads, job_t* job) {
+  FILE* log = open_memstream(&(job->log), &(job->log_size));
+  double start = now_ms();
+
+  FILE* fp = fopen(job->path, "rb");
+  if (fp == NULL) {
+    fprintf(log, "cannot open %s\n", job->path);
+    fclose(log);
+    return;
+  }
+
+  uint8_t* buffer;
+  size_t source_size;
+  read_source(fp, &buffer, &source_size);
+  fclose(fp);
+
+  tsg_ast_t* ast = parse_source(buffer, source_size, log);
+  free(buffer);
+
+  if (ast != NULL && check_ast(ast, verify_threads, log)) {
+    double checked = now_ms();
+    job->frontend_ms = checked - start;
+    job->ok = tsg_engine_try_run(engine, ast, &(job->result));
+    job->engine_ms = now_ms() - checked;
+    if (job->ok == false) {
+      fprintf(log, "cannot compile\n");
+    }
+  }
+  tsg_ast_destroy(ast);
+
+  fclose(log);
+}
+
+static void* run_worker(void* arg) {
+  batch_t* batch = (batch_t*)arg;
+
+  while (true) {
+    pthread_mutex_lock(&(batch->mutex));
+    size_t index = batch->next++;
+    pthread_mutex_unlock(&(batch->mutex));
+
+    if (index >= batch->n_jobs) {
+      break;
+    }
+    run_job(batch->engine, batch->verify_threads, &(batch->jobs[index]));
+  }
+
+  return NULL;
+}
+
+// one path per line; empty lines and lines starting with `#` are skipped
+static bool read_manifest(const char* path, char** outbuf,
+                          const char*** outpaths, size_t* n_outpaths) {
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return false;
+  }
+
+  uint8_t* buffer;
+  size_t size;
+  read_source(fp, &buffer, &size);
+  fclose(fp);
+
+  size_t n_lines = 1;
+  for (size_t i = 0; i < size; i++) {
+    if (buffer[i] == '\n') {
+      n_lines++;
+    }
+  }
+
+  const char** paths = (const char**)malloc(sizeof(char*) * n_lines);
+  size_t n_paths = 0;
+  char* line = (char*)buffer;
+  while (line != NULL && *line != '\0') {
+    char* end = strchr(line, '\n');
+    if (end != NULL) {
+      *end = '\0';
+      end++;
+    }
+    if (*line != '\0' && *line != '#') {
+      paths[n_paths++] = line;
+    }
+    line = end;
+  }
+
+  *outbuf = (char*)buffer;
+  *outpaths = paths;
+  *n_outpaths = n_paths;
+
+  return true;
+}
+
+static int run_batch(options_t* options) {
+  char* manifest_buf = NULL;
+  const char** manifest_paths = NULL;
+  size_t n_manifest_paths = 0;
+  if (options->manifest != NULL &&
+      read_manifest(options->manifest, &manifest_buf, &manifest_paths,
+                    &n_manifest_paths) == false) {
+    return 1;
+  }
+
+  batch_t batch;
+  batch.n_jobs = (size_t)options->n_paths + n_manifest_paths;
+  batch.jobs = (job_t*)calloc(batch.n_jobs, sizeof(job_t));
+  batch.next = 0;
+  batch.verify_threads = options->verify_threads;
+  pthread_mutex_init(&(batch.mutex), NULL);
+  for (size_t i = 0; i < batch.n_jobs; i++) {
+    if (i < (size_t)options->n_paths) {
+      batch.jobs[i].path = options->paths[i];
+    } else {
+      batch.jobs[i].path = manifest_paths[i - (size_t)options->n_paths];
+    }
+  }
+
+  batch.engine = tsg_engine_create(&(options->config));
+  if (batch.engine == NULL) {
+    return 1;
+  }
+
+  size_t n_workers = (options->jobs > 0)
+                         ? (size_t)options->jobs
+                         : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_workers > batch.n_jobs) {
+    n_workers = batch.n_jobs;
+  }
+  if (n_workers == 0) {
+    n_workers = 1;
+  }
+
+  double start = now_ms();
+  pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * n_workers);
+  for (size_t i = 0; i < n_workers; i++) {
+    pthread_create(&(workers[i]), NULL, run_worker, &batch);
+  }
+  for (size_t i = 0; i < n_workers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  double elapsed = now_ms() - start;
+
+  size_t n_failed = 0;
+  for (size_t i = 0; i < batch.n_jobs; i++) {
+    job_t* job = &(batch.jobs[i]);
+    if (job->ok) {
+      printf("%s: result = %" PRIi32 " (front end %.3f ms, engine %.3f ms)\n",
+             job->path, job->result, job->frontend_ms, job->engine_ms);
+    } else {
+      printf("%s: failed\n", job->path);
+      fputs(job->log, stdout);
+      n_failed++;
+    }
+    free(job->log);
+  }
+  printf("batch: %zu programs, %zu failed, %zu workers, %.3f ms\n",
+         batch.n_jobs, n_failed, n_workers, elapsed);
+
+  if (options->stats) {
+    print_stats(batch.engine);
+  }
+
+  tsg_engine_destroy(batch.engine);
+  free(workers);
+  pthread_mutex_destroy(&(batch.mutex));
+  free(batch.jobs);
+  free(manifest_paths);
+  free(manifest_buf);
+
+  return (n_failed > 0) ? 1 : 0;
+}
+
+// Server mode keeps a resident process on a Unix socket. A client sends a
+// program and closes its end for writing; the server answers with the
+// result and timings. Compiled programs are kept by source, most recently
+// used first, each in an engine of its own so that evicting one really
+// frees its code. Requests are served by a fixed pool of workers, --jobs
+// of them or one per core; connections past those that wait for a worker
+// are left in the listen backlog.
+
+typedef struct entry_s entry_t;
+
+struct entry_s {
+  uint64_t hash;
+  uint8_t* source;
+  size_t source_size;
+  tsg_engine_t* engine;
+  tsg_ast_t* ast;
+  tsg_program_t* program;
+  // the cache holds one reference, each running request another
+  int32_t nrefs;
+  entry_t* prev;
+  entry_t* next;
+};
+
+typedef struct {
+  tsg_engine_config_t config;
+  int verify_threads;
+  int max_programs;
+  pthread_mutex_t mutex;
+  entry_t* head;
+  entry_t* tail;
+  int n_programs;
+  // accepted connections, a ring of `max_pending` fds
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t queue_cond;
+  int* pending;
+  int max_pending;
+  int first_pending;
+  int n_pending;
+  bool closing;
+} server_t;
+
+// FNV-1a
+static uint64_t hash_source(const uint8_t* source, size_t size) {
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= source[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static void destroy_entry(entry_t* entry) {
+  tsg_program_destroy(entry->program);
+  tsg_engine_destroy(entry->engine);
+  tsg_ast_destroy(entry->ast);
+  free(entry->source);
+  free(entry);
+}
+
+static void unlink_entry(server_t* server, entry_t* entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    server->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    server->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void push_entry(server_t* server, entry_t* entry) {
+  entry->next = server->head;
+  if (server->head) {
+    server->head->prev = entry;
+  } else {
+    server->tail = entry;
+  }
+  server->head = entry;
+}
+
+// the caller holds the mutex; returns whether the entry must be destroyed
+static bool release_locked(entry_t* entry) {
+  entry->nrefs -= 1;
+  return entry->nrefs == 0;
+}
+
+static void release_entry(server_t* server, entry_t* entry) {
+  pthread_mutex_lock(&(server->mutex));
+  bool unused = release_locked(entry);
+  pthread_mutex_unlock(&(server->mutex));
+
+  if (unused) {
+    destroy_entry(entry);
+  }
+}
+
+static entry_t* find_entry(server_t* server, uint64_t hash,
+                           const uint8_t* source, size_t size) {
+  pthread_mutex_lock(&(server->mutex));
+
+  entry_t* entry = server->head;
+  while (entry != NULL) {
+    if (entry->hash == hash && entry->source_size == size &&
+        memcmp(entry->source, source, size) == 0) {
+      break;
+    }
+    entry = entry->next;
+  }
+
+  if (entry != NULL) {
+    unlink_entry(server, entry);
+    push_entry(server, entry);
+    entry->nrefs += 1;
+  }
+
+  pthread_mutex_unlock(&(server->mutex));
+  return entry;
+}
+
+// adds a compiled entry, unless another request got there first, and
+// evicts the least recently used ones beyond the limit
+static entry_t* insert_entry(server_t* server, entry_t* entry) {
+  entry_t* found = find_entry(server, entry->hash, entry->source,
+                              entry->source_size);
+  if (found != NULL) {
+    destroy_entry(entry);
+    return found;
+  }
+
+  entry_t* evicted = NULL;
+  pthread_mutex_lock(&(server->mutex));
+  push_entry(server, entry);
+  entry->nrefs = 2;
+  server->n_programs += 1;
+  while (server->n_programs > server->max_programs) {
+    entry_t* victim = server->tail;
+    unlink_entry(server, victim);
+    server->n_programs -= 1;
+    if (release_locked(victim)) {
+      victim->next = evicted;
+      evicted = victim;
+    }
+  }
+  pthread_mutex_unlock(&(server->mutex));
+
+  while (evicted != NULL) {
+    entry_t* next = evicted->next;
+    destroy_entry(evicted);
+    evicted = next;
+  }
+
+  return entry;
+}
+
+static entry_t* compile_entry(server_t* server, uint8_t* source, size_t size,
+                              FILE* log) {
+  tsg_ast_t* ast = parse_source(source, size, log);
+  if (ast == NULL) {
+    return NULL;
+  }
+  if (check_ast(ast, server->verify_threads, log) == false) {
+    tsg_ast_destroy(ast);
+    return NULL;
+  }
+
+  tsg_engine_t* engine = tsg_engine_create(&(server->config));
+  if (engine == NULL) {
+    fprintf(log, "cannot create an engine\n");
+    tsg_ast_destroy(ast);
+    return NULL;
+  }
+
+  tsg_program_t* program = tsg_engine_compile(engine, ast);
+  if (program == NULL) {
+    fprintf(log, "cannot compile\n");
+    tsg_engine_destroy(engine);
+    tsg_ast_destroy(ast);
+    return NULL;
+  }
+
+  entry_t* entry = (entry_t*)calloc(1, sizeof(entry_t));
+  entry->hash = hash_source(source, size);
+  entry->source = source;
+  entry->source_size = size;
+  entry->engine = engine;
+  entry->ast = ast;
+  entry->program = program;
+
+  return entry;
+}
+
+static bool read_all(int fd, uint8_t** outbuf, size_t* outsize) {
+  size_t size = 0;
+  size_t capacity = 4096;
+  uint8_t* buffer = (uint8_t*)malloc(capacity + 1);
+
+  while (true) {
+    ssize_t n = read(fd, buffer + size, capacity - size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      free(buffer);
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+
+    size += (size_t)n;
+    if (size == capacity) {
+      capacity *= 2;
+      buffer = realloc(buffer, capacity + 1);
+    }
+  }
+  buffer[size] = '\0';
+
+  *outbuf = buffer;
+  *outsize = size;
+
+  return true;
+}
+
+static void serve_request(server_t* server, int fd) {
+  uint8_t* source;
+  size_t size;
+  if (read_all(fd, &source, &size) == false) {
+    return;
+  }
+
+  double start = now_ms();
+  entry_t* entry = find_entry(server, hash_source(source, size), source, size);
+  bool cached = (entry != NULL);
+
+  if (cached) {
+    free(source);
+  } else {
+    char* log_buf = NULL;
+    size_t log_size = 0;
+    FILE* log = open_memstream(&log_buf, &log_size);
+    entry = compile_entry(server, source, size, log);
+    fclose(log);
+
+    if (entry == NULL) {
+      dprintf(fd, "%s", log_buf);
+      free(log_buf);
+      free(source);
+      return;
+    }
+    free(log_buf);
+    entry = insert_entry(server, entry);
+  }
+
+  double compiled = now_ms();
+  int32_t result = tsg_program_run(entry->program);
+  double done = now_ms();
+  release_entry(server, entry);
+
+  dprintf(fd, "result = %" PRIi32 "\n%s: compile %.3f ms, run %.3f ms\n",
+          result, cached ? "cached" : "compiled", compiled - start,
+          done - compiled);
+}
+
+// waits while the queue is full
+static void push_request(server_t* server, int fd) {
+  pthread_mutex_lock(&(server->queue_mutex));
+  while (server->n_pending == server->max_pending) {
+    pthread_cond_wait(&(server->queue_cond), &(server->queue_mutex));
+  }
+  int index = (server->first_pending + server->n_pending) % server->max_pending;
+  server->pending[index] = fd;
+  server->n_pending += 1;
+  pthread_cond_broadcast(&(server->queue_cond));
+  pthread_mutex_unlock(&(server->queue_mutex));
+}
+
+// -1 once the server is closing and nothing is left
+static int pop_request(server_t* server) {
+  pthread_mutex_lock(&(server->queue_mutex));
+  while (server->n_pending == 0 && !server->closing) {
+    pthread_cond_wait(&(server->queue_cond), &(server->queue_mutex));
+  }
+
+  int fd = -1;
+  if (server->n_pending > 0) {
+    fd = server->pending[server->first_pending];
+    server->first_pending = (server->first_pending + 1) % server->max_pending;
+    server->n_pending -= 1;
+    pthread_cond_broadcast(&(server->queue_cond));
+  }
+  pthread_mutex_unlock(&(server->queue_mutex));
+
+  return fd;
+}
+
+static void* run_server_worker(void* arg) {
+  server_t* server = (server_t*)arg;
+
+  while (true) {
+    int fd = pop_request(server);
+    if (fd < 0) {
+      break;
+    }
+    serve_request(server, fd);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+static bool make_address(const char* path, struct sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+static int run_server(options_t* options) {
+  struct sockaddr_un address;
+  if (make_address(options->serve, &address) == false) {
+    return 1;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(options->serve);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(listener, 64) < 0) {
+    fprintf(stderr, "%s: %s\n", options->serve, strerror(errno));
     return 1;
   }
 
-  tsg_verifier_t* verifier = tsg_verifier_create();
-  if (tsg_verifier_verify(verifier, ast) == false) {
-    tsg_verifier_error(verifier, &errors);
-    print_errors(&errors);
+  server_t server;
+  server.config = options->config;
+  server.verify_threads = options->verify_threads;
+  server.max_programs = (options->max_programs > 0) ? options->max_programs : 1;
+  pthread_mutex_init(&(server.mutex), NULL);
+  server.head = NULL;
+  server.tail = NULL;
+  server.n_programs = 0;
+
+  int n_workers = (options->jobs > 0) ? options->jobs
+                                      : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_workers < 1) {
+    n_workers = 1;
+  }
+  pthread_mutex_init(&(server.queue_mutex), NULL);
+  pthread_cond_init(&(server.queue_cond), NULL);
+  server.max_pending = n_workers;
+  server.pending = (int*)malloc(sizeof(int) * (size_t)server.max_pending);
+  server.first_pending = 0;
+  server.n_pending = 0;
+  server.closing = false;
+
+  pthread_t* workers =
+      (pthread_t*)malloc(sizeof(pthread_t) * (size_t)n_workers);
+  for (int i = 0; i < n_workers; i++) {
+    pthread_create(&(workers[i]), NULL, run_server_worker, &server);
+  }
+
+  // with --max-requests=N, serve N requests and exit
+  int n_requests = 0;
+  while (options->max_requests == 0 || n_requests < options->max_requests) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "%s: %s\n", options->serve, strerror(errno));
+      break;
+    }
+
+    push_request(&server, fd);
+    n_requests++;
+  }
+
+  pthread_mutex_lock(&(server.queue_mutex));
+  server.closing = true;
+  pthread_cond_broadcast(&(server.queue_cond));
+  pthread_mutex_unlock(&(server.queue_mutex));
+
+  for (int i = 0; i < n_workers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  free(server.pending);
+  pthread_cond_destroy(&(server.queue_cond));
+  pthread_mutex_destroy(&(server.queue_mutex));
+
+  close(listener);
+  unlink(options->serve);
+
+  while (server.head != NULL) {
+    entry_t* entry = server.head;
+    unlink_entry(&server, entry);
+    destroy_entry(entry);
+  }
+  pthread_mutex_destroy(&(server.mutex));
+
+  return 0;
+}
+
+static int run_client(options_t* options) {
+  struct sockaddr_un address;
+  if (make_address(options->connect, &address) == false) {
+    return 1;
+  }
+
+  // the server may still be starting; give it a second
+  int fd = -1;
+  int error = 0;
+  for (int attempt = 0; attempt < 100; attempt++) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+      break;
+    }
+    error = errno;
+    close(fd);
+    fd = -1;
+    if (error != ENOENT && error != ECONNREFUSED) {
+      break;
+    }
+    struct timespec delay = {0, 10000000};
+    nanosleep(&delay, NULL);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", options->connect, strerror(error));
+    return 1;
+  }
+
+  uint8_t* buffer;
+  size_t source_size;
+  read_source(stdin, &buffer, &source_size);
+
+  size_t written = 0;
+  while (written < source_size) {
+    ssize_t n = write(fd, buffer + written, source_size - written);
+    if (n < 0) {
+      fprintf(stderr, "%s: %s\n", options->connect, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    written += (size_t)n;
+  }
+  free(buffer);
+  shutdown(fd, SHUT_WR);
+
+  uint8_t* reply;
+  size_t reply_size;
+  if (read_all(fd, &reply, &reply_size) == false) {
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  fwrite(reply, 1, reply_size, stdout);
+  bool ok = (strncmp((char*)reply, "result = ", 9) == 0);
+  free(reply);
+
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+  options_t options;
+  if (parse_args(argc, argv, &options) == false) {
+    return 1;
+  }
+
+  if (options.serve) {
+    return run_server(&options);
+  }
+  if (options.connect) {
+    return run_client(&options);
+  }
+  if (options.n_paths > 0 || options.manifest) {
+    return run_batch(&options);
+  }
+
+  uint8_t* buffer;
+  size_t source_size;
+  read_source(stdin, &buffer, &source_size);
+
+  tsg_ast_t* ast = parse_source(buffer, source_size, stderr);
+  free(buffer);
+  if (ast == NULL) {
+    return 1;
+  }
+
+  printf("parse ok\n");
+
+  if (check_ast(ast, options.verify_threads, stderr) == false) {
+    tsg_ast_destroy(ast);
     return 1;
   }
   printf("syntax ok\n");
 
-  tsg_verifier_destroy(verifier);
-  tsg_resolver_destroy(resolver);
+  // --check stops once the program is known to be well typed
+  if (options.check_only) {
+    tsg_ast_destroy(ast);
+    return 0;
+  }
 
-  printf("engine start\n");
-  int32_t ret = tsg_engine_run_ast(ast);
-  printf("result = %" PRIi32 "\n", ret);
+  if (options.emit_obj || options.emit_exe) {
+    bool ok = true;
+    if (options.emit_obj) {
+      ok = ok &&
+           tsg_engine_emit_object(ast, options.emit_obj, options.pgo_load);
+    }
+    if (options.emit_exe) {
+      ok = ok && tsg_engine_emit_executable(ast, options.emit_exe,
+                                            options.pgo_load);
+    }
+    if (!ok) {
+      return 1;
+    }
+    printf("emit ok\n");
+  } else {
+    printf("engine start\n");
+    tsg_engine_t* engine = tsg_engine_create(&(options.config));
+    if (engine == NULL) {
+      return 1;
+    }
+    if (options.pgo_load &&
+        tsg_engine_load_profile(engine, options.pgo_load) == false) {
+      tsg_engine_destroy(engine);
+      return 1;
+    }
+    if (options.n_calls > 0) {
+      tsg_program_t* program = tsg_engine_load(engine, ast);
+      printf("result = %" PRIi32 "\n", tsg_program_result(program));
+      for (int i = 0; i < options.n_calls; i++) {
+        if (call_function(program, options.calls[i]) == false) {
+          printf("call failed: %s\n", options.calls[i]);
+        }
+      }
+      tsg_program_destroy(program);
+    } else if (options.runs > 1) {
+      // compiled once, so that the runs can warm it up
+      tsg_program_t* program = tsg_engine_compile(engine, ast);
+      int32_t ret = -1;
+      for (int i = 0; program != NULL && i < options.runs; i++) {
+        ret = tsg_program_run(program);
+      }
+      printf("result = %" PRIi32 "\n", ret);
+      if (program != NULL) {
+        tsg_program_destroy(program);
+      }
+    } else {
+      int32_t ret = tsg_engine_run(engine, ast);
+      printf("result = %" PRIi32 "\n", ret);
+    }
+    if (options.stats) {
+      print_stats(engine);
+    }
+    if (options.pgo_save &&
+        tsg_engine_save_profile(engine, options.pgo_save) == false) {
+      tsg_engine_destroy(engine);
+      return 1;
+    }
+    tsg_engine_destroy(engine);
+  }
 
   tsg_ast_destroy(ast);
   printf("finalize ok\n");
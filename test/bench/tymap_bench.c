@@ -0,0 +1,76 @@
+/*--------------------------------------- vi: set ft=c ts=2 sw=2 et: --*-c-*--*/
+/**
+ * @file tymap_bench.c
+ *
+ ** --------------------------------------------------------------------------*/
+
+#include <tsugu/core/memory.h>
+#include <tsugu/core/tymap.h>
+#include <stdio.h>
+#include <time.h>
+
+#define N_PARAMS 16
+#define N_LOOKUPS (1 << 22)
+
+static tsg_type_arr_t* create_key(tsg_type_t* types[2], size_t n) {
+  tsg_type_arr_t* key = tsg_type_arr_create(N_PARAMS);
+
+  // each instance takes its own combination of ints and bools
+  for (size_t i = 0; i < N_PARAMS; i++) {
+    key->elem[i] = types[(n >> i) & 1];
+  }
+
+  return key;
+}
+
+// Times tsg_tymap_get against a tymap with `n_instances` instances, as a
+// heavily polymorphic function would have. The time per lookup should stay
+// about the same from the smallest map to the largest.
+static double time_lookups(tsg_type_t* types[2], tsg_tyset_t* tyset,
+                           size_t n_instances) {
+  tsg_tymap_t* tymap = tsg_tymap_create();
+  tsg_type_arr_t** keys = tsg_malloc_arr(tsg_type_arr_t*, n_instances);
+  for (size_t i = 0; i < n_instances; i++) {
+    keys[i] = create_key(types, i);
+    tsg_tymap_add(tymap, keys[i], tsg_tyenv_create(tyset, NULL));
+  }
+
+  size_t found = 0;
+  clock_t start = clock();
+  for (size_t i = 0; i < N_LOOKUPS; i++) {
+    if (tsg_tymap_get(tymap, keys[i % n_instances]) != NULL) {
+      found++;
+    }
+  }
+  clock_t stop = clock();
+
+  if (found != N_LOOKUPS) {
+    fprintf(stderr, "lookup failed\n");
+  }
+
+  for (size_t i = 0; i < n_instances; i++) {
+    tsg_type_arr_destroy(keys[i]);
+  }
+  tsg_free(keys);
+  tsg_tymap_destroy(tymap);
+
+  return (double)(stop - start) / CLOCKS_PER_SEC * 1e9 / N_LOOKUPS;
+}
+
+int main(void) {
+  tsg_typetbl_t* typetbl = tsg_typetbl_create();
+  tsg_type_t* types[2];
+  types[0] = tsg_typetbl_prim(typetbl, TSG_TYPE_BOOL);
+  types[1] = tsg_typetbl_prim(typetbl, TSG_TYPE_INT);
+  tsg_tyset_t* tyset = tsg_tyset_create(NULL);
+
+  printf("%10s %14s\n", "instances", "ns per lookup");
+  for (size_t n = 16; n <= ((size_t)1 << N_PARAMS); n *= 4) {
+    printf("%10zu %14.1f\n", n, time_lookups(types, tyset, n));
+  }
+
+  tsg_tyset_destroy(tyset);
+  tsg_typetbl_destroy(typetbl);
+
+  return 0;
+}